@@ -46,3 +46,42 @@ void seedy_drive_stop(void);
 void seedy_isr_cdrom(void);
 void seedy_init_cdrom(void);
 
+//
+// File index generated by pscd-new (lbt= in the manifest)
+//
+// "LBT1" u32:count, then count entries. Looking a file up here saves
+// walking the PVD, path table and directories on the disc.
+//
+#define SEEDY_LBT_MAGIC 0x3154424C // "LBT1"
+
+#define SEEDY_LBT_DAT 0 // 0x800-byte sectors, size in bytes
+#define SEEDY_LBT_RAW 1 // raw XA/STR sectors, size in 0x930-byte source bytes
+
+typedef struct seedy_lbt_entry {
+	char name[23]; // path on the disc, e.g. "DATA/TEX.BIN"
+	uint8_t mode;
+	uint32_t lba;
+	uint32_t size;
+} __attribute__((__packed__)) seedy_lbt_entry_t;
+
+const seedy_lbt_entry_t *seedy_lbt_find(const void *table, const char *name);
+
+//
+// Overlay table written by elf2psx -O (OVERLAYS.TBL)
+//
+// "OVL1" u32:count, then count entries, padded to whole sectors.
+// Read <NAME>.OVL to addr, clear memsz-size bytes after it, flush the
+// I-cache and call entry.
+//
+#define SEEDY_OVL_MAGIC 0x314C564F // "OVL1"
+
+typedef struct seedy_ovl_entry {
+	char name[16];
+	uint32_t addr;
+	uint32_t size;
+	uint32_t memsz;
+	uint32_t entry;
+} __attribute__((__packed__)) seedy_ovl_entry_t;
+
+const seedy_ovl_entry_t *seedy_ovl_find(const void *table, const char *name);
+
@@ -467,6 +467,44 @@ int seedy_read_data_sync(int lba, int flags, uint8_t *buffer, int size)
 	}
 }
 
+//
+// Generated file index
+//
+
+const seedy_lbt_entry_t *seedy_lbt_find(const void *table, const char *name)
+{
+	const uint32_t *hdr = table;
+	if(hdr[0] != SEEDY_LBT_MAGIC) {
+		return NULL;
+	}
+
+	const seedy_lbt_entry_t *ent = (const seedy_lbt_entry_t *)(hdr+2);
+	for(uint32_t i = 0; i < hdr[1]; i++, ent++) {
+		if(!strncmp(ent->name, name, sizeof(ent->name))) {
+			return ent;
+		}
+	}
+
+	return NULL;
+}
+
+const seedy_ovl_entry_t *seedy_ovl_find(const void *table, const char *name)
+{
+	const uint32_t *hdr = table;
+	if(hdr[0] != SEEDY_OVL_MAGIC) {
+		return NULL;
+	}
+
+	const seedy_ovl_entry_t *ent = (const seedy_ovl_entry_t *)(hdr+2);
+	for(uint32_t i = 0; i < hdr[1]; i++, ent++) {
+		if(!strncmp(ent->name, name, sizeof(ent->name))) {
+			return ent;
+		}
+	}
+
+	return NULL;
+}
+
 //
 // Initialisation
 //
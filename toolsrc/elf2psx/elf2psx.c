@@ -27,6 +27,7 @@ freely, subject to the following restrictions:
 3. This notice may not be removed or altered from any source distribution.
 */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
@@ -34,6 +35,9 @@ freely, subject to the following restrictions:
 #include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 typedef enum region {
 	REGION_NTSC_JAPAN,
@@ -77,6 +81,42 @@ typedef struct elf_program_header {
 } __attribute__((__packed__)) elf_program_header_t;
 #define PT_LOAD 0x00000001
 
+typedef struct elf_section_header {
+	uint32_t name;
+	uint32_t type;
+	uint32_t flags;
+	uint32_t addr;
+	uint32_t offset;
+	uint32_t size;
+	uint32_t link;
+	uint32_t info;
+	uint32_t addralign;
+	uint32_t entsize;
+} __attribute__((__packed__)) elf_section_header_t;
+#define SHT_SYMTAB 0x00000002
+#define SHT_NOBITS 0x00000008
+
+typedef struct elf_symbol {
+	uint32_t name;
+	uint32_t value;
+	uint32_t size;
+	uint8_t info;
+	uint8_t other;
+	uint16_t shndx;
+} __attribute__((__packed__)) elf_symbol_t;
+
+// Overlay table, see seedy_ovl_entry_t in include/seedy.h
+#define OVL_MAGIC 0x314C564F // "OVL1"
+#define OVL_NAME_LEN 16
+
+typedef struct ovl_entry {
+	char name[OVL_NAME_LEN];
+	uint32_t addr;
+	uint32_t size;
+	uint32_t memsz;
+	uint32_t entry;
+} __attribute__((__packed__)) ovl_entry_t;
+
 typedef struct psx_header {
 	uint8_t magic[8];
 	uint8_t _pad1[8];
@@ -93,6 +133,738 @@ typedef struct psx_header {
 	uint8_t ascii_marker[0x800-0x4C];
 } __attribute__((__packed__)) psx_header_t;
 
+//
+// LZSS compression (-z)
+//
+// The stream is a series of groups: one flag byte, read LSB first, followed
+// by up to 8 tokens. A set bit is a literal byte. A clear bit is a 16-bit
+// little-endian match word ((len-3)<<12)|(dist-1), copied byte by byte so
+// overlapping matches work. There is no terminator; the stub stops once it
+// has written the whole image.
+//
+#define LZ_WINDOW 4096
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH 18
+#define LZ_HASH_BITS 14
+#define LZ_MAX_CHAIN 256
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+	return ((p[0]<<10)^(p[1]<<5)^p[2]) & ((1<<LZ_HASH_BITS)-1);
+}
+
+// Returns the compressed length. dst must hold at least len + len/8 + 1 bytes.
+size_t compress_lzss(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	int32_t *head = malloc(sizeof(int32_t)<<LZ_HASH_BITS);
+	int32_t *prev = malloc(sizeof(int32_t)*(len > 0 ? len : 1));
+	size_t pos = 0;
+	size_t outpos = 0;
+	size_t flagpos = 0;
+	int flagbit = 8;
+	assert(head != NULL && prev != NULL);
+
+	for(size_t i = 0; i < (1<<LZ_HASH_BITS); i++) {
+		head[i] = -1;
+	}
+
+	while(pos < len) {
+		size_t best_len = 0;
+		size_t best_dist = 0;
+
+		if(flagbit == 8) {
+			flagpos = outpos++;
+			dst[flagpos] = 0;
+			flagbit = 0;
+		}
+
+		if(pos + LZ_MIN_MATCH <= len) {
+			size_t max_len = len - pos;
+			int32_t cand = head[lz_hash(&src[pos])];
+			int chain = LZ_MAX_CHAIN;
+			if(max_len > LZ_MAX_MATCH) {
+				max_len = LZ_MAX_MATCH;
+			}
+			while(cand >= 0 && pos - (size_t)cand <= LZ_WINDOW && chain-- > 0) {
+				size_t l = 0;
+				while(l < max_len && src[cand+l] == src[pos+l]) {
+					l++;
+				}
+				if(l > best_len) {
+					best_len = l;
+					best_dist = pos - (size_t)cand;
+					if(l == max_len) {
+						break;
+					}
+				}
+				cand = prev[cand];
+			}
+		}
+
+		if(best_len >= LZ_MIN_MATCH) {
+			uint16_t word = ((best_len-LZ_MIN_MATCH)<<12) | (best_dist-1);
+			dst[outpos++] = word & 0xFF;
+			dst[outpos++] = word >> 8;
+		} else {
+			best_len = 1;
+			dst[flagpos] |= 1<<flagbit;
+			dst[outpos++] = src[pos];
+		}
+		flagbit++;
+
+		// Insert every position we step over into the hash chains
+		for(size_t end = pos + best_len; pos < end; pos++) {
+			if(pos + LZ_MIN_MATCH <= len) {
+				uint32_t h = lz_hash(&src[pos]);
+				prev[pos] = head[h];
+				head[h] = pos;
+			}
+		}
+	}
+
+	free(prev);
+	free(head);
+	return outpos;
+}
+
+// Host-side reference of what the MIPS stub does.
+// Returns false if the stream is truncated or refers outside the output.
+bool decompress_lzss(uint8_t *dst, size_t dst_len, const uint8_t *src, size_t src_len)
+{
+	size_t inpos = 0;
+	size_t outpos = 0;
+	uint8_t flags = 0;
+	int flagbits = 0;
+
+	while(outpos < dst_len) {
+		if(flagbits == 0) {
+			if(inpos >= src_len) {
+				return false;
+			}
+			flags = src[inpos++];
+			flagbits = 8;
+		}
+		flagbits--;
+		if(flags & 1) {
+			if(inpos >= src_len) {
+				return false;
+			}
+			dst[outpos++] = src[inpos++];
+		} else {
+			if(inpos + 2 > src_len) {
+				return false;
+			}
+			uint16_t word = src[inpos] | (src[inpos+1]<<8);
+			size_t dist = (word & 0xFFF) + 1;
+			size_t l = (word >> 12) + LZ_MIN_MATCH;
+			inpos += 2;
+			if(dist > outpos || outpos + l > dst_len) {
+				return false;
+			}
+			for(; l > 0; l--, outpos++) {
+				dst[outpos] = dst[outpos-dist];
+			}
+		}
+		flags >>= 1;
+	}
+
+	return true;
+}
+
+//
+// LZSS self-test (-T, run by "make test")
+//
+// Round-trips buffers chosen to hit the edges of the format through
+// compress_lzss and decompress_lzss, and checks the longest match and
+// the furthest distance the compressor actually emitted.
+//
+static uint32_t lz_test_seed;
+
+static uint8_t lz_test_random(void)
+{
+	lz_test_seed = lz_test_seed*1664525 + 1013904223;
+	return lz_test_seed >> 24;
+}
+
+// Walks a stream for its longest match and furthest distance
+static void lz_test_scan(const uint8_t *src, size_t src_len, size_t dst_len, size_t *max_len, size_t *max_dist)
+{
+	size_t inpos = 0;
+	size_t outpos = 0;
+	uint8_t flags = 0;
+	int flagbits = 0;
+
+	*max_len = 0;
+	*max_dist = 0;
+	while(outpos < dst_len && inpos < src_len) {
+		if(flagbits == 0) {
+			flags = src[inpos++];
+			flagbits = 8;
+		}
+		flagbits--;
+		if(flags & 1) {
+			inpos++;
+			outpos++;
+		} else {
+			uint16_t word = src[inpos] | (src[inpos+1]<<8);
+			size_t dist = (word & 0xFFF) + 1;
+			size_t l = (word >> 12) + LZ_MIN_MATCH;
+			inpos += 2;
+			outpos += l;
+			if(l > *max_len) { *max_len = l; }
+			if(dist > *max_dist) { *max_dist = dist; }
+		}
+		flags >>= 1;
+	}
+}
+
+// Returns false and says why if data doesn't round-trip or a bound is missed.
+// want_len/want_dist of 0 skip that check.
+static bool lz_test_case(const char *name, const uint8_t *data, size_t len, size_t want_len, size_t want_dist)
+{
+	size_t bound = len + len/8 + 1;
+	uint8_t *packed = malloc(bound);
+	uint8_t *unpacked = malloc(len > 0 ? len : 1);
+	size_t packed_len, max_len, max_dist;
+	bool ok = false;
+	assert(packed != NULL && unpacked != NULL);
+
+	packed_len = compress_lzss(packed, data, len);
+	lz_test_scan(packed, packed_len, len, &max_len, &max_dist);
+	if(packed_len > bound) {
+		fprintf(stderr, "FAIL %s: %zu bytes packed to %zu, over the %zu bound\n", name, len, packed_len, bound);
+	} else if(!decompress_lzss(unpacked, len, packed, packed_len) || memcmp(unpacked, data, len)) {
+		fprintf(stderr, "FAIL %s: does not round-trip\n", name);
+	} else if(len > 0 && decompress_lzss(unpacked, len, packed, packed_len-1)) {
+		fprintf(stderr, "FAIL %s: truncated stream was accepted\n", name);
+	} else if(max_dist > LZ_WINDOW) {
+		fprintf(stderr, "FAIL %s: match distance %zu is outside the window\n", name, max_dist);
+	} else if(want_len != 0 && max_len != want_len) {
+		fprintf(stderr, "FAIL %s: longest match %zu, expected %zu\n", name, max_len, want_len);
+	} else if(want_dist != 0 && max_dist != want_dist) {
+		fprintf(stderr, "FAIL %s: furthest match %zu, expected %zu\n", name, max_dist, want_dist);
+	} else {
+		printf("ok %s: %zu -> %zu bytes\n", name, len, packed_len);
+		ok = true;
+	}
+
+	free(unpacked);
+	free(packed);
+	return ok;
+}
+
+int lzss_self_test(void)
+{
+	size_t len = 0x10000;
+	uint8_t *buf = malloc(len);
+	int failures = 0;
+	assert(buf != NULL);
+
+	lz_test_seed = 1;
+	for(size_t i = 0; i < len; i++) {
+		buf[i] = lz_test_random();
+	}
+	failures += !lz_test_case("empty", buf, 0, 0, 0);
+	failures += !lz_test_case("1 byte", buf, 1, 0, 0);
+	failures += !lz_test_case("2 bytes", buf, 2, 0, 0);
+	failures += !lz_test_case("random", buf, len, 0, 0);
+
+	// A random window, then its start again: the only match is exactly
+	// LZ_WINDOW back. One byte further and there must be no match at all.
+	memcpy(buf + LZ_WINDOW, buf, LZ_MAX_MATCH);
+	failures += !lz_test_case("match at window", buf, LZ_WINDOW + LZ_MAX_MATCH, LZ_MAX_MATCH, LZ_WINDOW);
+	memcpy(buf + LZ_WINDOW + 1, buf, LZ_MAX_MATCH);
+	failures += !lz_test_case("match past window", buf, LZ_WINDOW + 1 + LZ_MAX_MATCH, 0, 0);
+
+	// Runs longer than LZ_MAX_MATCH are split into maximum-length matches
+	memset(buf, 0, len);
+	failures += !lz_test_case("all zero", buf, len, LZ_MAX_MATCH, 0);
+	for(size_t i = 0; i < len; i++) {
+		buf[i] = (i % 1000) < 500 ? 0xAA : (uint8_t)i;
+	}
+	failures += !lz_test_case("runs", buf, len, LZ_MAX_MATCH, 0);
+
+	free(buf);
+	if(failures != 0) {
+		fprintf(stderr, "%d LZSS tests failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
+
+//
+// Decompression stub
+//
+// Loaded by the BIOS together with the compressed stream, which directly
+// follows it. It unpacks the image to its link address, flushes the
+// I-cache through A(44h) FlushCache and jumps to the real entry point with
+// ra/a0/a1 as the BIOS left them. Hand-assembled; every load is followed by
+// an instruction that doesn't use its result (R3000 load delay slot).
+//
+enum {
+	R_ZERO = 0, R_A0 = 4, R_A1 = 5,
+	R_T0 = 8, R_T1, R_T2, R_T3, R_T4, R_T5, R_T6, R_T7,
+	R_T9 = 25, R_SP = 29, R_RA = 31,
+};
+
+#define MIPS_I(op, rs, rt, imm) \
+	(((uint32_t)(op)<<26)|((rs)<<21)|((rt)<<16)|((uint32_t)(imm)&0xFFFF))
+#define MIPS_R(rs, rt, rd, sa, fn) \
+	(((rs)<<21)|((rt)<<16)|((rd)<<11)|((sa)<<6)|(fn))
+
+#define ADDIU(rt, rs, imm) MIPS_I(0x09, rs, rt, imm)
+#define ANDI(rt, rs, imm)  MIPS_I(0x0C, rs, rt, imm)
+#define ORI(rt, rs, imm)   MIPS_I(0x0D, rs, rt, imm)
+#define LUI(rt, imm)       MIPS_I(0x0F, 0, rt, imm)
+#define LBU(rt, off, rs)   MIPS_I(0x24, rs, rt, off)
+#define LW(rt, off, rs)    MIPS_I(0x23, rs, rt, off)
+#define SB(rt, off, rs)    MIPS_I(0x28, rs, rt, off)
+#define SW(rt, off, rs)    MIPS_I(0x2B, rs, rt, off)
+#define BEQ(rs, rt, off)   MIPS_I(0x04, rs, rt, off)
+#define BNE(rs, rt, off)   MIPS_I(0x05, rs, rt, off)
+#define SLL(rd, rt, sa)    MIPS_R(0, rt, rd, sa, 0x00)
+#define SRL(rd, rt, sa)    MIPS_R(0, rt, rd, sa, 0x02)
+#define JR(rs)             MIPS_R(rs, 0, 0, 0, 0x08)
+#define JALR(rs)           MIPS_R(rs, 0, R_RA, 0, 0x09)
+#define OR(rd, rs, rt)     MIPS_R(rs, rt, rd, 0, 0x25)
+#define SUBU(rd, rs, rt)   MIPS_R(rs, rt, rd, 0, 0x23)
+#define SLTU(rd, rs, rt)   MIPS_R(rs, rt, rd, 0, 0x2B)
+#define NOP                0x00000000
+
+// Branch offsets are in words, relative to the delay slot
+#define BR(from, to) ((to)-(from)-1)
+
+#define STUB_LOOP 11
+#define STUB_FLAGS 19
+#define STUB_MATCH 28
+#define STUB_COPY 38
+#define STUB_DONE 46
+#define STUB_ENTRY 53
+#define STUB_WORDS 57
+
+static const uint32_t lzss_stub_template[STUB_WORDS] = {
+	/*  0 */ ADDIU(R_SP, R_SP, -16),
+	/*  1 */ SW(R_RA, 0, R_SP),
+	/*  2 */ SW(R_A0, 4, R_SP),
+	/*  3 */ SW(R_A1, 8, R_SP),
+	/*  4 */ LUI(R_T0, 0), // src
+	/*  5 */ ORI(R_T0, R_T0, 0),
+	/*  6 */ LUI(R_T1, 0), // dst
+	/*  7 */ ORI(R_T1, R_T1, 0),
+	/*  8 */ LUI(R_T2, 0), // dst end
+	/*  9 */ ORI(R_T2, R_T2, 0),
+	/* 10 */ ADDIU(R_T4, R_ZERO, 0),
+	// loop:
+	/* 11 */ SLTU(R_T9, R_T1, R_T2),
+	/* 12 */ BEQ(R_T9, R_ZERO, BR(12, STUB_DONE)),
+	/* 13 */ NOP,
+	/* 14 */ BNE(R_T4, R_ZERO, BR(14, STUB_FLAGS)),
+	/* 15 */ NOP,
+	/* 16 */ LBU(R_T3, 0, R_T0),
+	/* 17 */ ADDIU(R_T0, R_T0, 1),
+	/* 18 */ ADDIU(R_T4, R_ZERO, 8),
+	// flags:
+	/* 19 */ ANDI(R_T5, R_T3, 1),
+	/* 20 */ SRL(R_T3, R_T3, 1),
+	/* 21 */ BEQ(R_T5, R_ZERO, BR(21, STUB_MATCH)),
+	/* 22 */ ADDIU(R_T4, R_T4, -1),
+	// literal:
+	/* 23 */ LBU(R_T5, 0, R_T0),
+	/* 24 */ ADDIU(R_T0, R_T0, 1),
+	/* 25 */ SB(R_T5, 0, R_T1),
+	/* 26 */ BEQ(R_ZERO, R_ZERO, BR(26, STUB_LOOP)),
+	/* 27 */ ADDIU(R_T1, R_T1, 1),
+	// match:
+	/* 28 */ LBU(R_T5, 0, R_T0),
+	/* 29 */ LBU(R_T6, 1, R_T0),
+	/* 30 */ ADDIU(R_T0, R_T0, 2),
+	/* 31 */ SLL(R_T6, R_T6, 8),
+	/* 32 */ OR(R_T5, R_T5, R_T6),
+	/* 33 */ ANDI(R_T6, R_T5, 0x0FFF),
+	/* 34 */ SUBU(R_T6, R_T1, R_T6),
+	/* 35 */ ADDIU(R_T6, R_T6, -1),
+	/* 36 */ SRL(R_T5, R_T5, 12),
+	/* 37 */ ADDIU(R_T5, R_T5, LZ_MIN_MATCH),
+	// copy:
+	/* 38 */ LBU(R_T7, 0, R_T6),
+	/* 39 */ ADDIU(R_T6, R_T6, 1),
+	/* 40 */ SB(R_T7, 0, R_T1),
+	/* 41 */ ADDIU(R_T5, R_T5, -1),
+	/* 42 */ BNE(R_T5, R_ZERO, BR(42, STUB_COPY)),
+	/* 43 */ ADDIU(R_T1, R_T1, 1),
+	/* 44 */ BEQ(R_ZERO, R_ZERO, BR(44, STUB_LOOP)),
+	/* 45 */ NOP,
+	// done:
+	/* 46 */ ADDIU(R_T2, R_ZERO, 0xA0),
+	/* 47 */ JALR(R_T2),
+	/* 48 */ ADDIU(R_T1, R_ZERO, 0x44),
+	/* 49 */ LW(R_RA, 0, R_SP),
+	/* 50 */ LW(R_A0, 4, R_SP),
+	/* 51 */ LW(R_A1, 8, R_SP),
+	/* 52 */ ADDIU(R_SP, R_SP, 16),
+	/* 53 */ LUI(R_T0, 0), // entry
+	/* 54 */ ORI(R_T0, R_T0, 0),
+	/* 55 */ JR(R_T0),
+	/* 56 */ NOP,
+};
+
+static void stub_patch_addr(uint32_t *stub, int idx, uint32_t addr)
+{
+	stub[idx+0] |= addr >> 16;
+	stub[idx+1] |= addr & 0xFFFF;
+}
+
+//
+// Overlays (-O)
+//
+// An overlay is a PT_LOAD segment made of sections named .overlay.<name>,
+// usually placed at a shared address by an OVERLAY statement in the linker
+// script. Such segments are left out of the EXE image and written to
+// <dir>/<NAME>.OVL instead, padded to whole sectors. <dir>/OVERLAYS.TBL
+// lists them so the game can read the whole table with one sector read.
+// The entry point is the symbol overlay_<name>_entry if there is one,
+// otherwise the start of the overlay.
+//
+typedef struct overlay {
+	ovl_entry_t ent;
+	int phdr_idx;
+} overlay_t;
+
+static void *read_elf_range(FILE *elf, uint32_t offset, uint32_t len)
+{
+	uint8_t *buf = malloc(len + 1);
+	if(buf == NULL) {
+		perror("malloc(elf range)");
+		return NULL;
+	}
+	buf[len] = 0;
+	if(fseek(elf, offset, SEEK_SET) != 0 || (len > 0 && fread(buf, len, 1, elf) != 1)) {
+		perror("fread(elf range)");
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+// Finds the overlay segments and flags them in is_overlay.
+// Returns the number of overlays, or -1 on error.
+int find_overlays(FILE *elf, const elf_header_t *ehdr,
+	const elf_program_header_t *phdrs, bool *is_overlay, overlay_t **out)
+{
+	elf_section_header_t *shdrs = NULL;
+	char *shstr = NULL;
+	elf_symbol_t *syms = NULL;
+	char *symstr = NULL;
+	uint32_t sym_count = 0;
+	overlay_t *ovls = NULL;
+	int ovl_count = 0;
+	int i, j;
+
+	*out = NULL;
+	if(ehdr->shdr_offs == 0 || ehdr->shdr_ent_count == 0) {
+		return 0;
+	}
+	if(ehdr->shdr_ent_size != sizeof(elf_section_header_t)
+		|| ehdr->strtab_idx >= ehdr->shdr_ent_count) {
+		fprintf(stderr, "unusual SHdr table\n");
+		return -1;
+	}
+
+	shdrs = read_elf_range(elf, ehdr->shdr_offs,
+		sizeof(*shdrs)*ehdr->shdr_ent_count);
+	if(shdrs == NULL) {
+		goto fail;
+	}
+	shstr = read_elf_range(elf, shdrs[ehdr->strtab_idx].offset,
+		shdrs[ehdr->strtab_idx].size);
+	if(shstr == NULL) {
+		goto fail;
+	}
+
+	for(i = 0; i < ehdr->shdr_ent_count; i++) {
+		const elf_section_header_t *sh = &shdrs[i];
+		const char *name;
+		int seg = -1;
+
+		if(sh->name >= shdrs[ehdr->strtab_idx].size) {
+			continue;
+		}
+		if(sh->type == SHT_SYMTAB && sh->link < ehdr->shdr_ent_count && syms == NULL) {
+			syms = read_elf_range(elf, sh->offset, sh->size);
+			symstr = read_elf_range(elf, shdrs[sh->link].offset, shdrs[sh->link].size);
+			if(syms == NULL || symstr == NULL) {
+				goto fail;
+			}
+			sym_count = sh->size / sizeof(elf_symbol_t);
+			continue;
+		}
+
+		name = shstr + sh->name;
+		if(strncmp(name, ".overlay.", 9) || sh->size == 0) {
+			continue;
+		}
+		name += 9;
+
+		// Find the segment this section was placed in
+		for(j = 0; j < ehdr->phdr_ent_count; j++) {
+			const elf_program_header_t *ph = &phdrs[j];
+			if(ph->type != PT_LOAD
+				|| sh->addr < ph->vaddr || sh->addr >= ph->vaddr + ph->memsz) {
+				continue;
+			}
+			if(sh->type == SHT_NOBITS
+				|| (sh->offset >= ph->offset && sh->offset < ph->offset + ph->filesz)) {
+				seg = j;
+				break;
+			}
+		}
+		if(seg < 0) {
+			fprintf(stderr, "overlay section %s isn't in a PT_LOAD segment\n", shstr + sh->name);
+			goto fail;
+		}
+
+		// Sections called .overlay.<name>.<anything> belong to <name>
+		size_t nlen = strcspn(name, ".");
+		if(nlen == 0 || nlen >= OVL_NAME_LEN) {
+			fprintf(stderr, "overlay name in %s must be 1 to %d characters\n",
+				shstr + sh->name, OVL_NAME_LEN-1);
+			goto fail;
+		}
+
+		for(j = 0; j < ovl_count; j++) {
+			if(ovls[j].phdr_idx == seg) {
+				break;
+			}
+		}
+		if(j == ovl_count) {
+			ovls = realloc(ovls, sizeof(*ovls)*(ovl_count+1));
+			assert(ovls != NULL);
+			memset(&ovls[j], 0, sizeof(ovls[j]));
+			ovls[j].phdr_idx = seg;
+			ovls[j].ent.addr = phdrs[seg].vaddr;
+			ovls[j].ent.size = phdrs[seg].filesz;
+			ovls[j].ent.memsz = phdrs[seg].memsz;
+			ovls[j].ent.entry = phdrs[seg].vaddr;
+			for(size_t k = 0; k < nlen; k++) {
+				ovls[j].ent.name[k] = (name[k] >= 'a' && name[k] <= 'z')
+					? name[k] - 'a' + 'A' : name[k];
+			}
+			ovl_count++;
+			is_overlay[seg] = true;
+		} else if(strncasecmp(ovls[j].ent.name, name, nlen) || ovls[j].ent.name[nlen] != 0) {
+			fprintf(stderr, "overlays %s and %.*s share a segment\n",
+				ovls[j].ent.name, (int)nlen, name);
+			goto fail;
+		}
+	}
+
+	// Overlay names must be unique, and entry points come from the symbol table
+	for(i = 0; i < ovl_count; i++) {
+		char symname[OVL_NAME_LEN + 16];
+		for(j = 0; j < i; j++) {
+			if(!strcmp(ovls[i].ent.name, ovls[j].ent.name)) {
+				fprintf(stderr, "overlay %s is split over several segments\n", ovls[i].ent.name);
+				goto fail;
+			}
+		}
+		snprintf(symname, sizeof(symname), "overlay_%s_entry", ovls[i].ent.name);
+		for(uint32_t k = 0; k < sym_count; k++) {
+			if(syms[k].shndx != 0 && !strcasecmp(symstr + syms[k].name, symname)) {
+				ovls[i].ent.entry = syms[k].value;
+				break;
+			}
+		}
+	}
+
+	free(symstr);
+	free(syms);
+	free(shstr);
+	free(shdrs);
+	*out = ovls;
+	return ovl_count;
+
+fail:
+	free(ovls);
+	free(symstr);
+	free(syms);
+	free(shstr);
+	free(shdrs);
+	return -1;
+}
+
+int write_overlays(FILE *elf, const char *dir,
+	const elf_program_header_t *phdrs, const overlay_t *ovls, int ovl_count)
+{
+	char fname[4096];
+	uint32_t tbl_len = (8 + sizeof(ovl_entry_t)*ovl_count + 0x7FF) & ~0x7FF;
+	uint8_t *tbl = calloc(1, tbl_len);
+	FILE *fp;
+	int i;
+
+	assert(tbl != NULL);
+	((uint32_t *)tbl)[0] = OVL_MAGIC;
+	((uint32_t *)tbl)[1] = ovl_count;
+
+	for(i = 0; i < ovl_count; i++) {
+		const elf_program_header_t *ph = &phdrs[ovls[i].phdr_idx];
+		uint32_t padded = (ph->filesz + 0x7FF) & ~0x7FF;
+		uint8_t *data = read_elf_range(elf, ph->offset, ph->filesz);
+
+		memcpy(tbl + 8 + sizeof(ovl_entry_t)*i, &ovls[i].ent, sizeof(ovl_entry_t));
+		printf("Overlay %-15s %08X -> %08X (%08X in memory), entry %08X\n"
+			, ovls[i].ent.name
+			, ph->vaddr
+			, ph->vaddr + ph->filesz
+			, ph->memsz
+			, ovls[i].ent.entry
+		);
+
+		if(data == NULL) {
+			goto fail;
+		}
+		data = realloc(data, padded);
+		assert(data != NULL);
+		memset(data + ph->filesz, 0, padded - ph->filesz);
+
+		snprintf(fname, sizeof(fname), "%s/%s.OVL", dir, ovls[i].ent.name);
+		fp = fopen(fname, "wb");
+		if(fp == NULL || fwrite(data, padded, 1, fp) != 1) {
+			perror(fname);
+			if(fp != NULL) {
+				fclose(fp);
+			}
+			free(data);
+			goto fail;
+		}
+		fclose(fp);
+		free(data);
+	}
+
+	snprintf(fname, sizeof(fname), "%s/OVERLAYS.TBL", dir);
+	fp = fopen(fname, "wb");
+	if(fp == NULL || fwrite(tbl, tbl_len, 1, fp) != 1) {
+		perror(fname);
+		if(fp != NULL) {
+			fclose(fp);
+		}
+		goto fail;
+	}
+	fclose(fp);
+	free(tbl);
+	return 0;
+
+fail:
+	free(tbl);
+	return -1;
+}
+
+//
+// Output
+//
+// The EXE is written in one pass: header, then each segment copied
+// straight from the ELF at its offset in the image. Gaps are never
+// written; the final ftruncate leaves them as holes that read as zero.
+//
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offs)
+{
+	const uint8_t *p = buf;
+	while(len > 0) {
+		ssize_t n = pwrite(fd, p, len, offs);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+		offs += n;
+	}
+	return 0;
+}
+
+static int copy_range(int fd_in, off_t offs_in, int fd_out, off_t offs_out, size_t len)
+{
+	uint8_t buf[0x10000];
+
+	// In-kernel copy (may reflink) where the filesystems allow it
+	while(len > 0) {
+		ssize_t n = copy_file_range(fd_in, &offs_in, fd_out, &offs_out, len, 0);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			break;
+		}
+		len -= n;
+	}
+
+	// Otherwise (or for whatever remains) bounce through a buffer
+	while(len > 0) {
+		size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+		ssize_t n = pread(fd_in, buf, chunk, offs_in);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			if(n == 0) {
+				errno = EIO;
+			}
+			return -1;
+		}
+		if(pwrite_all(fd_out, buf, n, offs_out) != 0) {
+			return -1;
+		}
+		offs_in += n;
+		offs_out += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Prints the resident segments in address order, with the zero gap in
+// front of each and the BSS after it, so it's clear what pads the image.
+void print_segment_map(const elf_program_header_t *phdrs, const int *order,
+	int count, uint32_t ftext, uint32_t edata, uint32_t aedata)
+{
+	uint32_t pos = ftext;
+	uint32_t payload = 0;
+	uint32_t gaps = 0;
+	uint32_t bss = 0;
+	int i;
+
+	printf("Segment map:\n");
+	printf("  seg  vaddr    filesz   memsz    gap      bss\n");
+	for(i = 0; i < count; i++) {
+		const elf_program_header_t *ph = &phdrs[order[i]];
+		uint32_t gap = 0;
+
+		if(ph->filesz > 0) {
+			gap = ph->vaddr > pos ? ph->vaddr - pos : 0;
+			pos = ph->vaddr + ph->filesz;
+			payload += ph->filesz;
+			gaps += gap;
+		}
+		bss += ph->memsz > ph->filesz ? ph->memsz - ph->filesz : 0;
+
+		printf("  %3d  %08X %08X %08X %08X %08X\n"
+			, order[i]
+			, ph->vaddr
+			, ph->filesz
+			, ph->memsz
+			, gap
+			, ph->memsz > ph->filesz ? ph->memsz - ph->filesz : 0
+		);
+	}
+	printf("  payload %08X, gaps %08X, tail padding %08X, BSS %08X (not in image)\n"
+		, payload
+		, gaps
+		, aedata - edata
+		, bss
+	);
+}
+
 void show_usage(const char *arg0)
 {
 	printf(
@@ -101,62 +873,94 @@ void show_usage(const char *arg0)
 		"https://creativecommons.org/publicdomain/zero/1.0/\n"
 		"\n"
 		"usage:\n"
-		"\t%s -pnj infile.elf outfile.exe\n"
+		"\t%s [-z] [-O dir] -pnj infile.elf outfile.exe\n"
 		"\n"
 		"use one of the -p, -n, or -j flags to denote the intended region:\n"
 		"\t-j: NTSC Japan\n"
 		"\t-n: NTSC North America\n"
 		"\t-p: PAL\n"
 		"\n"
+		"other options:\n"
+		"\t-z: compress the image and boot it through a decompression stub\n"
+		"\t-O dir: write .overlay.<name> segments to dir/<NAME>.OVL\n"
+		"\t        and their load table to dir/OVERLAYS.TBL\n"
+		"\n"
 	, arg0);
 }
 
 int main(int argc, char *argv[])
 {
 	int i;
+	int opt;
 	uint32_t addr;
 
-	const char *region_flag_str;
 	const char *fname_elf;
 	const char *fname_psx;
-	region_t region_flag;
+	region_t region_flag = (region_t)-1;
+	bool compress = false;
+	const char *overlay_dir = NULL;
+	bool *is_overlay;
+	overlay_t *ovls = NULL;
+	int ovl_count;
 	elf_header_t ehdr;
 	elf_program_header_t *phdrs;
 	elf_program_header_t *phdr;
 	psx_header_t psxh;
-	uint8_t blank_page[0x800];
-	uint8_t *tmp_copy_buf;
+	uint8_t *image = NULL;
+	int *seg_order;
+	int seg_count;
+	uint8_t *out_data;
+	uint32_t out_len;
+	uint8_t *packed = NULL;
 	FILE *elf;
-	FILE *psx;
+	int psx;
 
 	uint32_t target_ftext;
 	uint32_t target_edata;
 	uint32_t target_aedata;
 
 	// Read arguments
-	if (argc <= 3) {
+	while((opt = getopt(argc, argv, "jnpzO:T")) != -1) {
+		switch(opt) {
+			case 'T':
+				// Not in the usage text; "make test" runs it
+				return lzss_self_test();
+			case 'j':
+				region_flag = REGION_NTSC_JAPAN;
+				break;
+			case 'n':
+				region_flag = REGION_NTSC_NORTH_AMERICA;
+				break;
+			case 'p':
+				region_flag = REGION_PAL;
+				break;
+			case 'z':
+				compress = true;
+				break;
+			case 'O':
+				overlay_dir = optarg;
+				break;
+			default:
+				show_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (argc - optind < 2) {
 		fprintf(stderr, "not enough arguments\n");
 		show_usage(argv[0]);
 		return 1;
 	}
 
-	region_flag_str = argv[1];
-	fname_elf = argv[2];
-	fname_psx = argv[3];
-
-	// Read region flag
-	if(!strcmp(region_flag_str, "-j")) {
-		region_flag = REGION_NTSC_JAPAN;
-	} else if(!strcmp(region_flag_str, "-n")) {
-		region_flag = REGION_NTSC_NORTH_AMERICA;
-	} else if(!strcmp(region_flag_str, "-p")) {
-		region_flag = REGION_PAL;
-	} else {
+	if (region_flag == (region_t)-1) {
 		fprintf(stderr, "invalid region flag\n");
 		show_usage(argv[0]);
 		return 1;
 	}
 
+	fname_elf = argv[optind+0];
+	fname_psx = argv[optind+1];
+
 	// Open source ELF
 	elf = fopen(fname_elf, "rb");
 	if (elf == NULL) {
@@ -223,6 +1027,18 @@ int main(int argc, char *argv[])
 		goto fail_free_phdr_elf;
 	}
 
+	// Pick out the overlay segments
+	is_overlay = calloc(ehdr.phdr_ent_count + 1, sizeof(bool));
+	assert(is_overlay != NULL);
+	ovl_count = find_overlays(elf, &ehdr, phdrs, is_overlay, &ovls);
+	if(ovl_count < 0) {
+		goto fail_free_overlays;
+	}
+	if(ovl_count > 0 && overlay_dir == NULL) {
+		fprintf(stderr, "ELF has %d overlay segment(s), use -O to write them out\n", ovl_count);
+		goto fail_free_overlays;
+	}
+
 	// Find start and end of program
 	target_ftext = 0xFFFFFFFF;
 	target_edata = 0x00000000;
@@ -243,7 +1059,7 @@ int main(int argc, char *argv[])
 			, phdr->align
 		);
 
-		if(phdr->type == PT_LOAD && phdr->filesz > 0) {
+		if(phdr->type == PT_LOAD && phdr->filesz > 0 && !is_overlay[i]) {
 			if(phdr->vaddr < target_ftext) {
 				target_ftext = phdr->vaddr;
 			}
@@ -256,19 +1072,19 @@ int main(int argc, char *argv[])
 	// Sanity-check the range
 	if(target_ftext > target_edata) {
 		fprintf(stderr, "couldn't find any PT_LOAD segments!\n");
-		goto fail_free_phdr_elf;
+		goto fail_free_overlays;
 	}
 	if(target_ftext < 0x80010000) {
 		fprintf(stderr, "text segment starts too early\n");
-		goto fail_free_phdr_elf;
+		goto fail_free_overlays;
 	}
 	if(target_edata > 0x80200000) {
 		fprintf(stderr, "data segment ends too late\n");
-		goto fail_free_phdr_elf;
+		goto fail_free_overlays;
 	}
 	if((target_ftext & 0x7FF) != 0) {
 		fprintf(stderr, "text segment start not 2KB-aligned\n");
-		goto fail_free_phdr_elf;
+		goto fail_free_overlays;
 	}
 
 	// Get 8KB-aligned end
@@ -277,11 +1093,72 @@ int main(int argc, char *argv[])
 	printf("File     memory range: %08X -> %08X\n", target_ftext, target_edata);
 	printf("Adjusted memory range: %08X -> %08X\n", target_ftext, target_aedata);
 
-	// Open destination PS-X EXE
-	psx = fopen(fname_psx, "w+b");
-	if(psx == NULL) {
-		perror("fopen(psx)");
-		goto fail_free_phdr_elf;
+	// Write the overlays
+	if(ovl_count > 0) {
+		if(write_overlays(elf, overlay_dir, phdrs, ovls, ovl_count) != 0) {
+			goto fail_free_overlays;
+		}
+		printf("Wrote %d overlay(s) to %s\n", ovl_count, overlay_dir);
+	}
+
+	// Sort the resident segments by address
+	seg_order = malloc(sizeof(int)*(ehdr.phdr_ent_count + 1));
+	assert(seg_order != NULL);
+	seg_count = 0;
+	for(i = 0; i < ehdr.phdr_ent_count; i++) {
+		int j;
+		if(phdrs[i].type != PT_LOAD || phdrs[i].memsz == 0 || is_overlay[i]) {
+			continue;
+		}
+		for(j = seg_count; j > 0 && phdrs[seg_order[j-1]].vaddr > phdrs[i].vaddr; j--) {
+			seg_order[j] = seg_order[j-1];
+		}
+		seg_order[j] = i;
+		seg_count++;
+	}
+	print_segment_map(phdrs, seg_order, seg_count,
+		target_ftext, target_edata, target_aedata);
+
+	// Check every segment lands inside the image without overlapping
+	addr = 0;
+	for(i = 0; i < seg_count; i++) {
+		phdr = &phdrs[seg_order[i]];
+		if(phdr->filesz == 0) {
+			continue;
+		}
+		if(phdr->vaddr - target_ftext < addr) {
+			fprintf(stderr, "PT_LOAD segments overlap at %08X\n", phdr->vaddr);
+			goto fail_free_order;
+		}
+		addr = phdr->vaddr - target_ftext + phdr->filesz;
+		if(addr > target_aedata - target_ftext) {
+			fprintf(stderr, "PT_LOAD destination out of range\n");
+			goto fail_free_order;
+		}
+	}
+
+	// The compressor needs the whole memory image
+	if(compress) {
+		image = calloc(1, target_aedata - target_ftext);
+		if(image == NULL) {
+			perror("calloc(image)");
+			goto fail_free_order;
+		}
+
+		for(i = 0; i < seg_count; i++) {
+			phdr = &phdrs[seg_order[i]];
+			if(phdr->filesz == 0) {
+				continue;
+			}
+			if(fseek(elf, phdr->offset, SEEK_SET)) {
+				perror("fseek(psx copy - elf)");
+				goto fail_free_image;
+			}
+			if(fread(image + (phdr->vaddr - target_ftext), phdr->filesz, 1, elf) != 1) {
+				perror("fread(psx copy)");
+				goto fail_free_image;
+			}
+		}
 	}
 
 	// Prepare header
@@ -295,6 +1172,65 @@ int main(int argc, char *argv[])
 	psxh.bss_len = 0;
 	psxh.sp_base = 0x801FFFF0;
 	psxh.sp_offs = 0;
+	out_data = NULL;
+	out_len = psxh.filesz;
+
+	if(compress) {
+		// The stub and stream get loaded right after the image, so
+		// the unpacked data never overwrites anything still to be read.
+		// That memory is part of the program's BSS, which crt0 clears.
+		uint32_t image_len = target_aedata - target_ftext;
+		uint32_t stub_len = sizeof(lzss_stub_template);
+		uint32_t packed_len;
+		uint32_t *stub;
+		uint8_t *check;
+
+		packed = calloc(1, stub_len + image_len + image_len/8 + 1 + 0x800);
+		if(packed == NULL) {
+			perror("calloc(packed)");
+			goto fail_free_image;
+		}
+		packed_len = compress_lzss(packed + stub_len, image, image_len);
+
+		// Verify against the reference decompressor before trusting it
+		check = malloc(image_len);
+		if(check == NULL) {
+			perror("malloc(check)");
+			goto fail_free_packed;
+		}
+		if(!decompress_lzss(check, image_len, packed + stub_len, packed_len)
+			|| memcmp(check, image, image_len)) {
+			fprintf(stderr, "compressed image failed to round-trip\n");
+			free(check);
+			goto fail_free_packed;
+		}
+		free(check);
+
+		stub = (uint32_t *)packed;
+		memcpy(stub, lzss_stub_template, stub_len);
+		stub_patch_addr(stub, 4, target_aedata + stub_len);
+		stub_patch_addr(stub, 6, target_ftext);
+		stub_patch_addr(stub, 8, target_aedata);
+		stub_patch_addr(stub, STUB_ENTRY, ehdr.entry_point);
+
+		out_data = packed;
+		out_len = (stub_len + packed_len + 0x7FF) & ~0x7FF;
+		if(target_aedata + out_len > psxh.sp_base - 0x1000) {
+			fprintf(stderr, "no room for the compressed image above the program\n");
+			goto fail_free_packed;
+		}
+
+		psxh.pc = target_aedata;
+		psxh.ftext = target_aedata;
+		psxh.filesz = out_len;
+
+		printf("Compressed: %08X -> %08X bytes (%u%%), stub at %08X\n"
+			, image_len
+			, stub_len + packed_len
+			, (unsigned)(((uint64_t)(stub_len + packed_len) * 100) / image_len)
+			, target_aedata
+		);
+	}
 
 	switch(region_flag) {
 		case REGION_NTSC_JAPAN:
@@ -316,78 +1252,71 @@ int main(int argc, char *argv[])
 			break;
 	}
 
+	// Open destination PS-X EXE
+	psx = open(fname_psx, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(psx < 0) {
+		perror("open(psx)");
+		goto fail_free_packed;
+	}
+
 	// Write header
-	if(fwrite(&psxh, sizeof(psxh), 1, psx) != 1) {
-		perror("fwrite(psx head)");
+	if(pwrite_all(psx, &psxh, sizeof(psxh), 0) != 0) {
+		perror("pwrite(psx head)");
 		goto fail_close_psx;
 	}
 
-	// Zerofill EXE space
-	memset(&blank_page, 0, 0x800);
-	for(i = 0; i < psxh.filesz; i += 0x800) {
-		if(fwrite(&blank_page, 0x800, 1, psx) != 1) {
-			perror("fwrite(psx zero)");
+	// Write image
+	if(out_data != NULL) {
+		if(pwrite_all(psx, out_data, out_len, sizeof(psxh)) != 0) {
+			perror("pwrite(psx image)");
 			goto fail_close_psx;
 		}
-	}
-
-	// Apply PT_LOAD sections
-	for(i = 0; i < ehdr.phdr_ent_count; i++) {
-		phdr = &phdrs[i];
-
-		if(phdr->type != PT_LOAD) {
-			continue;
-		}
-
-		if(phdr->filesz == 0) {
-			continue;
-		}
-
-		// Calculate output address
-		addr = phdr->vaddr - target_ftext;
-		if(addr < 0 || addr >= psxh.filesz || addr+phdr->filesz > psxh.filesz) {
-			fprintf(stderr, "PT_LOAD destination out of range\n");
-			goto fail_close_psx;
-		}
-
-		// Seek
-		if(fseek(elf, phdr->offset, SEEK_SET)) {
-			perror("fseek(psx copy - elf)");
-			goto fail_close_psx;
-		}
-
-		if(fseek(psx, addr + 0x800, SEEK_SET)) {
-			perror("fseek(psx copy - psx)");
-			goto fail_close_psx;
-		}
-
-		// Allocate
-		tmp_copy_buf = malloc(phdr->filesz);
-
-		// Copy
-		if(fread(tmp_copy_buf, phdr->filesz, 1, elf) != 1) {
-			perror("fread(psx copy)");
-			goto fail_free_tmp_copy_buf;
-		}
-		if(fwrite(tmp_copy_buf, phdr->filesz, 1, psx) != 1) {
-			perror("fwrite(psx copy)");
-			goto fail_free_tmp_copy_buf;
+	} else {
+		for(i = 0; i < seg_count; i++) {
+			phdr = &phdrs[seg_order[i]];
+			if(phdr->filesz == 0) {
+				continue;
+			}
+			if(copy_range(fileno(elf), phdr->offset,
+				psx, sizeof(psxh) + (phdr->vaddr - target_ftext),
+				phdr->filesz) != 0) {
+				perror("copy(psx segment)");
+				goto fail_close_psx;
+			}
 		}
-		free(tmp_copy_buf);
+	}
+	if(ftruncate(psx, sizeof(psxh) + out_len) != 0) {
+		perror("ftruncate(psx)");
+		goto fail_close_psx;
 	}
 
 	// Close files
-	fclose(psx);
+	if(close(psx) != 0) {
+		perror("close(psx)");
+		goto fail_free_packed;
+	}
 	fclose(elf);
 
+	free(packed);
+	free(image);
+	free(seg_order);
+	free(ovls);
+	free(is_overlay);
 	free(phdrs);
 	return 0;
 
 	// FAILURES
-fail_free_tmp_copy_buf:
-	free(tmp_copy_buf);
 fail_close_psx:
-	fclose(psx);
+	close(psx);
+fail_free_packed:
+	free(packed);
+fail_free_image:
+	free(image);
+fail_free_order:
+	free(seg_order);
+fail_free_overlays:
+	free(ovls);
+	free(is_overlay);
 fail_free_phdr_elf:
 	free(phdrs);
 fail_close_elf:
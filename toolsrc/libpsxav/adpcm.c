@@ -25,9 +25,10 @@ freely, subject to the following restrictions:
 #include <string.h>
 #include "libpsxav.h"
 
-#define ADPCM_FILTER_COUNT 5
+// The stats filters[] histograms are indexed by filter number
+#define ADPCM_FILTER_COUNT PSX_AUDIO_ADPCM_FILTER_COUNT
 #define XA_ADPCM_FILTER_COUNT 4
-#define SPU_ADPCM_FILTER_COUNT 5
+#define SPU_ADPCM_FILTER_COUNT ADPCM_FILTER_COUNT
 
 static const int16_t filter_k1[ADPCM_FILTER_COUNT] = {0, 60, 115, 98, 122};
 static const int16_t filter_k2[ADPCM_FILTER_COUNT] = {0, 0, -52, -55, -60};
@@ -67,11 +68,13 @@ static int find_min_shift(const psx_audio_encoder_channel_state_t *state, int16_
 	return min_shift;
 }
 
-static uint8_t attempt_to_encode_nibbles(psx_audio_encoder_channel_state_t *outstate, const psx_audio_encoder_channel_state_t *instate, int16_t *samples, int sample_limit, int pitch, uint8_t *data, int data_shift, int data_pitch, int filter, int sample_shift) {
+// stats is NULL for trial encodes; only the final one is counted
+static uint8_t attempt_to_encode_nibbles(psx_audio_encoder_channel_state_t *outstate, const psx_audio_encoder_channel_state_t *instate, int16_t *samples, int sample_limit, int pitch, uint8_t *data, int data_shift, int data_pitch, int filter, int sample_shift, psx_audio_encoder_channel_stats_t *stats) {
 	uint8_t nondata_mask = ~(0x0F << data_shift);
 	int min_shift = sample_shift;
 	int k1 = filter_k1[filter];
 	int k2 = filter_k2[filter];
+	int clipped_nibbles = 0, clipped_samples = 0;
 
 	uint8_t hdr = (min_shift & 0x0F) | (filter << 4);
 
@@ -88,15 +91,15 @@ static uint8_t attempt_to_encode_nibbles(psx_audio_encoder_channel_state_t *outs
 		sample_enc <<= min_shift;
 		sample_enc += (1<<(12-1));
 		sample_enc >>= 12;
-		if(sample_enc < -8) { sample_enc = -8; }
-		if(sample_enc > +7) { sample_enc = +7; }
+		if(sample_enc < -8) { sample_enc = -8; clipped_nibbles++; }
+		if(sample_enc > +7) { sample_enc = +7; clipped_nibbles++; }
 		sample_enc &= 0xF;
 
 		int32_t sample_dec = (int16_t) ((sample_enc&0xF) << 12);
 		sample_dec >>= min_shift;
 		sample_dec += previous_values;
-		if (sample_dec > +0x7FFF) { sample_dec = +0x7FFF; }
-		if (sample_dec < -0x8000) { sample_dec = -0x8000; }
+		if (sample_dec > +0x7FFF) { sample_dec = +0x7FFF; clipped_samples++; }
+		if (sample_dec < -0x8000) { sample_dec = -0x8000; clipped_samples++; }
 		int64_t sample_error = sample_dec - sample;
 
 		assert(sample_error < (1<<30));
@@ -111,14 +114,21 @@ static uint8_t attempt_to_encode_nibbles(psx_audio_encoder_channel_state_t *outs
 		outstate->prev1 = sample_dec;
 	}
 
+	if (stats != NULL) {
+		stats->clipped_nibbles += clipped_nibbles;
+		stats->clipped_samples += clipped_samples;
+		stats->error_energy += outstate->mse;
+	}
+
 	return hdr;
 }
 
-static uint8_t encode_nibbles(psx_audio_encoder_channel_state_t *state, int16_t *samples, int sample_limit, int pitch, uint8_t *data, int data_shift, int data_pitch, int filter_count) {
+static uint8_t encode_nibbles(psx_audio_encoder_channel_state_t *state, int16_t *samples, int sample_limit, int pitch, uint8_t *data, int data_shift, int data_pitch, int filter_count, psx_audio_encoder_channel_stats_t *stats) {
     psx_audio_encoder_channel_state_t proposed;
 	int64_t best_mse = ((int64_t)1<<(int64_t)50);
 	int best_filter = 0;
 	int best_sample_shift = 0;
+	int evaluated = 0;
 
 	for (int filter = 0; filter < filter_count; filter++) {
 		int true_min_shift = find_min_shift(state, samples, pitch, filter);
@@ -137,7 +147,8 @@ static uint8_t encode_nibbles(psx_audio_encoder_channel_state_t *state, int16_t
 				&proposed, state,
 				samples, sample_limit, pitch,
 				data, data_shift, data_pitch,
-				filter, sample_shift);
+				filter, sample_shift, NULL);
+			evaluated++;
 
 			if (best_mse > proposed.mse) {
 				best_mse = proposed.mse;
@@ -147,34 +158,51 @@ static uint8_t encode_nibbles(psx_audio_encoder_channel_state_t *state, int16_t
 		}
 	}
 
+	if (stats != NULL) {
+		stats->units++;
+		stats->filters[best_filter]++;
+		stats->shifts[best_sample_shift]++;
+		stats->candidates_evaluated += evaluated;
+		stats->candidates_pruned += filter_count*PSX_AUDIO_ADPCM_SHIFT_COUNT - evaluated;
+		for (int i = 0; i < 28 && i * pitch < sample_limit; i++) {
+			int32_t sample = samples[i * pitch];
+			stats->signal_energy += (uint64_t)(sample * sample);
+		}
+		stats->samples += 28;
+	}
+
 	// now go with the encoder
 	return attempt_to_encode_nibbles(
 		state, state,
 		samples, sample_limit, pitch,
 		data, data_shift, data_pitch,
-		best_filter, best_sample_shift);
+		best_filter, best_sample_shift, stats);
 }
 
 static void encode_block_xa(int16_t *audio_samples, int audio_samples_limit, uint8_t *data, psx_audio_xa_settings_t settings, psx_audio_encoder_state_t *state) {
+	psx_audio_encoder_channel_stats_t *left_stats = state->stats != NULL ? &(state->stats->left) : NULL;
+	psx_audio_encoder_channel_stats_t *right_stats = state->stats != NULL ? &(state->stats->right) : NULL;
+
 	if (settings.bits_per_sample == 4) {
 		if (settings.stereo) {
-			data[0]  = encode_nibbles(&(state->left), audio_samples, audio_samples_limit,           2, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT);
-			data[1]  = encode_nibbles(&(state->right), audio_samples + 1, audio_samples_limit - 1,        2, data + 0x10, 4, 4, XA_ADPCM_FILTER_COUNT);
-			data[2]  = encode_nibbles(&(state->left), audio_samples + 56, audio_samples_limit - 56,       2, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT);
-			data[3]  = encode_nibbles(&(state->right), audio_samples + 56 + 1, audio_samples_limit - 56 - 1,  2, data + 0x11, 4, 4, XA_ADPCM_FILTER_COUNT);
-			data[8]  = encode_nibbles(&(state->left), audio_samples + 56*2, audio_samples_limit - 56*2,    2, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT);
-			data[9]  = encode_nibbles(&(state->right), audio_samples + 56*2 + 1, audio_samples_limit - 56*2 - 1, 2, data + 0x12, 4, 4, XA_ADPCM_FILTER_COUNT);
-			data[10] = encode_nibbles(&(state->left), audio_samples + 56*3, audio_samples_limit - 56*3,     2, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT);
-			data[11] = encode_nibbles(&(state->right), audio_samples + 56*3 + 1, audio_samples_limit - 56*3 - 1, 2, data + 0x13, 4, 4, XA_ADPCM_FILTER_COUNT);
+			data[0]  = encode_nibbles(&(state->left), audio_samples, audio_samples_limit,           2, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT, left_stats);
+			data[1]  = encode_nibbles(&(state->right), audio_samples + 1, audio_samples_limit - 1,        2, data + 0x10, 4, 4, XA_ADPCM_FILTER_COUNT, right_stats);
+			data[2]  = encode_nibbles(&(state->left), audio_samples + 56, audio_samples_limit - 56,       2, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT, left_stats);
+			data[3]  = encode_nibbles(&(state->right), audio_samples + 56 + 1, audio_samples_limit - 56 - 1,  2, data + 0x11, 4, 4, XA_ADPCM_FILTER_COUNT, right_stats);
+			data[8]  = encode_nibbles(&(state->left), audio_samples + 56*2, audio_samples_limit - 56*2,    2, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT, left_stats);
+			data[9]  = encode_nibbles(&(state->right), audio_samples + 56*2 + 1, audio_samples_limit - 56*2 - 1, 2, data + 0x12, 4, 4, XA_ADPCM_FILTER_COUNT, right_stats);
+			data[10] = encode_nibbles(&(state->left), audio_samples + 56*3, audio_samples_limit - 56*3,     2, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT, left_stats);
+			data[11] = encode_nibbles(&(state->right), audio_samples + 56*3 + 1, audio_samples_limit - 56*3 - 1, 2, data + 0x13, 4, 4, XA_ADPCM_FILTER_COUNT, right_stats);
 		} else {
-			data[0]  = encode_nibbles(&(state->left), audio_samples, audio_samples_limit,           1, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT);
-			data[1]  = encode_nibbles(&(state->right), audio_samples + 28, audio_samples_limit - 28,       1, data + 0x10, 4, 4, XA_ADPCM_FILTER_COUNT);
-			data[2]  = encode_nibbles(&(state->left), audio_samples + 28*2, audio_samples_limit - 28*2,     1, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT);
-			data[3]  = encode_nibbles(&(state->right), audio_samples + 28*3, audio_samples_limit - 28*3,     1, data + 0x11, 4, 4, XA_ADPCM_FILTER_COUNT);
-			data[8]  = encode_nibbles(&(state->left), audio_samples + 28*4, audio_samples_limit - 28*4,     1, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT);
-			data[9]  = encode_nibbles(&(state->right), audio_samples + 28*5, audio_samples_limit - 28*5,     1, data + 0x12, 4, 4, XA_ADPCM_FILTER_COUNT);
-			data[10] = encode_nibbles(&(state->left), audio_samples + 28*6, audio_samples_limit - 28*6,     1, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT);
-			data[11] = encode_nibbles(&(state->right), audio_samples + 28*7, audio_samples_limit - 28*7,     1, data + 0x13, 4, 4, XA_ADPCM_FILTER_COUNT);
+			// Mono units play one after another through a single predictor
+			data[0]  = encode_nibbles(&(state->left), audio_samples, audio_samples_limit,           1, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT, left_stats);
+			data[1]  = encode_nibbles(&(state->left), audio_samples + 28, audio_samples_limit - 28,       1, data + 0x10, 4, 4, XA_ADPCM_FILTER_COUNT, left_stats);
+			data[2]  = encode_nibbles(&(state->left), audio_samples + 28*2, audio_samples_limit - 28*2,     1, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT, left_stats);
+			data[3]  = encode_nibbles(&(state->left), audio_samples + 28*3, audio_samples_limit - 28*3,     1, data + 0x11, 4, 4, XA_ADPCM_FILTER_COUNT, left_stats);
+			data[8]  = encode_nibbles(&(state->left), audio_samples + 28*4, audio_samples_limit - 28*4,     1, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT, left_stats);
+			data[9]  = encode_nibbles(&(state->left), audio_samples + 28*5, audio_samples_limit - 28*5,     1, data + 0x12, 4, 4, XA_ADPCM_FILTER_COUNT, left_stats);
+			data[10] = encode_nibbles(&(state->left), audio_samples + 28*6, audio_samples_limit - 28*6,     1, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT, left_stats);
+			data[11] = encode_nibbles(&(state->left), audio_samples + 28*7, audio_samples_limit - 28*7,     1, data + 0x13, 4, 4, XA_ADPCM_FILTER_COUNT, left_stats);
 		}
 	} else {
 /*		if (settings->stereo) {
@@ -290,7 +318,8 @@ int psx_audio_spu_encode(psx_audio_encoder_state_t *state, int16_t* samples, int
 	uint8_t *data;
 
 	for (int i = 0; i < sample_count; i += 28, buffer += 16) {
-		buffer[0] = encode_nibbles(&(state->left), samples + i, sample_count - i, 1, prebuf, 0, 1, SPU_ADPCM_FILTER_COUNT);
+		buffer[0] = encode_nibbles(&(state->left), samples + i, sample_count - i, 1, prebuf, 0, 1, SPU_ADPCM_FILTER_COUNT,
+			state->stats != NULL ? &(state->stats->left) : NULL);
 		buffer[1] = 0;
 
 		for (int j = 0; j < 28; j+=2) {
@@ -325,3 +354,118 @@ void psx_audio_spu_set_flag_at_sample(uint8_t* spu_data, int sample_pos, int fla
 	int buffer_pos = (sample_pos / 28) << 4;
 	spu_data[buffer_pos + 1] = flag;
 }
+
+//
+// Decoding
+//
+// Every sound unit is first expanded from nibbles (or bytes) into shifted
+// residuals; this has no dependencies between samples. The prediction
+// filter then runs over the residuals, with both stereo channels advanced
+// in the same loop since they don't depend on each other.
+//
+
+static inline int16_t decode_predict(psx_audio_decoder_channel_state_t *state, int32_t residual, int k1, int k2) {
+	int32_t sample = residual + ((k1*state->prev1 + k2*state->prev2 + (1<<5))>>6);
+	if (sample > +0x7FFF) { sample = +0x7FFF; }
+	if (sample < -0x8000) { sample = -0x8000; }
+	state->prev2 = state->prev1;
+	state->prev1 = sample;
+	return sample;
+}
+
+static inline int decode_shift(uint8_t hdr) {
+	// The hardware treats shifts 13-15 as 9
+	int shift = hdr & 0x0F;
+	return shift > 12 ? 9 : shift;
+}
+
+static inline int decode_filter(uint8_t hdr, int filter_count) {
+	int filter = (hdr >> 4) & 0x07;
+	return filter < filter_count ? filter : 0;
+}
+
+// Expands the 28 samples of one 4-bit unit: nibble n of every data_pitch bytes
+static void decode_residuals_4bit(const uint8_t *data, int data_shift, int data_pitch, int shift, int32_t *residuals) {
+	for (int i = 0; i < 28; i++) {
+		residuals[i] = ((int16_t)((data[i * data_pitch] >> data_shift) << 12)) >> shift;
+	}
+}
+
+static void decode_residuals_8bit(const uint8_t *data, int data_pitch, int shift, int32_t *residuals) {
+	for (int i = 0; i < 28; i++) {
+		residuals[i] = ((int16_t)(data[i * data_pitch] << 8)) >> shift;
+	}
+}
+
+// Decodes one 128-byte sound group into 224 (4-bit) or 112 (8-bit) samples,
+// interleaved when stereo.
+static void decode_group_xa(const uint8_t *data, psx_audio_xa_settings_t settings, psx_audio_decoder_state_t *state, int16_t *samples) {
+	int32_t residuals[8][28];
+	int filters[8];
+	int unit_count = (settings.bits_per_sample == 8) ? 4 : 8;
+
+	for (int u = 0; u < unit_count; u++) {
+		// Headers for units 4-7 are at 8-11; 4-7 and 12-15 hold copies
+		uint8_t hdr = data[(u < 4) ? u : (u + 4)];
+		filters[u] = decode_filter(hdr, XA_ADPCM_FILTER_COUNT);
+		if (settings.bits_per_sample == 8) {
+			decode_residuals_8bit(data + 0x10 + u, 4, decode_shift(hdr), residuals[u]);
+		} else {
+			decode_residuals_4bit(data + 0x10 + (u >> 1), (u & 1) * 4, 4, decode_shift(hdr), residuals[u]);
+		}
+	}
+
+	if (settings.stereo) {
+		// Even units are left, odd ones right
+		for (int u = 0; u < unit_count; u += 2) {
+			int lk1 = filter_k1[filters[u]], lk2 = filter_k2[filters[u]];
+			int rk1 = filter_k1[filters[u+1]], rk2 = filter_k2[filters[u+1]];
+			for (int i = 0; i < 28; i++) {
+				samples[0] = decode_predict(&(state->left), residuals[u][i], lk1, lk2);
+				samples[1] = decode_predict(&(state->right), residuals[u+1][i], rk1, rk2);
+				samples += 2;
+			}
+		}
+	} else {
+		for (int u = 0; u < unit_count; u++) {
+			int k1 = filter_k1[filters[u]], k2 = filter_k2[filters[u]];
+			for (int i = 0; i < 28; i++) {
+				*(samples++) = decode_predict(&(state->left), residuals[u][i], k1, k2);
+			}
+		}
+	}
+}
+
+int psx_audio_xa_decode(psx_audio_xa_settings_t settings, psx_audio_decoder_state_t *state, const uint8_t *sector, int16_t *samples) {
+	// .xa sectors start at the subheader
+	const uint8_t *subheader = sector + (settings.format == PSX_AUDIO_XA_FORMAT_XA ? 0 : 0x10);
+	if (!(subheader[2] & 0x04)) {
+		return 0;
+	}
+
+	int group_samples = ((settings.bits_per_sample == 8) ? 112 : 224);
+	for (int j = 0; j < 18; j++) {
+		decode_group_xa(subheader + 8 + j * 0x80, settings, state, samples + j * group_samples);
+	}
+
+	return psx_audio_xa_get_samples_per_sector(settings);
+}
+
+int psx_audio_spu_decode(psx_audio_decoder_state_t *state, const uint8_t *data, int length, int16_t *samples) {
+	int32_t residuals[28];
+	int sample_count = 0;
+
+	for (int i = 0; i + 16 <= length; i += 16) {
+		int filter = decode_filter(data[i], SPU_ADPCM_FILTER_COUNT);
+		int k1 = filter_k1[filter], k2 = filter_k2[filter];
+
+		for (int j = 0; j < 28; j++) {
+			residuals[j] = ((int16_t)((data[i + 2 + (j >> 1)] >> ((j & 1) * 4)) << 12)) >> decode_shift(data[i]);
+		}
+		for (int j = 0; j < 28; j++) {
+			samples[sample_count++] = decode_predict(&(state->left), residuals[j], k1, k2);
+		}
+	}
+
+	return sample_count;
+}
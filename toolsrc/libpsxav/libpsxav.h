@@ -52,11 +52,43 @@ typedef struct {
 	int prev1, prev2;
 } psx_audio_encoder_channel_state_t;
 
+#define PSX_AUDIO_ADPCM_FILTER_COUNT 5
+#define PSX_AUDIO_ADPCM_SHIFT_COUNT 13
+
+// What the ADPCM search did, summed over every 28-sample unit encoded
+typedef struct {
+	uint64_t units;
+	uint64_t filters[PSX_AUDIO_ADPCM_FILTER_COUNT]; // filter chosen per unit
+	uint64_t shifts[PSX_AUDIO_ADPCM_SHIFT_COUNT]; // shift chosen per unit
+	uint64_t candidates_evaluated; // filter/shift pairs trial encoded
+	uint64_t candidates_pruned; // pairs skipped as too far from the minimum shift
+	uint64_t clipped_nibbles; // residuals clamped to -8..+7
+	uint64_t clipped_samples; // decoded samples clamped to 16 bits
+	uint64_t samples;
+	uint64_t signal_energy; // sum of squared input samples
+	uint64_t error_energy; // sum of squared coding errors
+} psx_audio_encoder_channel_stats_t;
+
+typedef struct {
+	psx_audio_encoder_channel_stats_t left; // the only one used by mono XA and SPU
+	psx_audio_encoder_channel_stats_t right;
+} psx_audio_encoder_stats_t;
+
 typedef struct {
 	psx_audio_encoder_channel_state_t left;
 	psx_audio_encoder_channel_state_t right;
+	psx_audio_encoder_stats_t *stats; // optional; NULL leaves the search untouched
 } psx_audio_encoder_state_t;
 
+typedef struct {
+	int prev1, prev2;
+} psx_audio_decoder_channel_state_t;
+
+typedef struct {
+	psx_audio_decoder_channel_state_t left;
+	psx_audio_decoder_channel_state_t right;
+} psx_audio_decoder_state_t;
+
 #define PSX_AUDIO_SPU_LOOP_END 1
 #define PSX_AUDIO_SPU_LOOP_REPEAT 3
 #define PSX_AUDIO_SPU_LOOP_START 4
@@ -74,6 +106,13 @@ int psx_audio_spu_encode_simple(int16_t* samples, int sample_count, uint8_t *out
 int psx_audio_xa_encode_finalize(psx_audio_xa_settings_t settings, uint8_t *output, int output_length);
 void psx_audio_spu_set_flag_at_sample(uint8_t* spu_data, int sample_pos, int flag);
 
+// Decode one sector (2336 bytes from the subheader for .xa, 2352 otherwise)
+// into psx_audio_xa_get_samples_per_sector() samples per channel, interleaved
+// when stereo. Returns that count, or 0 if the sector isn't XA audio.
+int psx_audio_xa_decode(psx_audio_xa_settings_t settings, psx_audio_decoder_state_t *state, const uint8_t *sector, int16_t *samples);
+// Decode length bytes of SPU-ADPCM blocks, 28 samples per 16 bytes; returns the sample count
+int psx_audio_spu_decode(psx_audio_decoder_state_t *state, const uint8_t *data, int length, int16_t *samples);
+
 // cdrom.c
 
 #define PSX_CDROM_SECTOR_SIZE 2352
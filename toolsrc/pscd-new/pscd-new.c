@@ -27,8 +27,15 @@ freely, subject to the following restrictions:
 #include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include <ctype.h>
+#include <math.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 //define BSWAP16(v) ((((v)>>8)&0xFF)|(((v)<<8)&0xFF00))
 //define BSWAP32(v) (((BSWAP16(v)>>16)&0xFFFF)|((BSWAP16(v)<<16)&0xFFFF0000))
@@ -100,6 +107,7 @@ typedef enum dentmode
 	DENT_DAT, // Normal data
 	DENT_RAW, // Raw sectors
 	DENT_DIR, // Directory
+	DENT_ILV, // Raw sectors interleaved from several streams
 } dentmode_t;
 
 #define FNAME_MAX_LEN_ISO 32
@@ -142,11 +150,19 @@ typedef struct locdent {
 	xadent_t xadent;
 	char loc_fname[FNAME_MAX_LEN_LOC];
 	char dir_fname[FNAME_MAX_LEN_LOC];
+	char ilv_fname[FNAME_MAX_LEN_LOC]; // interleave pattern for DENT_ILV
 	dentmode_t dmode;
 	int path_idx; // -1 == not a dir
 	int parent_dir; // -1 == no parent
 	int parent_path; // -1 == no parent
 	int sector;
+	int sectors; // sectors used by the file contents
+	int alloc; // sectors reserved for the file (>= sectors, 0 for duplicates)
+	int dup_of; // -1 == not a duplicate of an earlier file
+	uint32_t data_len;
+	uint64_t hash; // content hash, see hash_bytes()
+	int64_t mtime; // nanoseconds
+	bool dirty; // needs (re)encoding into the image
 } locdent_t;
 
 /*
@@ -246,6 +262,7 @@ typedef struct vdst {
 } __attribute__((__packed__)) vdst_t;
 
 #define MAX_DENTS 2048
+#define LINEBUF_MAX 1024
 locdent_t dent_list[MAX_DENTS];
 int dent_remap[MAX_DENTS];
 int dent_path_remap[MAX_DENTS];
@@ -298,6 +315,145 @@ int load_whole_file(char **bufptr, size_t *buf_len, const char *fname)
 	return 0;
 }
 
+//
+// Content hashing (64-bit FNV-1a)
+//
+
+#define HASH_INIT 0xCBF29CE484222325ULL
+
+uint64_t hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	for(size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001B3ULL;
+	}
+	return h;
+}
+
+int hash_file(uint64_t *hash, const char *fname)
+{
+	FILE *fp = fopen(fname, "rb");
+	if(fp == NULL) {
+		return -1;
+	}
+
+	static uint8_t buf[1<<20];
+	uint64_t h = HASH_INIT;
+	for(;;) {
+		size_t amt = fread(buf, 1, sizeof(buf), fp);
+		if(amt == 0) {
+			assert(feof(fp));
+			break;
+		}
+		h = hash_bytes(h, buf, amt);
+	}
+
+	fclose(fp);
+	*hash = h;
+	return 0;
+}
+
+//
+// Incremental rebuild index
+//
+// One line per file, in dent_list order:
+//   sector alloc sectors data_len mtime hash dmode loc_fname
+// Duplicates have an alloc of 0 and share the sector of the original.
+// preceded by a header line:
+//   pscd-idx <version> <dir count> <sector_count> <config hash>
+//
+
+#define INDEX_VERSION 1
+
+typedef struct idxent {
+	int sector;
+	int alloc;
+	int sectors;
+	uint32_t data_len;
+	int64_t mtime;
+	uint64_t hash;
+	dentmode_t dmode;
+	char loc_fname[FNAME_MAX_LEN_LOC];
+} idxent_t;
+
+idxent_t idx_list[MAX_DENTS];
+int idx_count = 0;
+int idx_dir_count = 0;
+uint32_t idx_sector_count = 0;
+uint64_t idx_config_hash = 0;
+
+// Anything that changes the layout without changing file contents
+// must be mixed into this, or incremental builds will miss it.
+uint64_t config_hash = HASH_INIT;
+
+int find_idxent(const char *fname)
+{
+	for(int i = 0; i < idx_count; i++) {
+		if(!strcmp(idx_list[i].loc_fname, fname)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int load_index(const char *fname)
+{
+	FILE *fp = fopen(fname, "r");
+	if(fp == NULL) {
+		return -1;
+	}
+
+	int version = 0;
+	idx_count = 0;
+	if(fscanf(fp, "pscd-idx %d %d %" SCNu32 " %" SCNx64 "\n",
+			&version, &idx_dir_count, &idx_sector_count, &idx_config_hash) != 4
+			|| version != INDEX_VERSION) {
+		fclose(fp);
+		return -1;
+	}
+
+	char linebuf[LINEBUF_MAX];
+	while(fgets(linebuf, sizeof(linebuf), fp) != NULL) {
+		assert(idx_count < MAX_DENTS);
+		idxent_t *I = &idx_list[idx_count];
+		int dmode = 0;
+		int name_offs = 0;
+		if(sscanf(linebuf, "%d %d %d %" SCNu32 " %" SCNd64 " %" SCNx64 " %d %n",
+				&I->sector, &I->alloc, &I->sectors, &I->data_len,
+				&I->mtime, &I->hash, &dmode, &name_offs) != 7) {
+			fclose(fp);
+			return -1;
+		}
+		I->dmode = dmode;
+		strncpy(I->loc_fname, linebuf+name_offs, sizeof(I->loc_fname)-1);
+		I->loc_fname[strcspn(I->loc_fname, "\r\n")] = '\x00';
+		idx_count++;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+void save_index(const char *fname)
+{
+	FILE *fp = fopen(fname, "w");
+	assert(fp != NULL);
+
+	fprintf(fp, "pscd-idx %d %d %" PRIu32 " %016" PRIx64 "\n",
+		INDEX_VERSION, dent_path_count, sector_count, config_hash);
+	for(int i = 0; i < dent_count; i++) {
+		locdent_t *D = &dent_list[i];
+		if(D->dmode == DENT_DIR) { continue; }
+		fprintf(fp, "%d %d %d %" PRIu32 " %" PRId64 " %016" PRIx64 " %d %s\n",
+			D->sector, D->alloc, D->sectors, D->data_len,
+			D->mtime, D->hash, D->dmode, D->loc_fname);
+	}
+
+	fclose(fp);
+}
+
 uint32_t edc_table[256];
 int GF8_LOG[256];
 int GF8_ILOG[256];
@@ -436,6 +592,32 @@ int tobcd8(int v)
 	return (v%10)+((v/10)<<4);
 }
 
+// Work out what a raw input sector holds.
+// *data is pointed at what encode_sector() wants for that mode.
+secmode_t resolve_raw_sector(const uint8_t *srcsec, const uint8_t **data)
+{
+	*data = srcsec;
+
+	if(srcsec[0x00F] == 0) {
+		return SEC_EMPTY;
+
+	} else if(srcsec[0x00F] == 1) {
+		*data = srcsec+0x010;
+		return SEC_MODE1;
+
+	} else if(srcsec[0x00F] == 2) {
+		if((srcsec[0x012] & 0x20) == 0) {
+			*data = srcsec+0x018;
+			return SEC_MODE2_FORM1;
+		} else {
+			return SEC_MODE2_FORM2;
+		}
+	} else {
+		assert(!"invalid raw sector type");
+		abort();
+	}
+}
+
 void encode_sector(uint8_t *rawsec, const uint8_t *srcsec, int lba, secmode_t secmode, uint8_t submode)
 {
 	// Sync
@@ -453,24 +635,7 @@ void encode_sector(uint8_t *rawsec, const uint8_t *srcsec, int lba, secmode_t se
 	if(secmode == SEC_RAW) {
 		// Adjust it so it works
 		memcpy(rawsec+0x010, srcsec+0x010, 0x930-0x010);
-		if(srcsec[0x00F] == 0) {
-			secmode = SEC_EMPTY;
-
-		} else if(srcsec[0x00F] == 1) {
-			secmode = SEC_MODE1;
-			srcsec += 0x010;
-
-		} else if(srcsec[0x00F] == 2) {
-			if((srcsec[0x012] & 0x20) == 0) {
-				secmode = SEC_MODE2_FORM1;
-				srcsec += 0x018;
-			} else {
-				secmode = SEC_MODE2_FORM2;
-			}
-		} else {
-			assert(!"invalid raw sector type");
-			abort();
-		}
+		secmode = resolve_raw_sector(srcsec, &srcsec);
 	}
 
 	switch(secmode)
@@ -524,6 +689,315 @@ void encode_sector(uint8_t *rawsec, const uint8_t *srcsec, int lba, secmode_t se
 	}
 }
 
+//
+// Sector output
+//
+// Every sector goes through emit_sector(), which either encodes it into
+// the .bin or, with ecm= set, writes a compact record to an ECM image:
+//
+//   "PSCDECM1" u32:sector_count
+//   then per sector, in any order: u32:lba u8:type payload
+//
+// Sync, header, EDC and ECC are left out and regenerated on expansion
+// (pscd-new -x) by the same encode_sector() that builds a .bin, so an
+// expanded image is byte-identical to a directly built one.
+//
+
+#define ECM_MAGIC "PSCDECM1"
+
+typedef enum ecmtype
+{
+	ECM_VERBATIM = 0, // 0x930 bytes, stored as-is
+	ECM_ZERO, // Mode 0, all zero: no payload
+	ECM_MODE1, // 0x800 bytes of data
+	ECM_MODE2_FORM1, // submode + 0x800 bytes of data
+	ECM_MODE2_FORM2, // subheader + 0x914 bytes of data, with EDC
+	ECM_MODE2_FORM2_NOEDC, // same, EDC left as zero
+} ecmtype_t;
+
+//
+// .bin writer
+//
+// Sectors are encoded straight into a multi-megabyte buffer holding a
+// run of consecutive LBAs, which goes out in one pwrite() once it is
+// full or the next sector isn't the one following it.
+//
+
+#define BIN_EXTENT_SECTORS 1792 // 0x930*1792 = ~4MB
+
+typedef struct binwriter {
+	const char *fname;
+	int fd;
+	uint8_t *buf;
+	uint32_t lba; // first sector held in buf
+	uint32_t count; // sectors held in buf
+	uint64_t bytes;
+	int extents;
+	struct timespec t_start;
+} binwriter_t;
+
+binwriter_t binw = { .fd = -1 };
+FILE *ecmfp = NULL;
+
+// keep == true updates an existing image in place
+void bin_open(binwriter_t *bw, const char *fname, uint32_t total, bool keep)
+{
+	memset(bw, 0, sizeof(*bw));
+	bw->fname = fname;
+	clock_gettime(CLOCK_MONOTONIC, &bw->t_start);
+
+	bw->fd = open(fname, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0666);
+	if(bw->fd < 0) {
+		printf("ERROR: could not open \"%s\": %s\n", fname, strerror(errno));
+		exit(1);
+	}
+
+	// Not every filesystem can preallocate, but the size must be right
+	// either way as sectors we never write have to read back as zero
+	if(posix_fallocate(bw->fd, 0, 0x930*(off_t)total) != 0) {
+		if(ftruncate(bw->fd, 0x930*(off_t)total) != 0) {
+			printf("ERROR: could not size \"%s\": %s\n", fname, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if(posix_memalign((void **)&bw->buf, 4096, 0x930*BIN_EXTENT_SECTORS) != 0) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+}
+
+void bin_flush(binwriter_t *bw)
+{
+	size_t len = 0x930*(size_t)bw->count;
+	off_t offs = 0x930*(off_t)bw->lba;
+	for(size_t done = 0; done < len; ) {
+		ssize_t amt = pwrite(bw->fd, bw->buf+done, len-done, offs+done);
+		if(amt < 0 && errno == EINTR) {
+			continue;
+		}
+		if(amt <= 0) {
+			printf("ERROR: could not write \"%s\": %s\n", bw->fname, strerror(errno));
+			exit(1);
+		}
+		done += amt;
+	}
+
+	if(bw->count != 0) {
+		bw->bytes += len;
+		bw->extents++;
+	}
+	bw->lba += bw->count;
+	bw->count = 0;
+}
+
+// Returns where to put the 0x930 bytes of the given sector
+uint8_t *bin_sector(binwriter_t *bw, uint32_t lba)
+{
+	if(bw->count == BIN_EXTENT_SECTORS || lba != bw->lba+bw->count) {
+		bin_flush(bw);
+		bw->lba = lba;
+	}
+	return bw->buf + 0x930*(bw->count++);
+}
+
+void bin_close(binwriter_t *bw)
+{
+	bin_flush(bw);
+	if(close(bw->fd) != 0) {
+		printf("ERROR: could not write \"%s\": %s\n", bw->fname, strerror(errno));
+		exit(1);
+	}
+	bw->fd = -1;
+	free(bw->buf);
+	bw->buf = NULL;
+
+	struct timespec t_end;
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	double secs = (t_end.tv_sec - bw->t_start.tv_sec)
+		+ (t_end.tv_nsec - bw->t_start.tv_nsec)/1000000000.0;
+	double mib = bw->bytes/(1024.0*1024.0);
+	printf("Wrote %.1f MiB to \"%s\" in %d extents, %.3f s (%.1f MiB/s)\n",
+		mib, bw->fname, bw->extents, secs, (secs > 0.0 ? mib/secs : 0.0));
+}
+
+bool is_zero(const uint8_t *buf, size_t len)
+{
+	for(size_t i = 0; i < len; i++) {
+		if(buf[i] != 0x00) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void write_ecm_record(uint32_t lba, ecmtype_t type, const uint8_t *hdr, size_t hdr_len, const uint8_t *data, size_t data_len)
+{
+	uint8_t rec[5];
+	*(uint32_t *)(rec+0) = TOLE32(lba);
+	rec[4] = (uint8_t)type;
+	fwrite(rec, sizeof(rec), 1, ecmfp);
+	if(hdr_len != 0) {
+		fwrite(hdr, hdr_len, 1, ecmfp);
+	}
+	if(data_len != 0) {
+		fwrite(data, data_len, 1, ecmfp);
+	}
+}
+
+// Sector that can't be regenerated from its payload, e.g. the licence
+void emit_raw_sector(uint32_t lba, const uint8_t *rawsec)
+{
+	if(ecmfp != NULL) {
+		write_ecm_record(lba, ECM_VERBATIM, NULL, 0, rawsec, 0x930);
+	} else {
+		memcpy(bin_sector(&binw, lba), rawsec, 0x930);
+	}
+}
+
+void emit_sector(uint32_t lba, const uint8_t *srcsec, secmode_t secmode, uint8_t submode)
+{
+	uint8_t rawsec[0x930];
+
+	if(ecmfp == NULL) {
+		encode_sector(bin_sector(&binw, lba), srcsec, lba, secmode, submode);
+		return;
+	}
+
+	const uint8_t *data = srcsec;
+	bool is_raw = (secmode == SEC_RAW);
+	if(is_raw) {
+		secmode = resolve_raw_sector(srcsec, &data);
+	}
+
+	switch(secmode)
+	{
+		case SEC_MODE1:
+			// encode_sector() keeps whatever a raw sector had in the
+			// reserved bytes after the EDC
+			if(!is_raw || is_zero(srcsec+0x814, 8)) {
+				write_ecm_record(lba, ECM_MODE1, NULL, 0, data, 0x800);
+				return;
+			}
+			break;
+
+		case SEC_MODE2_FORM1:
+			write_ecm_record(lba, ECM_MODE2_FORM1, &submode, 1, data, 0x800);
+			return;
+
+		case SEC_MODE2_FORM2: {
+			uint8_t subhdr[4];
+			memcpy(subhdr, data+0x014, 4);
+			subhdr[2] |= 0x20;
+			write_ecm_record(lba,
+				(is_zero(data+0x92C, 4) ? ECM_MODE2_FORM2_NOEDC : ECM_MODE2_FORM2),
+				subhdr, 4, data+0x018, 0x914);
+		} return;
+
+		case SEC_EMPTY:
+			if(!is_raw || is_zero(srcsec+0x010, 0x920)) {
+				write_ecm_record(lba, ECM_ZERO, NULL, 0, NULL, 0);
+				return;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	// Not something we can regenerate, keep the whole thing
+	encode_sector(rawsec, srcsec, lba, (is_raw ? SEC_RAW : secmode), submode);
+	write_ecm_record(lba, ECM_VERBATIM, NULL, 0, rawsec, 0x930);
+}
+
+int expand_ecm(const char *fname_ecm, const char *fname_bin)
+{
+	FILE *infp = fopen(fname_ecm, "rb");
+	if(infp == NULL) {
+		printf("ERROR: could not open \"%s\": %s\n", fname_ecm, strerror(errno));
+		return 1;
+	}
+
+	uint8_t hdr[12];
+	if(fread(hdr, sizeof(hdr), 1, infp) != 1 || memcmp(hdr, ECM_MAGIC, 8)) {
+		printf("ERROR: \"%s\" is not a pscd ECM image\n", fname_ecm);
+		fclose(infp);
+		return 1;
+	}
+	uint32_t total = TOLE32(*(uint32_t *)(hdr+8));
+
+	bin_open(&binw, fname_bin, total, false);
+
+	uint8_t srcsec[0x930];
+	uint8_t rawsec[0x930];
+	uint32_t sectors = 0;
+	for(;;) {
+		uint8_t rec[5];
+		if(fread(rec, sizeof(rec), 1, infp) != 1) {
+			break;
+		}
+		uint32_t lba = TOLE32(*(uint32_t *)(rec+0));
+		ecmtype_t type = (ecmtype_t)rec[4];
+		if(lba >= total) {
+			printf("ERROR: sector %u out of range in \"%s\"\n", lba, fname_ecm);
+			break;
+		}
+
+		memset(srcsec, 0, sizeof(srcsec));
+		size_t got = 1;
+		switch(type)
+		{
+			case ECM_VERBATIM:
+				got = fread(rawsec, 0x930, 1, infp);
+				break;
+
+			case ECM_ZERO:
+				encode_sector(rawsec, srcsec, lba, SEC_EMPTY, 0x00);
+				break;
+
+			case ECM_MODE1:
+				got = fread(srcsec, 0x800, 1, infp);
+				encode_sector(rawsec, srcsec, lba, SEC_MODE1, 0x00);
+				break;
+
+			case ECM_MODE2_FORM1: {
+				uint8_t submode = 0;
+				got = fread(&submode, 1, 1, infp) & fread(srcsec, 0x800, 1, infp);
+				encode_sector(rawsec, srcsec, lba, SEC_MODE2_FORM1, submode);
+			} break;
+
+			case ECM_MODE2_FORM2:
+			case ECM_MODE2_FORM2_NOEDC:
+				got = fread(srcsec+0x014, 4+0x914, 1, infp);
+				// Non-zero EDC field tells encode_sector() to fill it in
+				srcsec[0x92F] = (type == ECM_MODE2_FORM2 ? 0xFF : 0x00);
+				encode_sector(rawsec, srcsec, lba, SEC_MODE2_FORM2, 0x00);
+				break;
+
+			default:
+				printf("ERROR: bad record type %d in \"%s\"\n", type, fname_ecm);
+				got = 0;
+				break;
+		}
+		if(got != 1) {
+			break;
+		}
+
+		memcpy(bin_sector(&binw, lba), rawsec, 0x930);
+		sectors++;
+	}
+
+	bool ok = (feof(infp) != 0);
+	if(!ok) {
+		printf("ERROR: \"%s\" is truncated or corrupt\n", fname_ecm);
+	}
+	fclose(infp);
+	bin_close(&binw);
+
+	printf("Expanded %u of %u sectors into \"%s\"\n", sectors, total, fname_bin);
+	return (ok ? 0 : 1);
+}
+
 int find_dent(const char *fname)
 {
 	for(int i = 0; i < dent_count; i++) {
@@ -585,6 +1059,7 @@ int assign_dent(const char *fname_in, dentmode_t dmode)
 	D->sector = (dmode != DENT_DIR ? 0 : D->path_idx + 22);
 	D->parent_dir = parent_idx;
 	D->parent_path = (parent_idx == -1 ? -1 : dent_list[parent_idx].path_idx);
+	D->dup_of = -1;
 	printf("%d %d %d %d \"%s\" \"%s\"\n", ent_idx, dmode, parent_idx, D->parent_path, fname_in, c_sep+1);
 
 	D->isodent.ts_year = 70;
@@ -599,7 +1074,7 @@ int assign_dent(const char *fname_in, dentmode_t dmode)
 	D->isodent.flags = (dmode == DENT_DIR ? 0x02 : 0x00);
 	D->isodent.vsnum_le = TOLE16(0x0001);
 	D->isodent.vsnum_be = TOBE16(0x0001);
-	D->xadent.fattr = (dmode == DENT_RAW ? TOBE16(0x3D55)
+	D->xadent.fattr = (dmode == DENT_RAW || dmode == DENT_ILV ? TOBE16(0x3D55)
 		: dmode == DENT_DAT ? TOBE16(0x0D55)
 		: TOBE16(0x8D55));
 	D->xadent.magic[0] = 'X';
@@ -610,87 +1085,948 @@ int assign_dent(const char *fname_in, dentmode_t dmode)
 	return ent_idx;
 }
 
-int main(int argc, char *argv[])
+//
+// Interleaved streams (ilv= in the manifest)
+//
+// Builds what xainterleave would have written straight into the image,
+// from the same pattern file format:
+//
+//   <sectors> null
+//   <sectors> raw <file>
+//   <sectors> xa <file> [<xa file> <xa channel>]
+//   <sectors> xacd <file> [<xa file> <xa channel>]
+//
+// The pattern is repeated until every stream has run out.
+//
+
+#define ILV_ENTRY_MAX 64
+
+typedef enum ilvtype
 {
-	init_tables();
+	ILV_NULL,
+	ILV_RAW, // 0x930-byte sectors
+	ILV_XA, // 0x920-byte sectors, no sync/header
+	ILV_XACD, // 0x930-byte XA sectors
+} ilvtype_t;
+
+typedef struct ilvent {
+	int sectors; // per round
+	ilvtype_t type;
+	char fname[FNAME_MAX_LEN_LOC];
+	int xa_file;
+	int xa_channel;
+	FILE *fp;
+} ilvent_t;
+
+int64_t stat_mtime(const struct stat *st)
+{
+	return (int64_t)st->st_mtim.tv_sec*1000000000 + st->st_mtim.tv_nsec;
+}
 
-	if(argc <= 1) {
-		printf("usage:\n\t%s manifest.txt\n", argv[0]);
+// Returns the entry count, or -1 with an error printed
+int parse_ilv(const char *fname, ilvent_t *ents)
+{
+	FILE *fp = fopen(fname, "r");
+	if(fp == NULL) {
+		printf("ERROR: could not open \"%s\": %s\n", fname, strerror(errno));
+		return -1;
 	}
 
-	//
-	// Parse manifest
-	//
-
-	FILE *manifestfp = fopen(argv[1], "r");
-#define LINEBUF_MAX 1024
-	char linebuf[LINEBUF_MAX];
-
-	char *fname_bin = NULL;
-	char *fname_cue = NULL;
-	char *fname_lic = NULL;
-
-	//assign_dent(".", DENT_DIR);
-
-	for(;;)
-	{
-		// Get line
-		char *ret_fgets = fgets(linebuf, sizeof(linebuf), manifestfp);
-		if(ret_fgets == NULL) {
-			assert(feof(manifestfp));
+	int count = 0;
+	char type_str[65];
+	ilvent_t e;
+	while(fscanf(fp, " %d %64s", &e.sectors, type_str) == 2) {
+		if(!strcmp(type_str, "null")) { e.type = ILV_NULL; }
+		else if(!strcmp(type_str, "raw")) { e.type = ILV_RAW; }
+		else if(!strcmp(type_str, "xa")) { e.type = ILV_XA; }
+		else if(!strcmp(type_str, "xacd")) { e.type = ILV_XACD; }
+		else {
+			printf("ERROR: \"%s\": unknown type \"%s\"\n", fname, type_str);
+			count = -1;
 			break;
 		}
 
-		// Strip comment/newlines
-		char *c_comnl = strpbrk(linebuf, "\r\n#");
-		if(c_comnl != NULL) {
-			*c_comnl = '\x00';
-		}
-
-		// Strip leading whitespace
-		size_t wsbeg = strspn(linebuf, " \t\r\n");
-		if(wsbeg != 0) {
-			size_t l = strlen(linebuf);
-			memmove(linebuf, linebuf+wsbeg, l-wsbeg+1);
+		e.fname[0] = '\x00';
+		e.xa_file = 0;
+		e.xa_channel = 0;
+		e.fp = NULL;
+		if(e.type != ILV_NULL && fscanf(fp, " %127s", e.fname) != 1) {
+			printf("ERROR: \"%s\": expected a file name\n", fname);
+			count = -1;
+			break;
 		}
-
-		// Skip empty lines
-		if(linebuf[0] == '\x00') {
-			continue;
+		if(e.type == ILV_XA || e.type == ILV_XACD) {
+			// Optional, and only ever given as a pair
+			if(fscanf(fp, " %d %d", &e.xa_file, &e.xa_channel) != 2) {
+				e.xa_file = 0;
+				e.xa_channel = 0;
+			}
 		}
 
-		// Do a split against '='
-		char *c_eq = strchr(linebuf, '=');
-		if(c_eq == NULL) {
-			printf("ERROR: expected '=' in line: \"%s\"\n", linebuf);
-			return 1;
+		if(count >= ILV_ENTRY_MAX || e.sectors <= 0) {
+			printf("ERROR: \"%s\": bad entry %d\n", fname, count);
+			count = -1;
+			break;
 		}
-		assert(*c_eq == '=');
-		*c_eq = '\x00';
+		ents[count++] = e;
+	}
 
-		char *arg1 = c_eq+1;
-		if(!strcmp(linebuf, "bin")) {
-			assert(fname_bin == NULL);
-			fname_bin = strdup(arg1);
-		} else if(!strcmp(linebuf, "cue")) {
-			assert(fname_cue == NULL);
-			fname_cue = strdup(arg1);
-		} else if(!strcmp(linebuf, "lic")) {
-			assert(fname_lic == NULL);
-			fname_lic = strdup(arg1);
+	if(count == 0) {
+		printf("ERROR: \"%s\": empty pattern\n", fname);
+		count = -1;
+	}
+	fclose(fp);
+	return count;
+}
 
-		} else if(!strcmp(linebuf, "dat")) {
-			assign_dent(arg1, DENT_DAT);
-		} else if(!strcmp(linebuf, "raw")) {
-			assign_dent(arg1, DENT_RAW);
+int ilv_source_size(ilvtype_t type)
+{
+	return (type == ILV_XA ? 0x920 : 0x930);
+}
 
-		} else {
-			printf("ERROR: unhandled: [%s] = [%s]\n", linebuf, arg1);
-			return 1;
-		}
+// Fills in sectors, data_len, mtime and hash for a DENT_ILV entry
+void ingest_ilv(locdent_t *D)
+{
+	ilvent_t ents[ILV_ENTRY_MAX];
+	int count = parse_ilv(D->ilv_fname, ents);
+	if(count < 0) {
+		exit(1);
 	}
 
-	// Close manifest
+	struct stat st;
+	if(stat(D->ilv_fname, &st) != 0) {
+		printf("ERROR: could not stat \"%s\": %s\n", D->ilv_fname, strerror(errno));
+		exit(1);
+	}
+	D->mtime = stat_mtime(&st);
+
+	int rounds = 0;
+	int round_sectors = 0;
+	for(int i = 0; i < count; i++) {
+		ilvent_t *e = &ents[i];
+		round_sectors += e->sectors;
+		if(e->type == ILV_NULL) { continue; }
+
+		if(stat(e->fname, &st) != 0) {
+			printf("ERROR: could not stat \"%s\": %s\n", e->fname, strerror(errno));
+			exit(1);
+		}
+		if(stat_mtime(&st) > D->mtime) {
+			D->mtime = stat_mtime(&st);
+		}
+
+		int n = st.st_size/ilv_source_size(e->type);
+		int r = (n+e->sectors-1)/e->sectors;
+		if(r > rounds) {
+			rounds = r;
+		}
+	}
+
+	D->sectors = rounds*round_sectors;
+	D->data_len = D->sectors*0x930;
+
+	// Only rehash if something looks like it's been touched
+	int k = find_idxent(D->loc_fname);
+	if(k != -1 && idx_list[k].data_len == D->data_len && idx_list[k].mtime == D->mtime) {
+		D->hash = idx_list[k].hash;
+		return;
+	}
+
+	if(hash_file(&D->hash, D->ilv_fname) != 0) {
+		printf("ERROR: could not read \"%s\": %s\n", D->ilv_fname, strerror(errno));
+		exit(1);
+	}
+	for(int i = 0; i < count; i++) {
+		if(ents[i].type == ILV_NULL) { continue; }
+		uint64_t h = 0;
+		if(hash_file(&h, ents[i].fname) != 0) {
+			printf("ERROR: could not read \"%s\": %s\n", ents[i].fname, strerror(errno));
+			exit(1);
+		}
+		D->hash = hash_bytes(D->hash, &h, sizeof(h));
+	}
+}
+
+// Reads the next sector of a stream in raw form.
+// Returns false once the stream has run out.
+bool read_ilv_sector(ilvent_t *e, uint8_t *rawsec)
+{
+	switch(e->type)
+	{
+		case ILV_RAW:
+			return fread(rawsec, 0x930, 1, e->fp) == 1;
+
+		case ILV_XA:
+		case ILV_XACD:
+			if(e->type == ILV_XACD) {
+				if(fread(rawsec, 0x930, 1, e->fp) != 1) { return false; }
+			} else {
+				if(fread(rawsec+0x010, 0x920, 1, e->fp) != 1) { return false; }
+				memset(rawsec, 0, 0x00F);
+				rawsec[0x00F] = 0x02;
+			}
+			if(e->xa_file >= 0) { rawsec[0x010] = rawsec[0x014] = e->xa_file; }
+			if(e->xa_channel >= 0) { rawsec[0x011] = rawsec[0x015] = e->xa_channel & 0x1F; }
+			rawsec[0x92F] = 0xFF; // have encode_sector() generate EDC
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+void write_ilv_sectors(locdent_t *D)
+{
+	ilvent_t ents[ILV_ENTRY_MAX];
+	int count = parse_ilv(D->ilv_fname, ents);
+	if(count < 0) {
+		exit(1);
+	}
+
+	for(int i = 0; i < count; i++) {
+		if(ents[i].type == ILV_NULL) { continue; }
+		printf("Loading \"%s\"\n", ents[i].fname);
+		ents[i].fp = fopen(ents[i].fname, "rb");
+		assert(ents[i].fp != NULL);
+	}
+
+	uint8_t rawsec[0x930];
+	int j = 0;
+	while(j < D->sectors) {
+		for(int i = 0; i < count; i++) {
+			ilvent_t *e = &ents[i];
+			for(int is = 0; is < e->sectors; is++) {
+				if(e->type == ILV_NULL || !read_ilv_sector(e, rawsec)) {
+					memset(rawsec, 0, sizeof(rawsec));
+				}
+				emit_sector((D->sector+j), rawsec, SEC_RAW, 0x00);
+				j++;
+			}
+		}
+	}
+	assert(j == D->sectors);
+
+	for(int i = 0; i < count; i++) {
+		if(ents[i].fp != NULL) {
+			fclose(ents[i].fp);
+		}
+	}
+}
+
+void ingest_file(locdent_t *D)
+{
+	if(D->dmode == DENT_ILV) {
+		ingest_ilv(D);
+		return;
+	}
+
+	struct stat st;
+	if(stat(D->loc_fname, &st) != 0) {
+		printf("ERROR: could not stat \"%s\": %s\n", D->loc_fname, strerror(errno));
+		exit(1);
+	}
+
+	D->data_len = st.st_size;
+	D->mtime = stat_mtime(&st);
+	D->sectors = (D->dmode == DENT_RAW
+		? (D->data_len+0x92F)/0x930
+		: (D->data_len+0x7FF)/0x800);
+
+	// Only rehash files which look like they've been touched
+	int k = find_idxent(D->loc_fname);
+	if(k != -1 && idx_list[k].data_len == D->data_len && idx_list[k].mtime == D->mtime) {
+		D->hash = idx_list[k].hash;
+	} else if(hash_file(&D->hash, D->loc_fname) != 0) {
+		printf("ERROR: could not read \"%s\": %s\n", D->loc_fname, strerror(errno));
+		exit(1);
+	}
+}
+
+void place_duplicates(void)
+{
+	for(int i = 0; i < dent_count; i++) {
+		locdent_t *D = &dent_list[i];
+		if(D->dmode == DENT_DIR || D->dup_of == -1) { continue; }
+
+		D->sector = dent_list[D->dup_of].sector;
+		D->alloc = 0;
+		D->dirty = false;
+	}
+}
+
+bool files_equal(const char *fname_a, const char *fname_b)
+{
+	static uint8_t buf_a[1<<16];
+	static uint8_t buf_b[1<<16];
+	bool equal = false;
+
+	FILE *fp_a = fopen(fname_a, "rb");
+	FILE *fp_b = fopen(fname_b, "rb");
+	if(fp_a != NULL && fp_b != NULL) {
+		for(;;) {
+			size_t amt_a = fread(buf_a, 1, sizeof(buf_a), fp_a);
+			size_t amt_b = fread(buf_b, 1, sizeof(buf_b), fp_b);
+			if(amt_a != amt_b || memcmp(buf_a, buf_b, amt_a)) {
+				break;
+			}
+			if(amt_a == 0) {
+				equal = true;
+				break;
+			}
+		}
+	}
+
+	if(fp_a != NULL) { fclose(fp_a); }
+	if(fp_b != NULL) { fclose(fp_b); }
+	return equal;
+}
+
+// Point files with identical contents at the first copy.
+// Hash matches are confirmed byte-for-byte before being trusted.
+void find_duplicates(void)
+{
+	int dup_count = 0;
+	int sectors_saved = 0;
+
+	for(int i = 0; i < dent_count; i++) {
+		locdent_t *D = &dent_list[i];
+		D->dup_of = -1;
+		if(D->dmode == DENT_DIR || D->dmode == DENT_ILV || D->sectors == 0) { continue; }
+
+		for(int j = 0; j < i; j++) {
+			locdent_t *E = &dent_list[j];
+			if(E->dmode != D->dmode || E->dup_of != -1) { continue; }
+			if(E->data_len != D->data_len || E->hash != D->hash) { continue; }
+			if(!files_equal(E->loc_fname, D->loc_fname)) { continue; }
+
+			printf("dedup: \"%s\" is a copy of \"%s\"\n", D->loc_fname, E->loc_fname);
+			D->dup_of = j;
+			dup_count++;
+			sectors_saved += D->sectors;
+			break;
+		}
+	}
+
+	printf("dedup: %d duplicate files, %d sectors (%d bytes) saved\n",
+		dup_count, sectors_saved, sectors_saved*0x930);
+}
+
+// Lay files out in the given order (see plan_layout()).
+void place_files(const int *order, int order_count)
+{
+	sector_count = 22 + dent_path_count;
+	for(int i = 0; i < order_count; i++) {
+		locdent_t *D = &dent_list[order[i]];
+		assert(D->dmode != DENT_DIR);
+		if(D->dup_of != -1) { continue; }
+
+		D->sector = sector_count;
+		D->alloc = D->sectors;
+		D->dirty = true;
+		sector_count += D->alloc;
+	}
+
+	place_duplicates();
+}
+
+//
+// Access-trace-driven layout
+//
+// A trace is a list of file names (as given in the manifest) or LBAs,
+// one per line, in the order the game reads them. LBAs refer to the
+// image the trace was recorded on: the layout in the index if there is
+// one, manifest order otherwise.
+//
+
+// Rough model of a 2x drive. Short forward gaps get read through,
+// anything else pays a fixed settle time plus a sqrt-shaped sled move.
+#define SEEK_SECTOR_MS (1000.0/150.0)
+#define SEEK_READTHROUGH_MAX 16
+#define SEEK_BASE_MS 80.0
+#define SEEK_STROKE_MS 250.0
+#define SEEK_FULL_STROKE (74*60*75)
+
+typedef struct traceent {
+	int dent;
+	int offs; // sector offset into the file
+	int len; // sectors read
+} traceent_t;
+
+traceent_t *trace_list = NULL;
+int trace_count = 0;
+
+double seek_cost_ms(int from, int to)
+{
+	int dist = (to > from ? to - from : from - to);
+	if(dist == 0) {
+		return 0.0;
+	}
+	if(to > from && dist <= SEEK_READTHROUGH_MAX) {
+		return dist*SEEK_SECTOR_MS;
+	}
+	return SEEK_BASE_MS + SEEK_STROKE_MS*sqrt((double)dist/(double)SEEK_FULL_STROKE);
+}
+
+// starts[] is indexed by dent
+double trace_cost_ms(const int *starts)
+{
+	double total = 0.0;
+	int head = 0;
+	for(int i = 0; i < trace_count; i++) {
+		traceent_t *T = &trace_list[i];
+		int lba = starts[T->dent] + T->offs;
+		total += seek_cost_ms(head, lba);
+		head = lba + T->len;
+	}
+	return total;
+}
+
+void layout_starts(const int *order, int order_count, int *starts)
+{
+	int lba = 22 + dent_path_count;
+	for(int i = 0; i < order_count; i++) {
+		if(dent_list[order[i]].dup_of != -1) { continue; }
+		starts[order[i]] = lba;
+		lba += dent_list[order[i]].sectors;
+	}
+	for(int i = 0; i < order_count; i++) {
+		int dup_of = dent_list[order[i]].dup_of;
+		if(dup_of != -1) {
+			starts[order[i]] = starts[dup_of];
+		}
+	}
+}
+
+int find_trace_dent(const char *name)
+{
+	if(name[0] == '.' && name[1] == '/') { name += 2; }
+	size_t len = strcspn(name, ";");
+
+	for(int i = 0; i < dent_count; i++) {
+		const char *fname = dent_list[i].loc_fname;
+		if(dent_list[i].dmode == DENT_DIR) { continue; }
+		if(fname[0] == '.' && fname[1] == '/') { fname += 2; }
+		if(strlen(fname) == len && !strncasecmp(fname, name, len)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void load_trace(const char *fname, const int *old_starts)
+{
+	FILE *fp = fopen(fname, "r");
+	if(fp == NULL) {
+		printf("ERROR: could not open trace \"%s\": %s\n", fname, strerror(errno));
+		exit(1);
+	}
+
+	char linebuf[LINEBUF_MAX];
+	int trace_max = 0;
+	while(fgets(linebuf, sizeof(linebuf), fp) != NULL) {
+		char *c_comnl = strpbrk(linebuf, "\r\n#");
+		if(c_comnl != NULL) {
+			*c_comnl = '\x00';
+		}
+		char *name = linebuf + strspn(linebuf, " \t");
+		if(name[0] == '\x00') {
+			continue;
+		}
+
+		traceent_t T = { .dent = -1, .offs = 0, .len = 0 };
+		if(strspn(name, "0123456789") == strlen(name)) {
+			int lba = atoi(name);
+			for(int i = 0; i < dent_count; i++) {
+				locdent_t *D = &dent_list[i];
+				if(D->dmode == DENT_DIR) { continue; }
+				if(lba >= old_starts[i] && lba < old_starts[i] + D->sectors) {
+					T.dent = i;
+					T.offs = lba - old_starts[i];
+					T.len = 1;
+					break;
+				}
+			}
+		} else {
+			T.dent = find_trace_dent(name);
+			T.len = (T.dent == -1 ? 0 : dent_list[T.dent].sectors);
+		}
+
+		if(T.dent == -1) {
+			printf("trace: ignoring \"%s\"\n", name);
+			continue;
+		}
+		if(dent_list[T.dent].dup_of != -1) {
+			T.dent = dent_list[T.dent].dup_of;
+		}
+
+		// Merge sequential sector reads
+		if(trace_count > 0) {
+			traceent_t *P = &trace_list[trace_count-1];
+			if(P->dent == T.dent && P->offs + P->len == T.offs) {
+				P->len += T.len;
+				continue;
+			}
+		}
+
+		if(trace_count >= trace_max) {
+			trace_max = (trace_max == 0 ? 256 : trace_max*2);
+			trace_list = realloc(trace_list, sizeof(*trace_list)*trace_max);
+		}
+		trace_list[trace_count++] = T;
+	}
+
+	fclose(fp);
+	printf("trace: %d accesses\n", trace_count);
+}
+
+// Reorder files so that the trace seeks as little as possible.
+//
+// Files are chained greedily by how often one follows another in the
+// trace, which keeps sequentially read files contiguous. The result is
+// then polished by swapping neighbours while the modelled cost drops.
+// Files the trace never touches go last, in manifest order.
+void plan_layout(int *order, int order_count)
+{
+	static int follows[MAX_DENTS];
+	static int first_seen[MAX_DENTS];
+	static bool placed[MAX_DENTS];
+	static int starts[MAX_DENTS];
+	int new_order[MAX_DENTS];
+	int new_count = 0;
+
+	for(int i = 0; i < dent_count; i++) {
+		first_seen[i] = INT32_MAX;
+		placed[i] = false;
+	}
+	for(int i = trace_count-1; i >= 0; i--) {
+		first_seen[trace_list[i].dent] = i;
+	}
+
+	layout_starts(order, order_count, starts);
+	double cost_before = trace_cost_ms(starts);
+
+	int prev = -1;
+	for(;;) {
+		// Count what follows the previous file
+		int best = -1;
+		if(prev != -1) {
+			memset(follows, 0, sizeof(follows[0])*dent_count);
+			for(int i = 0; i+1 < trace_count; i++) {
+				if(trace_list[i].dent == prev) {
+					follows[trace_list[i+1].dent]++;
+				}
+			}
+			for(int i = 0; i < dent_count; i++) {
+				if(placed[i] || follows[i] == 0) { continue; }
+				if(best == -1 || follows[i] > follows[best]
+						|| (follows[i] == follows[best] && first_seen[i] < first_seen[best])) {
+					best = i;
+				}
+			}
+		}
+
+		// Otherwise start a new chain at the earliest unplaced file
+		if(best == -1) {
+			for(int i = 0; i < dent_count; i++) {
+				if(placed[i] || first_seen[i] == INT32_MAX) { continue; }
+				if(best == -1 || first_seen[i] < first_seen[best]) {
+					best = i;
+				}
+			}
+		}
+		if(best == -1) {
+			break;
+		}
+
+		placed[best] = true;
+		new_order[new_count++] = best;
+		prev = best;
+	}
+	int traced_count = new_count;
+	for(int i = 0; i < order_count; i++) {
+		if(!placed[order[i]]) {
+			new_order[new_count++] = order[i];
+		}
+	}
+	assert(new_count == order_count);
+
+	layout_starts(new_order, new_count, starts);
+	double cost_after = trace_cost_ms(starts);
+	for(int pass = 0; pass < 8; pass++) {
+		bool improved = false;
+		for(int i = 0; i+1 < traced_count; i++) {
+			int tmp = new_order[i];
+			new_order[i] = new_order[i+1];
+			new_order[i+1] = tmp;
+			layout_starts(new_order, new_count, starts);
+			double cost = trace_cost_ms(starts);
+			if(cost < cost_after) {
+				cost_after = cost;
+				improved = true;
+			} else {
+				new_order[i+1] = new_order[i];
+				new_order[i] = tmp;
+			}
+		}
+		if(!improved) {
+			break;
+		}
+	}
+
+	// Never make things worse than the manifest order
+	if(cost_after < cost_before) {
+		memcpy(order, new_order, sizeof(order[0])*order_count);
+	} else {
+		cost_after = cost_before;
+	}
+
+	printf("layout: estimated seek time %.1f ms -> %.1f ms\n", cost_before, cost_after);
+}
+
+// Reuse the previous layout if every file still fits where it was.
+// Returns 0 on success, -1 if a full rebuild is needed.
+int place_files_incremental(void)
+{
+	if(idx_dir_count != dent_path_count || idx_config_hash != config_hash) {
+		printf("Directories or layout settings changed, doing full rebuild\n");
+		return -1;
+	}
+
+	for(int i = 0; i < dent_count; i++) {
+		locdent_t *D = &dent_list[i];
+		if(D->dmode == DENT_DIR) { continue; }
+
+		int k = find_idxent(D->loc_fname);
+		if(k == -1 || idx_list[k].dmode != D->dmode) {
+			printf("\"%s\" is new, doing full rebuild\n", D->loc_fname);
+			return -1;
+		}
+		idxent_t *I = &idx_list[k];
+		bool was_dup = (I->alloc == 0 && I->sectors != 0);
+		bool is_dup = (D->dup_of != -1);
+		if(was_dup != is_dup) {
+			printf("\"%s\" %s a duplicate, doing full rebuild\n", D->loc_fname, is_dup ? "became" : "is no longer");
+			return -1;
+		}
+		if(is_dup) {
+			continue;
+		}
+		if(D->sectors > I->alloc) {
+			printf("\"%s\" outgrew its %d sectors, doing full rebuild\n", D->loc_fname, I->alloc);
+			return -1;
+		}
+
+		D->sector = I->sector;
+		D->alloc = I->alloc;
+		D->dirty = (D->hash != I->hash || D->data_len != I->data_len || D->sectors != I->sectors);
+	}
+
+	sector_count = idx_sector_count;
+	place_duplicates();
+	return 0;
+}
+
+void fill_dent_records(void)
+{
+	for(int i = 0; i < dent_count; i++) {
+		locdent_t *D = &dent_list[i];
+		uint32_t dlen = (D->dmode == DENT_DAT ? D->data_len
+			: D->dmode == DENT_RAW || D->dmode == DENT_ILV ? (uint32_t)D->sectors*0x800
+			: 0x800);
+
+		D->isodent.dblk_le = TOLE32(D->sector);
+		D->isodent.dblk_be = TOBE32(D->sector);
+		D->isodent.dlen_le = TOLE32(dlen);
+		D->isodent.dlen_be = TOBE32(dlen);
+	}
+}
+
+void write_file_sectors(locdent_t *D)
+{
+	uint8_t secdata_in_data[0x800];
+	uint8_t secdata_in_raw[0x930];
+
+	switch(D->dmode) {
+		case DENT_DAT: {
+			char *dat_buf = NULL;
+			size_t dat_len = 0;
+			load_whole_file(&dat_buf, &dat_len, D->loc_fname);
+			assert(dat_len == D->data_len);
+			int dat_sectors = D->sectors;
+
+			for(int j = 0; j < dat_sectors; j++) {
+				memset(secdata_in_data, 0, sizeof(secdata_in_data));
+				memcpy(secdata_in_data, dat_buf+0x800*j,
+					(j < dat_sectors-1 ? 0x800: dat_len-0x800*j));
+				emit_sector((D->sector+j), secdata_in_data, SEC_MODE2_FORM1, (j+1 == dat_sectors ? 0x89 : 0x08));
+			}
+
+			free_whole_file(&dat_buf, &dat_len);
+		} break;
+
+		case DENT_RAW: {
+			char *raw_buf = NULL;
+			size_t raw_len = 0;
+			load_whole_file(&raw_buf, &raw_len, D->loc_fname);
+			assert(raw_len == D->data_len);
+			int raw_sectors = D->sectors;
+
+			for(int j = 0; j < raw_sectors; j++) {
+				memset(secdata_in_raw, 0, sizeof(secdata_in_raw));
+				memcpy(secdata_in_raw, raw_buf+0x930*j,
+					(j < raw_sectors-1 ? 0x930: raw_len-0x930*j));
+				emit_sector((D->sector+j), secdata_in_raw, SEC_RAW, 0x00);
+			}
+
+			free_whole_file(&raw_buf, &raw_len);
+		} break;
+
+		case DENT_ILV:
+			write_ilv_sectors(D);
+			break;
+
+		default:
+			assert(!"halp");
+			abort();
+	}
+
+	// Blank out whatever a shrunken file left behind
+	memset(secdata_in_data, 0, sizeof(secdata_in_data));
+	for(int j = D->sectors; j < D->alloc; j++) {
+		emit_sector((D->sector+j), secdata_in_data, SEC_MODE2_FORM1, 0x00);
+	}
+}
+
+//
+// LBA index for runtime code
+//
+// Lets a game go straight to a file with seedy_read_data_sync() instead
+// of walking the filesystem. lbh= gives a C header of #defines, lbt= a
+// binary table in the format seedy_lbt_find() reads (see seedy.h).
+//
+
+#define LBT_NAME_MAX 23
+#define LBT_MODE_DAT 0
+#define LBT_MODE_RAW 1
+
+// Path as it appears on the disc, e.g. "./data/tex.bin" -> "DATA/TEX.BIN"
+void lba_index_name(char *out, size_t out_len, const locdent_t *D)
+{
+	const char *src = D->loc_fname;
+	if(!strncmp(src, "./", 2)) {
+		src += 2;
+	}
+
+	size_t i = 0;
+	for(; src[i] != '\x00' && i+1 < out_len; i++) {
+		out[i] = toupper(src[i]);
+	}
+	out[i] = '\x00';
+}
+
+int write_lba_header(const char *fname)
+{
+	FILE *fp = fopen(fname, "w");
+	if(fp == NULL) {
+		printf("ERROR: could not create \"%s\": %s\n", fname, strerror(errno));
+		return 1;
+	}
+
+	fprintf(fp, "// Generated by pscd-new, do not edit\n");
+	fprintf(fp, "// MODE is 0 for data (0x800-byte sectors), 1 for raw XA/STR sectors\n");
+	fprintf(fp, "#pragma once\n\n");
+	fprintf(fp, "#define CD_SECTOR_COUNT %" PRIu32 "\n", sector_count);
+
+	for(int i = 0; i < dent_count; i++) {
+		locdent_t *D = &dent_list[i];
+		if(D->dmode == DENT_DIR) { continue; }
+
+		char name[FNAME_MAX_LEN_LOC];
+		lba_index_name(name, sizeof(name), D);
+		for(int j = 0; name[j] != '\x00'; j++) {
+			if(!isalnum((unsigned char)name[j])) {
+				name[j] = '_';
+			}
+		}
+
+		fprintf(fp, "\n");
+		fprintf(fp, "#define CD_%s_LBA %d\n", name, D->sector);
+		fprintf(fp, "#define CD_%s_SIZE %" PRIu32 "\n", name, D->data_len);
+		fprintf(fp, "#define CD_%s_SECTORS %d\n", name, D->sectors);
+		fprintf(fp, "#define CD_%s_MODE %d\n", name,
+			(D->dmode == DENT_DAT ? LBT_MODE_DAT : LBT_MODE_RAW));
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+int write_lba_table(const char *fname)
+{
+	uint8_t ent[32];
+	uint32_t count = 0;
+
+	for(int i = 0; i < dent_count; i++) {
+		locdent_t *D = &dent_list[i];
+		if(D->dmode == DENT_DIR) { continue; }
+
+		char name[FNAME_MAX_LEN_LOC];
+		lba_index_name(name, sizeof(name), D);
+		if(strlen(name) >= LBT_NAME_MAX) {
+			printf("ERROR: \"%s\" is too long for the LBA table\n", name);
+			return 1;
+		}
+		count++;
+	}
+
+	FILE *fp = fopen(fname, "wb");
+	if(fp == NULL) {
+		printf("ERROR: could not create \"%s\": %s\n", fname, strerror(errno));
+		return 1;
+	}
+
+	memcpy(ent+0, "LBT1", 4);
+	*(uint32_t *)(ent+4) = TOLE32(count);
+	fwrite(ent, 8, 1, fp);
+
+	for(int i = 0; i < dent_count; i++) {
+		locdent_t *D = &dent_list[i];
+		if(D->dmode == DENT_DIR) { continue; }
+
+		memset(ent, 0, sizeof(ent));
+		lba_index_name((char *)ent, LBT_NAME_MAX, D);
+		ent[23] = (D->dmode == DENT_DAT ? LBT_MODE_DAT : LBT_MODE_RAW);
+		*(uint32_t *)(ent+24) = TOLE32(D->sector);
+		*(uint32_t *)(ent+28) = TOLE32(D->data_len);
+		fwrite(ent, sizeof(ent), 1, fp);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	init_tables();
+
+	if(argc <= 1) {
+		printf("usage:\n\t%s manifest.txt\n\t%s -x image.ecm image.bin\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	if(!strcmp(argv[1], "-x")) {
+		if(argc != 4) {
+			printf("usage:\n\t%s -x image.ecm image.bin\n", argv[0]);
+			return 1;
+		}
+		return expand_ecm(argv[2], argv[3]);
+	}
+
+	//
+	// Parse manifest
+	//
+
+	FILE *manifestfp = fopen(argv[1], "r");
+	char linebuf[LINEBUF_MAX];
+
+	char *fname_bin = NULL;
+	char *fname_cue = NULL;
+	char *fname_lic = NULL;
+	char *fname_idx = NULL;
+	char *fname_layout = NULL;
+	char *fname_ecm = NULL;
+	char *fname_lbh = NULL;
+	char *fname_lbt = NULL;
+	bool dedup = false; // "dedup=1" in the manifest turns it on
+
+	//assign_dent(".", DENT_DIR);
+
+	for(;;)
+	{
+		// Get line
+		char *ret_fgets = fgets(linebuf, sizeof(linebuf), manifestfp);
+		if(ret_fgets == NULL) {
+			assert(feof(manifestfp));
+			break;
+		}
+
+		// Strip comment/newlines
+		char *c_comnl = strpbrk(linebuf, "\r\n#");
+		if(c_comnl != NULL) {
+			*c_comnl = '\x00';
+		}
+
+		// Strip leading whitespace
+		size_t wsbeg = strspn(linebuf, " \t\r\n");
+		if(wsbeg != 0) {
+			size_t l = strlen(linebuf);
+			memmove(linebuf, linebuf+wsbeg, l-wsbeg+1);
+		}
+
+		// Skip empty lines
+		if(linebuf[0] == '\x00') {
+			continue;
+		}
+
+		// Do a split against '='
+		char *c_eq = strchr(linebuf, '=');
+		if(c_eq == NULL) {
+			printf("ERROR: expected '=' in line: \"%s\"\n", linebuf);
+			return 1;
+		}
+		assert(*c_eq == '=');
+		*c_eq = '\x00';
+
+		char *arg1 = c_eq+1;
+		if(!strcmp(linebuf, "bin")) {
+			assert(fname_bin == NULL);
+			fname_bin = strdup(arg1);
+		} else if(!strcmp(linebuf, "cue")) {
+			assert(fname_cue == NULL);
+			fname_cue = strdup(arg1);
+		} else if(!strcmp(linebuf, "lic")) {
+			assert(fname_lic == NULL);
+			fname_lic = strdup(arg1);
+		} else if(!strcmp(linebuf, "idx")) {
+			assert(fname_idx == NULL);
+			fname_idx = strdup(arg1);
+		} else if(!strcmp(linebuf, "layout")) {
+			assert(fname_layout == NULL);
+			fname_layout = strdup(arg1);
+		} else if(!strcmp(linebuf, "ecm")) {
+			assert(fname_ecm == NULL);
+			fname_ecm = strdup(arg1);
+		} else if(!strcmp(linebuf, "lbh")) {
+			assert(fname_lbh == NULL);
+			fname_lbh = strdup(arg1);
+		} else if(!strcmp(linebuf, "lbt")) {
+			assert(fname_lbt == NULL);
+			fname_lbt = strdup(arg1);
+		} else if(!strcmp(linebuf, "dedup")) {
+			dedup = (atoi(arg1) != 0);
+		} else if(!strcmp(linebuf, "dat")) {
+			assign_dent(arg1, DENT_DAT);
+		} else if(!strcmp(linebuf, "raw")) {
+			assign_dent(arg1, DENT_RAW);
+		} else if(!strcmp(linebuf, "ilv")) {
+			// ilv=<name on disc>,<pattern file>
+			char *c_comma = strchr(arg1, ',');
+			if(c_comma == NULL) {
+				printf("ERROR: expected ilv=<name>,<pattern>: \"%s\"\n", arg1);
+				return 1;
+			}
+			*c_comma = '\x00';
+			int k = assign_dent(arg1, DENT_ILV);
+			strncpy(dent_list[k].ilv_fname, c_comma+1, sizeof(dent_list[k].ilv_fname)-1);
+
+		} else {
+			printf("ERROR: unhandled: [%s] = [%s]\n", linebuf, arg1);
+			return 1;
+		}
+	}
+
+	// Close manifest
 	fclose(manifestfp);
 
 	// Sort directories in 1. parent node order, 2. alphabetical order
@@ -737,6 +2073,10 @@ int main(int argc, char *argv[])
 	assert(fname_bin != NULL);
 	assert(fname_cue != NULL);
 	assert(fname_lic != NULL);
+	if(fname_ecm != NULL && fname_idx != NULL) {
+		printf("ERROR: idx= needs a .bin to update, it cannot be used with ecm=\n");
+		return 1;
+	}
 
 	printf("Building CD image...\n");
 
@@ -746,14 +2086,101 @@ int main(int argc, char *argv[])
 	load_whole_file(&licence_buf, &licence_len, fname_lic);
 	assert(licence_len == 0x930*16);
 
-	// Start producing bin file
-	FILE *binfp = fopen(fname_bin, "w+b");
-	uint8_t secdata_out[0x930];
+	// Work out where everything goes
+	config_hash = hash_bytes(config_hash, &dedup, sizeof(dedup));
+	if(fname_layout != NULL) {
+		uint64_t layout_hash = 0;
+		if(hash_file(&layout_hash, fname_layout) != 0) {
+			printf("ERROR: could not read trace \"%s\": %s\n", fname_layout, strerror(errno));
+			return 1;
+		}
+		config_hash = hash_bytes(config_hash, &layout_hash, sizeof(layout_hash));
+	}
+	if(fname_idx != NULL && load_index(fname_idx) != 0) {
+		printf("No usable index in \"%s\", doing full rebuild\n", fname_idx);
+		idx_count = 0;
+	}
+	for(int i = 0; i < dent_count; i++) {
+		if(dent_list[i].dmode != DENT_DIR) {
+			ingest_file(&dent_list[i]);
+		}
+	}
+	if(dedup) {
+		find_duplicates();
+	}
+
+	bool incremental = false;
+	if(idx_count != 0) {
+		struct stat st;
+		if(stat(fname_bin, &st) != 0 || st.st_size != (off_t)idx_sector_count*0x930) {
+			printf("\"%s\" does not match the index, doing full rebuild\n", fname_bin);
+		} else {
+			incremental = (place_files_incremental() == 0);
+		}
+	}
+	if(!incremental) {
+		int order[MAX_DENTS];
+		int order_count = 0;
+		for(int i = 0; i < dent_count; i++) {
+			if(dent_list[i].dmode != DENT_DIR) {
+				order[order_count++] = i;
+			}
+		}
+
+		if(fname_layout != NULL) {
+			// Map trace LBAs through the previous layout if we know it
+			int old_starts[MAX_DENTS];
+			layout_starts(order, order_count, old_starts);
+			bool have_old = (idx_count != 0);
+			for(int i = 0; i < order_count && have_old; i++) {
+				int k = find_idxent(dent_list[order[i]].loc_fname);
+				have_old = (k != -1);
+			}
+			for(int i = 0; i < order_count && have_old; i++) {
+				old_starts[order[i]] = idx_list[find_idxent(dent_list[order[i]].loc_fname)].sector;
+			}
+
+			load_trace(fname_layout, old_starts);
+			plan_layout(order, order_count);
+		}
+
+		place_files(order, order_count);
+	}
+	fill_dent_records();
+
+	// Start producing bin file (or the ECM image standing in for it)
 	uint8_t secdata_in_data[0x800];
-	uint8_t secdata_in_raw[0x930];
-	assert(binfp != NULL);
-	fwrite(licence_buf, licence_len, 1, binfp);
-	sector_count = 22 + dent_path_count;
+	if(fname_ecm != NULL) {
+		ecmfp = fopen(fname_ecm, "wb");
+		assert(ecmfp != NULL);
+		uint32_t ecm_total = TOLE32(sector_count);
+		fwrite(ECM_MAGIC, 8, 1, ecmfp);
+		fwrite(&ecm_total, 4, 1, ecmfp);
+	} else {
+		bin_open(&binw, fname_bin, sector_count, incremental);
+	}
+
+	// Put files everywhere
+	for(int i = 0; i < dent_count; i++) {
+		locdent_t *D = &dent_list[i];
+		if(D->dmode == DENT_DIR) { continue; }
+		if(D->dup_of != -1) {
+			printf("file \"%s\" shares \"%s\"\n", D->loc_fname, dent_list[D->dup_of].loc_fname);
+			continue;
+		}
+		if(!D->dirty) {
+			printf("file \"%s\" unchanged\n", D->loc_fname);
+			continue;
+		}
+		printf("file \"%s\"\n", D->loc_fname);
+		write_file_sectors(D);
+	}
+
+	// Everything from here on lives in sectors 0..22+dirs, which are
+	// written front to back so they go out as a single extent
+	for(int i = 0; i < 16; i++) {
+		emit_raw_sector(i, (uint8_t *)licence_buf+0x930*i);
+	}
 
 	// Generate path table
 	// We have to do a little-endian ver and a big-endian ver
@@ -762,9 +2189,9 @@ int main(int argc, char *argv[])
 	}
 
 	int ptsize = 0;
+	uint8_t pathtab_data[2][0x800];
 	for(int i = 0; i < 4; i+=2) {
 		ptsize = 0;
-		fseek(binfp, 0x930*(18+i), SEEK_SET);
 		memset(secdata_in_data, 0, sizeof(secdata_in_data));
 
 		// XXX: Does this require everything to be ordered by depth?
@@ -815,142 +2242,14 @@ int main(int argc, char *argv[])
 			pent_idx++;
 		}
 
-		encode_sector(secdata_out, secdata_in_data, (18+i), SEC_MODE2_FORM1, 0x89);
-		fwrite(secdata_out, 0x930, 1, binfp);
-		encode_sector(secdata_out, secdata_in_data, (19+i), SEC_MODE2_FORM1, 0x89);
-		fwrite(secdata_out, 0x930, 1, binfp);
+		// Needs the PVD to go first, so hold onto it for now
+		memcpy(pathtab_data[i/2], secdata_in_data, sizeof(secdata_in_data));
 	}
 	printf("ptsize = %d\n", ptsize);
 
-	// Put files everywhere
-	for(int i = 0; i < dent_count; i++) {
-		locdent_t *D = &dent_list[i];
-		//if(D->dmode == DENT_DIR) { continue; }
-		printf("file \"%s\"\n", D->loc_fname);
-
-		switch(D->dmode) {
-			case DENT_DAT: {
-				char *dat_buf = NULL;
-				size_t dat_len = 0;
-				load_whole_file(&dat_buf, &dat_len, D->loc_fname);
-				int dat_sectors = (dat_len+0x7FF)/0x800;
-
-				D->sector = sector_count;
-				D->isodent.dblk_le = TOLE32(D->sector);
-				D->isodent.dblk_be = TOBE32(D->sector);
-				D->isodent.dlen_le = TOLE32(dat_len);
-				D->isodent.dlen_be = TOBE32(dat_len);
-				sector_count += dat_sectors;
-
-				//fseek(binfp, 0x930*(D->sector+j), SEEK_SET);
-				fseek(binfp, 0x930*(D->sector), SEEK_SET);
-				for(int j = 0; j < dat_sectors; j++) {
-					memset(secdata_in_data, 0, sizeof(secdata_in_data));
-					memcpy(secdata_in_data, dat_buf+0x800*j,
-						(j < dat_sectors-1 ? 0x800: dat_len-0x800*j));
-					encode_sector(secdata_out, secdata_in_data, (D->sector+j), SEC_MODE2_FORM1, (j+1 == dat_sectors ? 0x89 : 0x08));
-					fwrite(secdata_out, 0x930, 1, binfp);
-				}
-
-				free_whole_file(&dat_buf, &dat_len);
-			} break;
-
-			case DENT_RAW: {
-				char *raw_buf = NULL;
-				size_t raw_len = 0;
-				load_whole_file(&raw_buf, &raw_len, D->loc_fname);
-				int raw_sectors = (raw_len+0x92F)/0x930;
-				int raw_normlen = raw_sectors*0x800;
-
-				D->sector = sector_count;
-				D->isodent.dblk_le = TOLE32(D->sector);
-				D->isodent.dblk_be = TOBE32(D->sector);
-				D->isodent.dlen_le = TOLE32(raw_normlen);
-				D->isodent.dlen_be = TOBE32(raw_normlen);
-				sector_count += raw_sectors;
-
-				fseek(binfp, 0x930*(D->sector), SEEK_SET);
-				for(int j = 0; j < raw_sectors; j++) {
-					memset(secdata_in_raw, 0, sizeof(secdata_in_raw));
-					memcpy(secdata_in_raw, raw_buf+0x930*j,
-						(j < raw_sectors-1 ? 0x930: raw_len-0x930*j));
-					//fseek(binfp, 0x930*(D->sector+j), SEEK_SET);
-					encode_sector(secdata_out, secdata_in_raw, (D->sector+j), SEC_RAW, 0x00);
-					fwrite(secdata_out, 0x930, 1, binfp);
-				}
-
-				free_whole_file(&raw_buf, &raw_len);
-			} break;
-
-			case DENT_DIR:
-				// Do nothing
-				D->isodent.dblk_le = TOLE32(D->sector);
-				D->isodent.dblk_be = TOBE32(D->sector);
-				D->isodent.dlen_le = TOLE32(0x800);
-				D->isodent.dlen_be = TOBE32(0x800);
-				break;
-
-			default:
-				assert(!"halp");
-				abort();
-				return 99;
-		}
-	}
-
-	// Generate directories
-	for(int i = 0; i < dent_count; i++) {
-		locdent_t *D = &dent_list[i];
-		if(D->dmode != DENT_DIR) { continue; }
-		fseek(binfp, 0x930*(22+D->path_idx), SEEK_SET);
-
-		memset(secdata_in_data, 0, sizeof(secdata_in_data));
-
-		printf("Directory! %d %d %d %d \"%s\"\n", i, D->path_idx, D->sector, D->parent_dir, D->isodent.fname);
-		uint8_t *p = secdata_in_data;
-
-		// Generate main link
-		memcpy(p, &D->isodent, sizeof(D->isodent)-FNAME_MAX_LEN_ISO);
-		((isodent_t *)p)->len_fi = 1;
-		((isodent_t *)p)->len_dr = 33+1+14;
-		p += sizeof(D->isodent)-FNAME_MAX_LEN_ISO;
-		*(p++) = '\x00';
-		memcpy(p, &D->xadent, sizeof(D->xadent));
-		p += sizeof(D->xadent);
-
-		// Generate back link
-		assert(D->parent_dir >= 0);
-		locdent_t *E = &dent_list[D->parent_dir];
-		memcpy(p, &E->isodent, sizeof(E->isodent)-FNAME_MAX_LEN_ISO);
-		((isodent_t *)p)->len_fi = 1;
-		((isodent_t *)p)->len_dr = 33+1+14;
-		p += sizeof(E->isodent)-FNAME_MAX_LEN_ISO;
-		*(p++) = '\x01';
-		memcpy(p, &E->xadent, sizeof(E->xadent));
-		p += sizeof(E->xadent);
-
-		// Generate file stuff
-		for(int j = 0; j < dent_count; j++) {
-			locdent_t *F = &dent_list[dent_remap[j]];
-			if(j == i) { continue; }
-			if(F->parent_dir != i) { continue; }
-			printf("- %d %d \"%s\"\n", j, F->sector, F->isodent.fname);
-			memcpy(p, &F->isodent, sizeof(F->isodent)-FNAME_MAX_LEN_ISO+F->isodent.len_fi);
-			//p += sizeof(F->isodent)-FNAME_MAX_LEN_ISO+((F->isodent.len_fi+1)&~1);
-			p += F->isodent.len_dr-sizeof(F->xadent);
-			memcpy(p, &F->xadent, sizeof(F->xadent));
-			p += sizeof(F->xadent);
-		}
-
-		// TODO!
-
-		encode_sector(secdata_out, secdata_in_data, (22+D->path_idx), SEC_MODE2_FORM1, 0x89);
-		fwrite(secdata_out, 0x930, 1, binfp);
-	}
-
 	printf("sector_count = %d\n", sector_count);
 
 	// Generate PVD
-	fseek(binfp, 0x930*16, SEEK_SET);
 	pvd_t pvd = {
 		.vdtype = 0x01, // 0x01 = PVD
 		.magic1 = "CD001", // "CD001"
@@ -995,8 +2294,7 @@ int main(int argc, char *argv[])
 		.fsver = 0x01,
 		.xamagic1 = "CD-XA001",
 	};
-	encode_sector(secdata_out, (uint8_t *)&pvd, 16, SEC_MODE2_FORM1, 0x09);
-	fwrite(secdata_out, 0x930, 1, binfp);
+	emit_sector(16, (uint8_t *)&pvd, SEC_MODE2_FORM1, 0x09);
 
 	// Generate VDST
 	vdst_t vdst = {
@@ -1004,11 +2302,80 @@ int main(int argc, char *argv[])
 		.magic1 = "CD001", // "CD001"
 		.vdver = 0x01, // 0x01
 	};
-	encode_sector(secdata_out, (uint8_t *)&vdst, 17, SEC_MODE2_FORM1, 0x89);
-	fwrite(secdata_out, 0x930, 1, binfp);
+	emit_sector(17, (uint8_t *)&vdst, SEC_MODE2_FORM1, 0x89);
+
+	// Write out path tables
+	for(int i = 0; i < 4; i++) {
+		emit_sector((18+i), pathtab_data[i/2], SEC_MODE2_FORM1, 0x89);
+	}
+
+	// Generate directories
+	for(int i = 0; i < dent_count; i++) {
+		locdent_t *D = &dent_list[i];
+		if(D->dmode != DENT_DIR) { continue; }
+		memset(secdata_in_data, 0, sizeof(secdata_in_data));
+
+		printf("Directory! %d %d %d %d \"%s\"\n", i, D->path_idx, D->sector, D->parent_dir, D->isodent.fname);
+		uint8_t *p = secdata_in_data;
+
+		// Generate main link
+		memcpy(p, &D->isodent, sizeof(D->isodent)-FNAME_MAX_LEN_ISO);
+		((isodent_t *)p)->len_fi = 1;
+		((isodent_t *)p)->len_dr = 33+1+14;
+		p += sizeof(D->isodent)-FNAME_MAX_LEN_ISO;
+		*(p++) = '\x00';
+		memcpy(p, &D->xadent, sizeof(D->xadent));
+		p += sizeof(D->xadent);
+
+		// Generate back link
+		assert(D->parent_dir >= 0);
+		locdent_t *E = &dent_list[D->parent_dir];
+		memcpy(p, &E->isodent, sizeof(E->isodent)-FNAME_MAX_LEN_ISO);
+		((isodent_t *)p)->len_fi = 1;
+		((isodent_t *)p)->len_dr = 33+1+14;
+		p += sizeof(E->isodent)-FNAME_MAX_LEN_ISO;
+		*(p++) = '\x01';
+		memcpy(p, &E->xadent, sizeof(E->xadent));
+		p += sizeof(E->xadent);
+
+		// Generate file stuff
+		for(int j = 0; j < dent_count; j++) {
+			locdent_t *F = &dent_list[dent_remap[j]];
+			if(j == i) { continue; }
+			if(F->parent_dir != i) { continue; }
+			printf("- %d %d \"%s\"\n", j, F->sector, F->isodent.fname);
+			memcpy(p, &F->isodent, sizeof(F->isodent)-FNAME_MAX_LEN_ISO+F->isodent.len_fi);
+			//p += sizeof(F->isodent)-FNAME_MAX_LEN_ISO+((F->isodent.len_fi+1)&~1);
+			p += F->isodent.len_dr-sizeof(F->xadent);
+			memcpy(p, &F->xadent, sizeof(F->xadent));
+			p += sizeof(F->xadent);
+		}
+
+		// TODO!
+
+		emit_sector((22+D->path_idx), secdata_in_data, SEC_MODE2_FORM1, 0x89);
+	}
 
 	// Close bin file
-	fclose(binfp);
+	if(ecmfp != NULL) {
+		fclose(ecmfp);
+		ecmfp = NULL;
+	} else {
+		bin_close(&binw);
+	}
+
+	// Tell runtime code where everything went
+	if(fname_lbh != NULL && write_lba_header(fname_lbh) != 0) {
+		return 1;
+	}
+	if(fname_lbt != NULL && write_lba_table(fname_lbt) != 0) {
+		return 1;
+	}
+
+	// Remember the layout for next time
+	if(fname_idx != NULL) {
+		save_index(fname_idx);
+	}
 
 	// Do cue file
 	{
@@ -0,0 +1,324 @@
+/*
+psxavdec: XA-ADPCM and SPU-ADPCM decoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libpsxav.h"
+
+#define FORMAT_XA 0
+#define FORMAT_XACD 1
+#define FORMAT_SPU 2
+
+#define MAX_CHANNELS 32
+#define WAV_HEADER_SIZE 44
+
+typedef struct {
+	int format; // FORMAT_*
+	int file_number; // -1 = the first one found
+	int channel_number; // -1 = the first one found
+	bool all_channels;
+	bool raw;
+	int frequency; // SPU only; XA takes it from the subheader
+} settings_t;
+
+typedef struct {
+	FILE *fp;
+	char filename[4096];
+	psx_audio_decoder_state_t state;
+	int frequency;
+	int channels;
+	uint64_t sample_count; // per channel
+} output_t;
+
+static void print_help(void) {
+	fprintf(stderr, "Usage: psxavdec [-t xa|xacd|str2|spu] [-F num] [-C num] [-a] [-f freq] [-r] <in> <out>\n\n");
+	fprintf(stderr, "    -t format        Input type:\n");
+	fprintf(stderr, "                       xa     .xa 2336-byte sectors\n");
+	fprintf(stderr, "                       xacd   .xa 2352-byte sectors\n");
+	fprintf(stderr, "                       str2   .str 2352-byte sectors (video is skipped)\n");
+	fprintf(stderr, "                       spu    raw SPU-ADPCM data, up to the loop end flag\n");
+	fprintf(stderr, "    -F num           [.xa] Decode file number num (default: the first one found)\n");
+	fprintf(stderr, "    -C num           [.xa] Decode channel num (default: the first one found)\n");
+	fprintf(stderr, "    -a               [.xa] Decode every channel, to <out> with .NN before the extension\n");
+	fprintf(stderr, "    -f freq          [spu] Sample rate to put in the .wav header (default: 37800)\n");
+	fprintf(stderr, "    -r               Write raw 16-bit PCM instead of .wav\n");
+	fprintf(stderr, "    <in>, <out>      \"-\" reads stdin or writes stdout\n");
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+	put_u16(p, (uint16_t)v);
+	put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+// Sizes are left at 0xFFFFFFFF until the output is finished, which is also
+// what gets left behind on a pipe.
+static void write_wav_header(output_t *out, uint32_t data_size) {
+	uint8_t header[WAV_HEADER_SIZE];
+	int block_align = 2 * out->channels;
+
+	memcpy(header, "RIFF", 4);
+	put_u32(header + 4, data_size == 0xFFFFFFFF ? data_size : data_size + WAV_HEADER_SIZE - 8);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	put_u32(header + 16, 16);
+	put_u16(header + 20, 1); // PCM
+	put_u16(header + 22, out->channels);
+	put_u32(header + 24, out->frequency);
+	put_u32(header + 28, out->frequency * block_align);
+	put_u16(header + 32, block_align);
+	put_u16(header + 34, 16);
+	memcpy(header + 36, "data", 4);
+	put_u32(header + 40, data_size);
+	fwrite(header, sizeof(header), 1, out->fp);
+}
+
+static bool open_output(output_t *out, const char *filename, int frequency, int channels, settings_t *settings) {
+	out->fp = (strcmp(filename, "-") == 0) ? stdout : fopen(filename, "wb");
+	if (out->fp == NULL) {
+		fprintf(stderr, "Could not open output file %s!\n", filename);
+		return false;
+	}
+	snprintf(out->filename, sizeof(out->filename), "%s", filename);
+	memset(&(out->state), 0, sizeof(psx_audio_decoder_state_t));
+	out->frequency = frequency;
+	out->channels = channels;
+	out->sample_count = 0;
+	if (!settings->raw) {
+		write_wav_header(out, 0xFFFFFFFF);
+	}
+	return true;
+}
+
+static void close_output(output_t *out, settings_t *settings) {
+	uint64_t data_size = out->sample_count * out->channels * 2;
+
+	if (!settings->raw && out->fp != stdout && data_size <= 0xFFFFFFFF - WAV_HEADER_SIZE && fseek(out->fp, 0, SEEK_SET) == 0) {
+		write_wav_header(out, (uint32_t)data_size);
+	}
+	if (out->fp != stdout) {
+		fclose(out->fp);
+	} else {
+		fflush(stdout);
+	}
+	fprintf(stderr, "Wrote %s: %d Hz %s, %.2f s\n", out->filename, out->frequency,
+		out->channels == 2 ? "stereo" : "mono", (double)out->sample_count / out->frequency);
+}
+
+// "music.wav" -> "music.03.wav"
+static void channel_filename(char *buffer, size_t size, const char *filename, int channel) {
+	const char *ext = strrchr(filename, '.');
+	const char *slash = strrchr(filename, '/');
+	if (ext == NULL || (slash != NULL && ext < slash)) {
+		ext = filename + strlen(filename);
+	}
+	snprintf(buffer, size, "%.*s.%02d%s", (int)(ext - filename), filename, channel, ext);
+}
+
+static int decode_xa(settings_t *settings, FILE *input, const char *output_name) {
+	output_t outputs[MAX_CHANNELS];
+	uint8_t sector[2352];
+	int16_t samples[4032];
+	int sector_size = (settings->format == FORMAT_XA) ? 2336 : 2352;
+	const uint8_t *subheader = sector + ((settings->format == FORMAT_XA) ? 0 : 0x10);
+	int sectors = 0, skipped = 0;
+	int result = 0;
+
+	memset(outputs, 0, sizeof(outputs));
+
+	while (fread(sector, sector_size, 1, input) == 1) {
+		int file = subheader[0];
+		int channel = subheader[1] & 0x1F;
+		int coding = subheader[3];
+
+		// Video, data and null sectors
+		if (!(subheader[2] & 0x04)) {
+			skipped++;
+			continue;
+		}
+		if (settings->file_number < 0) settings->file_number = file;
+		if (!settings->all_channels && settings->channel_number < 0) settings->channel_number = channel;
+		if (file != settings->file_number || (!settings->all_channels && channel != settings->channel_number)) {
+			skipped++;
+			continue;
+		}
+
+		psx_audio_xa_settings_t xa_settings;
+		xa_settings.format = (settings->format == FORMAT_XA) ? PSX_AUDIO_XA_FORMAT_XA : PSX_AUDIO_XA_FORMAT_XACD;
+		xa_settings.stereo = coding & 0x01;
+		xa_settings.frequency = (coding & 0x04) ? PSX_AUDIO_XA_FREQ_SINGLE : PSX_AUDIO_XA_FREQ_DOUBLE;
+		xa_settings.bits_per_sample = (coding & 0x10) ? 8 : 4;
+		xa_settings.file_number = file;
+		xa_settings.channel_number = channel;
+
+		output_t *out = &outputs[channel];
+		if (out->fp == NULL) {
+			char filename[4096];
+			if (settings->all_channels) {
+				channel_filename(filename, sizeof(filename), output_name, channel);
+			} else {
+				snprintf(filename, sizeof(filename), "%s", output_name);
+			}
+			if (!open_output(out, filename, xa_settings.frequency, xa_settings.stereo ? 2 : 1, settings)) {
+				result = 1;
+				break;
+			}
+		}
+
+		int sample_count = psx_audio_xa_decode(xa_settings, &(out->state), sector, samples);
+		fwrite(samples, sizeof(int16_t) * out->channels, sample_count, out->fp);
+		out->sample_count += sample_count;
+		sectors++;
+	}
+
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		if (outputs[i].fp != NULL) {
+			close_output(&outputs[i], settings);
+		}
+	}
+	if (sectors == 0 && result == 0) {
+		fprintf(stderr, "No matching XA audio sectors found\n");
+		return 1;
+	}
+	fprintf(stderr, "Decoded %d sectors, skipped %d\n", sectors, skipped);
+	return result;
+}
+
+static int decode_spu(settings_t *settings, FILE *input, const char *output_name) {
+	output_t out;
+	uint8_t block[16];
+	int16_t samples[28];
+
+	if (!open_output(&out, output_name, settings->frequency, 1, settings)) {
+		return 1;
+	}
+
+	while (fread(block, sizeof(block), 1, input) == 1) {
+		int sample_count = psx_audio_spu_decode(&(out.state), block, sizeof(block), samples);
+		fwrite(samples, sizeof(int16_t), sample_count, out.fp);
+		out.sample_count += sample_count;
+		if (block[1] & PSX_AUDIO_SPU_LOOP_END) {
+			break;
+		}
+	}
+
+	close_output(&out, settings);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	settings_t settings;
+	int c;
+
+	memset(&settings, 0, sizeof(settings_t));
+	settings.format = FORMAT_XA;
+	settings.file_number = -1;
+	settings.channel_number = -1;
+	settings.frequency = PSX_AUDIO_XA_FREQ_DOUBLE;
+
+	while ((c = getopt(argc, argv, "t:F:C:af:rh")) != -1) {
+		switch (c) {
+			case 't': {
+				if (strcmp(optarg, "xa") == 0) {
+					settings.format = FORMAT_XA;
+				} else if (strcmp(optarg, "xacd") == 0 || strcmp(optarg, "str2") == 0) {
+					settings.format = FORMAT_XACD;
+				} else if (strcmp(optarg, "spu") == 0) {
+					settings.format = FORMAT_SPU;
+				} else {
+					fprintf(stderr, "Invalid format: %s\n", optarg);
+					return 1;
+				}
+			} break;
+			case 'F': {
+				settings.file_number = atoi(optarg);
+				if (settings.file_number < 0 || settings.file_number > 255) {
+					fprintf(stderr, "Invalid file number: %d\n", settings.file_number);
+					return 1;
+				}
+			} break;
+			case 'C': {
+				settings.channel_number = atoi(optarg);
+				if (settings.channel_number < 0 || settings.channel_number > 31) {
+					fprintf(stderr, "Invalid channel number: %d\n", settings.channel_number);
+					return 1;
+				}
+			} break;
+			case 'a': {
+				settings.all_channels = true;
+			} break;
+			case 'f': {
+				settings.frequency = atoi(optarg);
+				if (settings.frequency <= 0) {
+					fprintf(stderr, "Invalid frequency: %d Hz\n", settings.frequency);
+					return 1;
+				}
+			} break;
+			case 'r': {
+				settings.raw = true;
+			} break;
+			case '?':
+			case 'h': {
+				print_help();
+				return 1;
+			} break;
+		}
+	}
+
+	if (argc != optind + 2) {
+		print_help();
+		return 1;
+	}
+	const char *input_name = argv[optind];
+	const char *output_name = argv[optind + 1];
+
+	if (settings.all_channels && strcmp(output_name, "-") == 0) {
+		fprintf(stderr, "-a needs an output file name\n");
+		return 1;
+	}
+
+	FILE *input = (strcmp(input_name, "-") == 0) ? stdin : fopen(input_name, "rb");
+	if (input == NULL) {
+		fprintf(stderr, "Could not open input file!\n");
+		return 1;
+	}
+
+	int result;
+	if (settings.format == FORMAT_SPU) {
+		result = decode_spu(&settings, input, output_name);
+	} else {
+		result = decode_xa(&settings, input, output_name);
+	}
+
+	if (input != stdin) {
+		fclose(input);
+	}
+	return result;
+}
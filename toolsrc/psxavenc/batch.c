@@ -0,0 +1,342 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "common.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//
+// Batch mode (-B jobs.txt)
+//
+// Each non-blank line of the job list is a psxavenc command line without
+// the program name, e.g.
+//
+//   -t xa -f 18900 -c 1 sfx/jump.wav out/jump.xa
+//   -t str2 "movies/intro 1.mp4" out/intro.str
+//
+// Lines starting with # are comments; double quotes group words. Jobs are
+// sorted by input size, largest first, dealt round-robin to -j workers,
+// and an idle worker steals from the back of the busiest queue, so one
+// long movie never holds up the short clips queued behind it. Jobs without
+// their own --cache-dir use the one given on the command line.
+//
+
+#define BATCH_MAX_ARGS 256
+
+typedef struct {
+	int line;
+	char *text; // owns the strings argv points into
+	char *argv[BATCH_MAX_ARGS + 1];
+	int argc;
+	settings_t settings;
+	char **inputs;
+	int input_count;
+	const char *output;
+	uint64_t input_bytes;
+	uint64_t output_bytes;
+	double seconds;
+	int result;
+} batch_job_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	batch_job_t **jobs;
+	int head, tail; // owner pops from head, thieves take from tail
+
+	// Reused between jobs with the same frame size
+	int32_t *dct_block_lists[6];
+	int dct_width, dct_height;
+
+	int done, stolen;
+	double busy_seconds;
+} batch_worker_t;
+
+static batch_worker_t *workers;
+static int worker_count;
+
+static double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t file_size(const char *path) {
+	struct stat st;
+	return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+// Splits a line into words in place. Returns the word count, or -1.
+static int split_line(char *text, char **argv, int max_args) {
+	int argc = 0;
+	char *p = text;
+	while (1) {
+		while (isspace((unsigned char)*p)) p++;
+		if (*p == '\0' || *p == '#') break;
+		if (argc >= max_args) return -1;
+
+		char *out = p;
+		argv[argc++] = out;
+		bool quoted = false;
+		while (*p != '\0' && (quoted || !isspace((unsigned char)*p))) {
+			if (*p == '"') {
+				quoted = !quoted;
+				p++;
+			} else {
+				*(out++) = *(p++);
+			}
+		}
+		if (quoted) return -1;
+		if (*p != '\0') p++;
+		*out = '\0';
+	}
+	return argc;
+}
+
+static batch_job_t *take_job(int self) {
+	batch_worker_t *w = &workers[self];
+	batch_job_t *job = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->head < w->tail) {
+		job = w->jobs[w->head++];
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (job != NULL) return job;
+
+	// Steal from whichever worker has the most left
+	while (1) {
+		int victim = -1, most = 0;
+		for (int i = 0; i < worker_count; i++) {
+			pthread_mutex_lock(&workers[i].lock);
+			int left = workers[i].tail - workers[i].head;
+			pthread_mutex_unlock(&workers[i].lock);
+			if (left > most) {
+				most = left;
+				victim = i;
+			}
+		}
+		if (victim < 0) return NULL;
+
+		batch_worker_t *v = &workers[victim];
+		pthread_mutex_lock(&v->lock);
+		if (v->head < v->tail) {
+			job = v->jobs[--v->tail];
+		}
+		pthread_mutex_unlock(&v->lock);
+		if (job != NULL) {
+			w->stolen++;
+			return job;
+		}
+	}
+}
+
+static void *batch_worker(void *arg) {
+	int self = (int)(intptr_t)arg;
+	batch_worker_t *w = &workers[self];
+	batch_job_t *job;
+
+	while ((job = take_job(self)) != NULL) {
+		settings_t *settings = &job->settings;
+
+		if (w->dct_block_lists[0] != NULL
+			&& w->dct_width == settings->video_width && w->dct_height == settings->video_height) {
+			memcpy(settings->state_vid.dct_block_lists, w->dct_block_lists, sizeof(w->dct_block_lists));
+		}
+
+		double start = now_seconds();
+		job->result = run_encode(settings, job->inputs, job->input_count, job->output);
+		job->seconds = now_seconds() - start;
+		job->output_bytes = file_size(job->output);
+		w->busy_seconds += job->seconds;
+		w->done++;
+
+		// Keep this job's DCT buffers for the next one
+		if (settings->state_vid.dct_block_lists[0] != NULL
+			&& settings->state_vid.dct_block_lists[0] != w->dct_block_lists[0]) {
+			for (int i = 0; i < 6; i++) {
+				free(w->dct_block_lists[i]);
+				w->dct_block_lists[i] = settings->state_vid.dct_block_lists[i];
+			}
+			w->dct_width = settings->video_width;
+			w->dct_height = settings->video_height;
+		}
+
+		fprintf(stderr, "[%d] %s %s (%.2fs)\n", self,
+			job->result == 0 ? "done" : "FAILED", job->output, job->seconds);
+	}
+	return NULL;
+}
+
+static int job_size_cmp(const void *a, const void *b) {
+	const batch_job_t *ja = *(batch_job_t * const *)a, *jb = *(batch_job_t * const *)b;
+	if (ja->input_bytes != jb->input_bytes) return ja->input_bytes > jb->input_bytes ? -1 : 1;
+	return ja->line - jb->line;
+}
+
+int run_batch(settings_t *defaults) {
+	FILE *fp = strcmp(defaults->batch_file, "-") == 0 ? stdin : fopen(defaults->batch_file, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Could not open job list %s\n", defaults->batch_file);
+		return 1;
+	}
+
+	// Parse every line up front; getopt isn't reentrant
+	batch_job_t **jobs = NULL;
+	int job_count = 0, line_no = 0;
+	bool ok = true;
+	char *line = NULL;
+	size_t line_size = 0;
+	while (getline(&line, &line_size, fp) != -1) {
+		line_no++;
+		batch_job_t *job = calloc(1, sizeof(batch_job_t));
+		assert(job != NULL);
+		job->line = line_no;
+		job->text = strdup(line);
+		job->argv[0] = "psxavenc";
+		int words = split_line(job->text, job->argv + 1, BATCH_MAX_ARGS - 1);
+		if (words == 0) {
+			free(job->text);
+			free(job);
+			continue;
+		}
+
+		int arg_offset = -1;
+		job->argc = words + 1;
+		job->argv[job->argc] = NULL;
+		init_settings(&job->settings);
+		job->settings.thread_count = 1;
+		if (words > 0) {
+			optind = 0;
+			arg_offset = parse_args(&job->settings, job->argc, job->argv, stderr);
+		}
+		bool uses_stdio = false;
+		for (int i = (arg_offset < 0 ? job->argc : arg_offset); i < job->argc; i++) {
+			uses_stdio |= is_stdio_path(job->argv[i]);
+		}
+		if (arg_offset < 0 || job->argc < arg_offset + 2 || uses_stdio
+			|| job->settings.batch_file != NULL || job->settings.serve_socket != NULL) {
+			fprintf(stderr, "%s:%d: invalid job\n", defaults->batch_file, line_no);
+			ok = false;
+			free(job->text);
+			free(job);
+			continue;
+		}
+
+		if (job->settings.cache_dir == NULL) {
+			job->settings.cache_dir = defaults->cache_dir;
+			job->settings.cache_size = defaults->cache_size;
+		}
+		job->inputs = job->argv + arg_offset;
+		job->input_count = job->argc - arg_offset - 1;
+		job->output = job->argv[job->argc - 1];
+		for (int i = 0; i < job->input_count; i++) {
+			job->input_bytes += file_size(job->inputs[i]);
+		}
+
+		jobs = realloc(jobs, sizeof(batch_job_t *) * (job_count + 1));
+		assert(jobs != NULL);
+		jobs[job_count++] = job;
+	}
+	free(line);
+	if (fp != stdin) fclose(fp);
+	if (!ok) {
+		for (int i = 0; i < job_count; i++) {
+			free(jobs[i]->text);
+			free(jobs[i]);
+		}
+		free(jobs);
+		return 1;
+	}
+
+	worker_count = defaults->thread_count;
+	if (worker_count <= 0) worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (worker_count <= 0) worker_count = 1;
+	if (worker_count > job_count) worker_count = job_count > 0 ? job_count : 1;
+
+	// Largest first, dealt round-robin
+	qsort(jobs, job_count, sizeof(batch_job_t *), job_size_cmp);
+	workers = calloc(worker_count, sizeof(batch_worker_t));
+	assert(workers != NULL);
+	for (int i = 0; i < worker_count; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].jobs = calloc(job_count / worker_count + 1, sizeof(batch_job_t *));
+		assert(workers[i].jobs != NULL);
+	}
+	for (int i = 0; i < job_count; i++) {
+		batch_worker_t *w = &workers[i % worker_count];
+		w->jobs[w->tail++] = jobs[i];
+	}
+
+	prepare_dct_data();
+	double start = now_seconds();
+	pthread_t *threads = calloc(worker_count, sizeof(pthread_t));
+	for (int i = 0; i < worker_count; i++) {
+		pthread_create(&threads[i], NULL, batch_worker, (void *)(intptr_t)i);
+	}
+	for (int i = 0; i < worker_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	double wall = now_seconds() - start;
+	free(threads);
+
+	// Summary
+	int failed = 0;
+	uint64_t in_bytes = 0, out_bytes = 0;
+	double busy = 0;
+	for (int i = 0; i < job_count; i++) {
+		if (jobs[i]->result != 0) {
+			failed++;
+			fprintf(stderr, "Failed: %s:%d %s\n", defaults->batch_file, jobs[i]->line, jobs[i]->output);
+		}
+		in_bytes += jobs[i]->input_bytes;
+		out_bytes += jobs[i]->output_bytes;
+	}
+	for (int i = 0; i < worker_count; i++) {
+		fprintf(stderr, "Worker %d: %d jobs (%d stolen), busy %.2fs\n",
+			i, workers[i].done, workers[i].stolen, workers[i].busy_seconds);
+		busy += workers[i].busy_seconds;
+		for (int j = 0; j < 6; j++) {
+			free(workers[i].dct_block_lists[j]);
+		}
+		free(workers[i].jobs);
+		pthread_mutex_destroy(&workers[i].lock);
+	}
+	if (wall <= 0) wall = 1e-9;
+	fprintf(stderr, "Batch: %d jobs, %d failed, %.2fs on %d workers (%.0f%% busy)\n",
+		job_count, failed, wall, worker_count, 100.0 * busy / (wall * worker_count));
+	fprintf(stderr, "Batch: %.1f jobs/s, in %.2f MB (%.2f MB/s), out %.2f MB (%.2f MB/s)\n",
+		job_count / wall,
+		in_bytes / 1e6, in_bytes / 1e6 / wall,
+		out_bytes / 1e6, out_bytes / 1e6 / wall);
+
+	for (int i = 0; i < job_count; i++) {
+		free(jobs[i]->text);
+		free(jobs[i]);
+	}
+	free(jobs);
+	free(workers);
+	return failed > 0 ? 1 : 0;
+}
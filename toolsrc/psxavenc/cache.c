@@ -0,0 +1,295 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "common.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+//
+// Encode cache (--cache-dir)
+//
+// Outputs are stored as <dir>/<key>.out, where the key is a 64-bit FNV-1a
+// hash of CACHE_VERSION, every encoding setting and the bytes of every
+// input. Entries are stored as a reflink or a copy of the output, never a
+// hard link, and are made read-only. A hit is handed back as a reflink,
+// else a hard link, else a copy; open_output() replaces rather than
+// truncates an existing file, so writing that output later leaves the
+// entry alone.
+// Entries are touched on every hit; when the directory grows past
+// --cache-size the least recently used ones are deleted.
+//
+
+// Bump whenever the encoder output changes for the same settings.
+#define CACHE_VERSION "psxavenc cache 2"
+
+#define HASH_INIT 0xCBF29CE484222325ULL
+
+static uint64_t hash_bytes(uint64_t h, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001B3ULL;
+	}
+	return h;
+}
+
+static uint64_t hash_int(uint64_t h, int64_t v) {
+	return hash_bytes(h, &v, sizeof(v));
+}
+
+static bool hash_file(uint64_t *h, const char *filename) {
+	uint8_t buf[1<<14];
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL) return false;
+
+	size_t amt;
+	while ((amt = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		*h = hash_bytes(*h, buf, amt);
+	}
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
+
+bool cache_key(settings_t *settings, char **inputs, int input_count, char *key) {
+	uint64_t h = hash_bytes(HASH_INIT, CACHE_VERSION, sizeof(CACHE_VERSION));
+
+	// Settings that change the output; thread count and cache options don't
+	h = hash_int(h, settings->format);
+	h = hash_int(h, settings->stereo);
+	h = hash_int(h, settings->frequency);
+	h = hash_int(h, settings->bits_per_sample);
+	h = hash_int(h, settings->file_number);
+	h = hash_int(h, settings->channel_number);
+	h = hash_int(h, settings->channel_number_count);
+	for (int i = 0; i < settings->channel_number_count; i++) {
+		h = hash_int(h, settings->channel_numbers[i]);
+	}
+	h = hash_int(h, settings->video_width);
+	h = hash_int(h, settings->video_height);
+	h = hash_int(h, settings->video_fps_num);
+	h = hash_int(h, settings->video_fps_den);
+	h = hash_bytes(h, &(settings->start_time), sizeof(double));
+	h = hash_bytes(h, &(settings->end_time), sizeof(double));
+	h = hash_int(h, settings->start_frame_index);
+	h = hash_int(h, settings->start_lba);
+	h = hash_int(h, settings->audio_preroll);
+	h = hash_int(h, settings->concat);
+	h = hash_int(h, settings->replace_audio);
+
+	h = hash_int(h, input_count);
+	for (int i = 0; i < input_count; i++) {
+		if (!hash_file(&h, inputs[i])) {
+			fprintf(stderr, "Cache: could not read %s, not caching\n", inputs[i]);
+			return false;
+		}
+		h = hash_int(h, -1); // input separator
+	}
+
+	snprintf(key, CACHE_KEY_LENGTH, "%016" PRIx64, h);
+	return true;
+}
+
+static bool try_reflink(const char *src, const char *dst) {
+#ifdef FICLONE
+	int fd_in = open(src, O_RDONLY);
+	if (fd_in < 0) return false;
+	int fd_out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd_out < 0) {
+		close(fd_in);
+		return false;
+	}
+	bool ok = ioctl(fd_out, FICLONE, fd_in) == 0;
+	if (close(fd_out) != 0) ok = false;
+	close(fd_in);
+	if (!ok) unlink(dst);
+	return ok;
+#else
+	return false;
+#endif
+}
+
+static bool copy_file(const char *src, const char *dst) {
+	FILE *in = fopen(src, "rb");
+	if (in == NULL) return false;
+	FILE *out = fopen(dst, "wb");
+	if (out == NULL) {
+		fclose(in);
+		return false;
+	}
+
+	uint8_t buf[1<<14];
+	size_t amt;
+	bool ok = true;
+	while ((amt = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (fwrite(buf, 1, amt, out) != amt) {
+			ok = false;
+			break;
+		}
+	}
+	if (ferror(in)) ok = false;
+	if (fclose(out) != 0) ok = false;
+	fclose(in);
+	if (!ok) unlink(dst);
+	return ok;
+}
+
+// Clones src to dst, preferring a reflink, then a hard link if allowed,
+// then a copy.
+static bool clone_file(const char *src, const char *dst, bool allow_link, const char **how) {
+	unlink(dst);
+	if (try_reflink(src, dst)) {
+		*how = "reflink";
+		return true;
+	}
+	if (allow_link && link(src, dst) == 0) {
+		*how = "hard link";
+		return true;
+	}
+	*how = "copy";
+	return copy_file(src, dst);
+}
+
+bool cache_fetch(settings_t *settings, const char *key, const char *output) {
+	char path[4096];
+	const char *how;
+
+	snprintf(path, sizeof(path), "%s/%s.out", settings->cache_dir, key);
+	if (access(path, R_OK) != 0 || !clone_file(path, output, true, &how)) {
+		fprintf(stderr, "Cache miss: %s\n", key);
+		return false;
+	}
+
+	// Mark as recently used
+	utimensat(AT_FDCWD, path, NULL, 0);
+	fprintf(stderr, "Cache hit: %s (%s)\n", key, how);
+	return true;
+}
+
+typedef struct {
+	char name[32];
+	off_t size;
+	struct timespec mtime;
+} cache_entry_t;
+
+static int cache_entry_cmp(const void *a, const void *b) {
+	const cache_entry_t *ea = a, *eb = b;
+	if (ea->mtime.tv_sec != eb->mtime.tv_sec) return ea->mtime.tv_sec < eb->mtime.tv_sec ? -1 : 1;
+	if (ea->mtime.tv_nsec != eb->mtime.tv_nsec) return ea->mtime.tv_nsec < eb->mtime.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+// Deletes the least recently used entries until the cache fits its size limit.
+static void cache_trim(settings_t *settings) {
+	char path[4096];
+	DIR *dir = opendir(settings->cache_dir);
+	if (dir == NULL) return;
+
+	cache_entry_t *entries = NULL;
+	int count = 0, capacity = 0;
+	uint64_t total = 0;
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		struct stat st;
+		size_t len = strlen(de->d_name);
+		if (len < 4 || len >= sizeof(entries[0].name) || strcmp(de->d_name + len - 4, ".out") != 0) continue;
+		snprintf(path, sizeof(path), "%s/%s", settings->cache_dir, de->d_name);
+		if (stat(path, &st) != 0) continue;
+
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			entries = realloc(entries, capacity * sizeof(cache_entry_t));
+			assert(entries != NULL);
+		}
+		strcpy(entries[count].name, de->d_name);
+		entries[count].size = st.st_size;
+		entries[count].mtime = st.st_mtim;
+		total += st.st_size;
+		count++;
+	}
+	closedir(dir);
+
+	if (total > settings->cache_size) {
+		qsort(entries, count, sizeof(cache_entry_t), cache_entry_cmp);
+		int evicted = 0;
+		for (int i = 0; i < count && total > settings->cache_size; i++) {
+			snprintf(path, sizeof(path), "%s/%s", settings->cache_dir, entries[i].name);
+			if (unlink(path) == 0) {
+				total -= entries[i].size;
+				evicted++;
+			}
+		}
+		fprintf(stderr, "Cache: evicted %d entries, %" PRIu64 " bytes in use\n", evicted, total);
+	}
+
+	free(entries);
+}
+
+void cache_store(settings_t *settings, const char *key, const char *output) {
+	char path[4096], tmp_path[4096];
+	const char *how;
+
+	if (mkdir(settings->cache_dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Cache: could not create %s\n", settings->cache_dir);
+		return;
+	}
+
+	// Store under a temporary name so a concurrent run never sees a partial
+	// entry. A hard link would share the inode with the output, which the
+	// user is free to overwrite, so only a reflink or a copy will do.
+	snprintf(path, sizeof(path), "%s/%s.out", settings->cache_dir, key);
+	static int tmp_serial = 0;
+	snprintf(tmp_path, sizeof(tmp_path), "%s/%s.%ld.%d.tmp", settings->cache_dir, key,
+		(long)getpid(), __sync_fetch_and_add(&tmp_serial, 1));
+	if (!clone_file(output, tmp_path, false, &how) || chmod(tmp_path, 0444) != 0
+		|| rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+		fprintf(stderr, "Cache: could not store %s\n", key);
+		return;
+	}
+
+	fprintf(stderr, "Cache: stored %s (%s)\n", key, how);
+	cache_trim(settings);
+}
+
+bool parse_size(const char *str, uint64_t *size) {
+	char *end;
+	double value = strtod(str, &end);
+	if (end == str || value < 0) return false;
+	switch (*end) {
+		case 'k': case 'K': value *= 1024.0; end++; break;
+		case 'm': case 'M': value *= 1024.0 * 1024.0; end++; break;
+		case 'g': case 'G': value *= 1024.0 * 1024.0 * 1024.0; end++; break;
+	}
+	if (*end != '\0') return false;
+	*size = (uint64_t)value;
+	return true;
+}
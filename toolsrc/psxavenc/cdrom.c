@@ -35,6 +35,20 @@ void init_sector_buffer_video(uint8_t *buffer, settings_t *settings) {
 	memcpy(buffer + 0x014, buffer + 0x010, 4);
 }
 
+// Writes the BCD minute:second:frame address of sector number lba
+void set_sector_msf(uint8_t *buffer, int lba) {
+	buffer[0x00C] = ((lba/75/60)%10)|(((lba/75/60)/10)<<4);
+	buffer[0x00D] = (((lba/75)%60)%10)|((((lba/75)%60)/10)<<4);
+	buffer[0x00E] = ((lba%75)%10)|(((lba%75)/10)<<4);
+}
+
+int get_sector_msf(uint8_t *buffer) {
+	int m = (buffer[0x00C]>>4)*10 + (buffer[0x00C]&0xF);
+	int s = (buffer[0x00D]>>4)*10 + (buffer[0x00D]&0xF);
+	int f = (buffer[0x00E]>>4)*10 + (buffer[0x00E]&0xF);
+	return (m*60 + s)*75 + f;
+}
+
 void calculate_edc_data(uint8_t *buffer)
 {
 	uint32_t edc = 0;
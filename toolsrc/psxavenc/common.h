@@ -36,6 +36,10 @@ freely, subject to the following restrictions:
 #include <libswresample/swresample.h>
 #include <libpsxav.h>
 
+#define MAX_XA_INPUTS 32
+#define CACHE_KEY_LENGTH 17
+#define DEFAULT_CACHE_SIZE (1024ULL*1024*1024)
+
 #define FORMAT_XA 0
 #define FORMAT_XACD 1
 #define FORMAT_SPU 2
@@ -56,9 +60,38 @@ typedef struct {
 	int blocks_used;
 	int uncomp_hwords_used;
 	int quant_scale;
+	int coeffs_shed; // by reduce_dct_block, this frame
 	int32_t *dct_block_lists[6];
 } vid_encoder_state_t;
 
+typedef struct str_stats str_stats_t;
+
+// Called by decode_frame_str for every macroblock, with its top left
+// corner and its pixels as 16x16 planes of R, G and B
+typedef void (*mdec_macroblock_fn)(void *arg, int x, int y, const uint8_t *r, const uint8_t *g, const uint8_t *b);
+
+// Stages timed by --profile
+#define PROFILE_DEMUX 0
+#define PROFILE_AUDIO_DECODE 1
+#define PROFILE_RESAMPLE 2
+#define PROFILE_VIDEO_DECODE 3
+#define PROFILE_SWSCALE 4
+#define PROFILE_COLOUR 5
+#define PROFILE_DCT 6
+#define PROFILE_RATE_CONTROL 7
+#define PROFILE_HUFFMAN 8
+#define PROFILE_ADPCM 9
+#define PROFILE_EDC 10
+#define PROFILE_WRITE 11
+#define PROFILE_STAGE_COUNT 12
+
+typedef struct profile profile_t;
+
+typedef struct {
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+} profile_mark_t;
+
 typedef struct {
 	int video_frame_src_size;
 	int video_frame_dst_size;
@@ -78,8 +111,32 @@ typedef struct {
 	int sample_count_mul;
 
 	double video_next_pts;
+
+	// Native readers (native.c); FFmpeg isn't used when native != NATIVE_NONE
+	int native; // NATIVE_*
+	uint8_t *map;
+	size_t map_size;
+	size_t file_size;
+	size_t y4m_pos;
+	size_t y4m_frame_size;
+	int y4m_width;
+	int y4m_height;
+	int y4m_fps_num;
+	int y4m_fps_den;
+	int y4m_frame_index;
+
+	// Input from stdin ("-"): map holds what has been read so far, which
+	// FFmpeg is served through avio before the rest of the stream
+	bool from_stdin;
+	bool stdin_eof;
+	size_t avio_pos;
+	AVIOContext *avio;
 } av_decoder_state_t;
 
+#define NATIVE_NONE 0
+#define NATIVE_WAV 1
+#define NATIVE_Y4M 2
+
 typedef struct {
 	int format; // FORMAT_*
 	bool stereo; // false or true
@@ -87,6 +144,22 @@ typedef struct {
 	int bits_per_sample; // 4 or 8
 	int file_number; // 00-FF
 	int channel_number; // 00-1F
+	int channel_numbers[MAX_XA_INPUTS]; // one per input when muxing several
+	int channel_number_count;
+	int thread_count;
+	const char *cache_dir; // NULL if caching is off
+	uint64_t cache_size; // bytes
+	const char *serve_socket; // --serve
+	const char *batch_file; // -B
+	double start_time; // --start, seconds
+	double end_time; // --end, seconds; 0 = end of input
+	int start_frame_index; // --frame-index; -1 = follow --start
+	int start_lba; // --lba; -1 = follow --start
+	int audio_preroll; // --preroll, audio sectors
+	bool concat; // --concat
+	bool replace_audio; // --replace-audio
+	bool print_stats; // --stats
+	const char *profile_path; // --profile
 
 	int video_width;
 	int video_height;
@@ -101,13 +174,31 @@ typedef struct {
 	av_decoder_state_t decoder_state_av;
 
 	vid_encoder_state_t state_vid;
+	str_stats_t *str_stats; // NULL unless --stats
+	profile_t *profile; // NULL unless --profile
 } settings_t;
 
+// cache.c
+bool cache_key(settings_t *settings, char **inputs, int input_count, char *key);
+bool cache_fetch(settings_t *settings, const char *key, const char *output);
+void cache_store(settings_t *settings, const char *key, const char *output);
+bool parse_size(const char *str, uint64_t *size);
+
+// batch.c
+int run_batch(settings_t *defaults);
+
 // cdrom.c
 void init_sector_buffer_video(uint8_t *buffer, settings_t *settings);
+void set_sector_msf(uint8_t *buffer, int lba);
+int get_sector_msf(uint8_t *buffer);
 void calculate_edc_data(uint8_t *buffer);
 
 // decoding.c
+bool is_stdio_path(const char *filename);
+int get_sector_size(settings_t *settings);
+FILE *open_output(const char *filename, settings_t *settings);
+void write_output(const void *data, size_t length, FILE *output, settings_t *settings);
+void close_output(FILE *output, settings_t *settings);
 bool open_av_data(const char *filename, settings_t *settings);
 bool poll_av_data(settings_t *settings);
 bool ensure_av_data(settings_t *settings, int needed_audio_samples, int needed_video_frames);
@@ -115,10 +206,47 @@ void pull_all_av_data(settings_t *settings);
 void retire_av_data(settings_t *settings, int retired_audio_samples, int retired_video_frames);
 void close_av_data(settings_t *settings);
 
+// native.c
+bool open_native_data(const char *filename, settings_t *settings);
+bool poll_native_data(settings_t *settings);
+void close_native_data(settings_t *settings);
+
 // filefmt.c
 void encode_file_spu(int16_t *audio_samples, int audio_sample_count, settings_t *settings, FILE *output);
 void encode_file_xa(int16_t *audio_samples, int audio_sample_count, settings_t *settings, FILE *output);
-void encode_file_str(settings_t *settings, FILE *output);
+int encode_buffer_xa(int16_t *audio_samples, int audio_sample_count, settings_t *settings, uint8_t **output);
+int get_xa_stride(settings_t *settings);
+void mux_file_xa(uint8_t **channels, int *lengths, int channel_count, settings_t *settings, FILE *output);
+void get_str_alignment(settings_t *settings, int *frames, int *groups);
+int encode_file_str(settings_t *settings, FILE *output);
+int concat_file_str(char **inputs, int input_count, settings_t *settings, FILE *output);
+int replace_audio_str(const char *str_name, const char *audio_name, settings_t *settings, FILE *output);
 
 // mdec.c
 void encode_block_str(uint8_t *video_frames, int video_frame_count, uint8_t *output, settings_t *settings);
+void prepare_dct_data(void);
+bool decode_frame_str(const uint8_t *data, int length, int width, int height, mdec_macroblock_fn fn, void *arg);
+
+// profile.c
+profile_t *profile_create(void);
+void profile_begin(settings_t *settings, profile_mark_t *mark);
+void profile_end(settings_t *settings, int stage, profile_mark_t *mark);
+void profile_add_output(settings_t *settings, size_t bytes);
+void profile_note_buffers(settings_t *settings);
+void profile_add_adpcm_stats(settings_t *settings, const psx_audio_encoder_stats_t *stats);
+bool profile_finish(profile_t *profile, settings_t *settings, const char *filename);
+
+// psxavenc.c
+void init_settings(settings_t *settings);
+int parse_args(settings_t* settings, int argc, char** argv, FILE *err);
+int run_encode(settings_t *settings, char **inputs, int input_count, const char *output_name);
+
+// stats.c
+str_stats_t *stats_create(settings_t *settings);
+void stats_add_frame(str_stats_t *stats, settings_t *settings, uint8_t *video_frame);
+void stats_add_sector(str_stats_t *stats, settings_t *settings, uint8_t *sector);
+void stats_finish(str_stats_t *stats);
+
+// server.c
+int run_server(settings_t *settings);
+int run_client(const char *socket_path, int argc, char **argv);
@@ -22,9 +22,92 @@ freely, subject to the following restrictions:
 */
 
 #include "common.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define AVIO_BUFFER_SIZE 0x10000
+
+// Sectors per write when the output is a pipe
+#define OUTPUT_BUFFER_SECTORS 32
 
 static void poll_av_packet(settings_t *settings, AVPacket *packet);
 
+bool is_stdio_path(const char *filename) {
+	return strcmp(filename, "-") == 0;
+}
+
+int get_sector_size(settings_t *settings) {
+	switch (settings->format) {
+		case FORMAT_XA: return 2336;
+		case FORMAT_XACD: return 2352;
+		case FORMAT_STR2: return 2352;
+		default: return 2048;
+	}
+}
+
+// "-" is stdout, buffered so every write is a whole number of sectors.
+// None of the writers seek, so the output may be a pipe.
+// An existing regular file is unlinked and created anew rather than
+// truncated, so that an output hard linked into the encode cache by an
+// earlier hit is never written through.
+FILE *open_output(const char *filename, settings_t *settings) {
+	FILE *output;
+	if (is_stdio_path(filename)) {
+		output = stdout;
+	} else {
+		struct stat st;
+		if (lstat(filename, &st) == 0 && S_ISREG(st.st_mode)) {
+			unlink(filename);
+		}
+		output = fopen(filename, "wb");
+	}
+	if (output == NULL) {
+		return NULL;
+	}
+
+	setvbuf(output, NULL, _IOFBF, get_sector_size(settings) * OUTPUT_BUFFER_SECTORS);
+	return output;
+}
+
+void write_output(const void *data, size_t length, FILE *output, settings_t *settings) {
+	profile_mark_t mark;
+	profile_begin(settings, &mark);
+	fwrite(data, length, 1, output);
+	profile_end(settings, PROFILE_WRITE, &mark);
+	profile_add_output(settings, length);
+}
+
+// Flushing what is left in the buffer counts as writing
+void close_output(FILE *output, settings_t *settings) {
+	profile_mark_t mark;
+	profile_begin(settings, &mark);
+	fclose(output);
+	profile_end(settings, PROFILE_WRITE, &mark);
+}
+
+// Serves the bytes read from stdin while sniffing, then the rest of stdin
+static int read_stdin_packet(void *opaque, uint8_t *buf, int buf_size) {
+	av_decoder_state_t* av = opaque;
+
+	if (av->avio_pos < av->file_size) {
+		size_t amt = av->file_size - av->avio_pos;
+		if (amt > (size_t)buf_size) amt = buf_size;
+		memcpy(buf, av->map + av->avio_pos, amt);
+		av->avio_pos += amt;
+		return amt;
+	}
+
+	while (!av->stdin_eof) {
+		ssize_t n = read(STDIN_FILENO, buf, buf_size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n > 0) return n;
+		av->stdin_eof = true;
+	}
+	return AVERROR_EOF;
+}
+
 int decode_audio_frame(AVCodecContext *codec, AVFrame *frame, int *frame_size, AVPacket *packet) {
 	int ret;
 
@@ -83,8 +166,27 @@ bool open_av_data(const char *filename, settings_t *settings)
 	av->video_codec = NULL;
 	av->resampler = NULL;
 	av->scaler = NULL;
+	av->native = NATIVE_NONE;
+	av->map = NULL;
+	av->avio = NULL;
+
+	if (open_native_data(filename, settings)) {
+		return true;
+	}
 
 	av->format = avformat_alloc_context();
+	if (av->from_stdin) {
+		if (av->map == NULL) {
+			return false;
+		}
+		uint8_t *avio_buffer = av_malloc(AVIO_BUFFER_SIZE);
+		av->avio = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 0, av, read_stdin_packet, NULL, NULL);
+		if (av->avio == NULL) {
+			return false;
+		}
+		av->format->pb = av->avio;
+		filename = "pipe:";
+	}
 	if (avformat_open_input(&(av->format), filename, NULL, NULL)) {
 		return false;
 	}
@@ -194,12 +296,19 @@ static void poll_av_packet_audio(settings_t *settings, AVPacket *packet)
 
 	int frame_size, frame_sample_count;
 	uint8_t *buffer[1];
+	profile_mark_t mark;
+
+	profile_begin(settings, &mark);
+	int decoded = decode_audio_frame(av->audio_codec_context, av->frame, &frame_size, packet);
+	profile_end(settings, PROFILE_AUDIO_DECODE, &mark);
 
-	if (decode_audio_frame(av->audio_codec_context, av->frame, &frame_size, packet)) {
+	if (decoded) {
 		size_t buffer_size = sizeof(int16_t) * av->sample_count_mul * swr_get_out_samples(av->resampler, av->frame->nb_samples);
 		buffer[0] = malloc(buffer_size);
 		memset(buffer[0], 0, buffer_size);
+		profile_begin(settings, &mark);
 		frame_sample_count = swr_convert(av->resampler, buffer, av->frame->nb_samples, (const uint8_t**)av->frame->data, av->frame->nb_samples);
+		profile_end(settings, PROFILE_RESAMPLE, &mark);
 		settings->audio_samples = realloc(settings->audio_samples, (settings->audio_sample_count + ((frame_sample_count + 4032) * av->sample_count_mul)) * sizeof(int16_t));
 		memmove(&(settings->audio_samples[settings->audio_sample_count]), buffer[0], sizeof(int16_t) * frame_sample_count * av->sample_count_mul);
 		settings->audio_sample_count += frame_sample_count * av->sample_count_mul;
@@ -212,8 +321,13 @@ static void poll_av_packet_video(settings_t *settings, AVPacket *packet)
 	av_decoder_state_t* av = &(settings->decoder_state_av);
 
 	int frame_size;
+	profile_mark_t mark;
+
+	profile_begin(settings, &mark);
+	int decoded = decode_video_frame(av->video_codec_context, av->frame, &frame_size, packet);
+	profile_end(settings, PROFILE_VIDEO_DECODE, &mark);
 
-	if (decode_video_frame(av->video_codec_context, av->frame, &frame_size, packet)) {
+	if (decoded) {
 		double pts = (((double)av->frame->pts)*(double)av->video_stream->time_base.num)/av->video_stream->time_base.den;
 		//fprintf(stderr, "%f\n", pts);
 		// Drop frames with negative PTS values
@@ -244,7 +358,9 @@ static void poll_av_packet_video(settings_t *settings, AVPacket *packet)
 		uint8_t *dst_pointers[1] = {
 			(settings->video_frames) + av->video_frame_dst_size*(settings->video_frame_count),
 		};
+		profile_begin(settings, &mark);
 		sws_scale(av->scaler, av->frame->data, av->frame->linesize, 0, av->frame->height, dst_pointers, dst_strides);
+		profile_end(settings, PROFILE_SWSCALE, &mark);
 
 		settings->video_frame_count += 1;
 		//free(buffer[0]);
@@ -267,10 +383,22 @@ bool poll_av_data(settings_t *settings)
 {
 	av_decoder_state_t* av = &(settings->decoder_state_av);
 	AVPacket packet;
+	profile_mark_t mark;
+
+	if (av->native != NATIVE_NONE) {
+		bool polled = poll_native_data(settings);
+		profile_note_buffers(settings);
+		return polled;
+	}
 
-	if (av_read_frame(av->format, &packet) >= 0) {
+	profile_begin(settings, &mark);
+	int read = av_read_frame(av->format, &packet);
+	profile_end(settings, PROFILE_DEMUX, &mark);
+
+	if (read >= 0) {
 		poll_av_packet(settings, &packet);
 		av_packet_unref(&packet);
+		profile_note_buffers(settings);
 		return true;
 	} else {
 		// out is always padded out with 4032 "0" samples, this makes calculations elsewhere easier
@@ -317,13 +445,13 @@ void retire_av_data(settings_t *settings, int retired_audio_samples, int retired
 	assert(retired_video_frames <= settings->video_frame_count);
 
 	int sample_size = sizeof(int16_t);
-	if (settings->audio_sample_count > retired_audio_samples) {
+	if (settings->audio_sample_count >= retired_audio_samples) {
 		memmove(settings->audio_samples, settings->audio_samples + retired_audio_samples, (settings->audio_sample_count - retired_audio_samples)*sample_size);
 		settings->audio_sample_count -= retired_audio_samples;
 	}
 
 	int frame_size = av->video_frame_dst_size;
-	if (settings->video_frame_count > retired_video_frames) {
+	if (settings->video_frame_count >= retired_video_frames) {
 		memmove(settings->video_frames, settings->video_frames + retired_video_frames*frame_size, (settings->video_frame_count - retired_video_frames)*frame_size);
 		settings->video_frame_count -= retired_video_frames;
 	}
@@ -333,11 +461,24 @@ void close_av_data(settings_t *settings)
 {
 	av_decoder_state_t* av = &(settings->decoder_state_av);
 
+	if (av->native != NATIVE_NONE) {
+		close_native_data(settings);
+		return;
+	}
+
 	av_frame_free(&(av->frame));
 	swr_free(&(av->resampler));
 	avcodec_close(av->audio_codec_context);
 	avcodec_free_context(&(av->audio_codec_context));
 	avformat_free_context(av->format);
+	if (av->avio != NULL) {
+		av_freep(&(av->avio->buffer));
+		avio_context_free(&(av->avio));
+	}
+	if (av->map != NULL) {
+		munmap(av->map, av->map_size);
+		av->map = NULL;
+	}
 
 	if(settings->audio_samples != NULL) {
 		free(settings->audio_samples);
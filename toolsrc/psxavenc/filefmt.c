@@ -23,6 +23,8 @@ freely, subject to the following restrictions:
 
 #include "common.h"
 #include "libpsxav.h"
+#include <limits.h>
+#include <math.h>
 
 static psx_audio_xa_settings_t settings_to_libpsxav_xa_audio(settings_t *settings) {
 	psx_audio_xa_settings_t new_settings;
@@ -44,56 +46,159 @@ static psx_audio_xa_settings_t settings_to_libpsxav_xa_audio(settings_t *setting
 	return new_settings;
 };
 
+// psx_audio_xa_encode, timed for --profile
+static int encode_sector_xa(settings_t *settings, psx_audio_xa_settings_t xa_settings, psx_audio_encoder_state_t *audio_state, int16_t *samples, int sample_count, uint8_t *output) {
+	profile_mark_t mark;
+	profile_begin(settings, &mark);
+	int length = psx_audio_xa_encode(xa_settings, audio_state, samples, sample_count, output);
+	profile_end(settings, PROFILE_ADPCM, &mark);
+	return length;
+}
+
+// Collects ADPCM search statistics into *stats when profiling
+static void attach_adpcm_stats(settings_t *settings, psx_audio_encoder_state_t *audio_state, psx_audio_encoder_stats_t *stats) {
+	memset(stats, 0, sizeof(psx_audio_encoder_stats_t));
+	audio_state->stats = (settings->profile != NULL) ? stats : NULL;
+}
+
+static void calculate_edc_data_timed(settings_t *settings, uint8_t *sector) {
+	profile_mark_t mark;
+	profile_begin(settings, &mark);
+	calculate_edc_data(sector);
+	profile_end(settings, PROFILE_EDC, &mark);
+}
+
 void encode_file_spu(int16_t *audio_samples, int audio_sample_count, settings_t *settings, FILE *output) {
 	psx_audio_encoder_state_t audio_state;	
 	int audio_samples_per_block = psx_audio_spu_get_samples_per_block();
+	psx_audio_encoder_stats_t audio_stats;
 	uint8_t buffer[16];
+	profile_mark_t mark;
 
 	memset(&audio_state, 0, sizeof(psx_audio_encoder_state_t));
+	attach_adpcm_stats(settings, &audio_state, &audio_stats);
 
 	for (int i = 0; i < audio_sample_count; i += audio_samples_per_block) {
 		int samples_length = audio_sample_count - i;
 		if (samples_length > audio_samples_per_block) samples_length = audio_samples_per_block;
+		profile_begin(settings, &mark);
 		int length = psx_audio_spu_encode(&audio_state, audio_samples + i, samples_length, buffer);
+		profile_end(settings, PROFILE_ADPCM, &mark);
 		if (i == 0) {
 			buffer[1] = PSX_AUDIO_SPU_LOOP_START;
 		} else if ((i + audio_samples_per_block) >= audio_sample_count) {
 			buffer[1] = PSX_AUDIO_SPU_LOOP_END;
 		}
-		fwrite(buffer, length, 1, output);
+		write_output(buffer, length, output, settings);
 	}
+	profile_add_adpcm_stats(settings, audio_state.stats);
 }
 
-void encode_file_xa(int16_t *audio_samples, int audio_sample_count, settings_t *settings, FILE *output) {
+// Returns the length in bytes of the newly allocated *output
+int encode_buffer_xa(int16_t *audio_samples, int audio_sample_count, settings_t *settings, uint8_t **output) {
 	psx_audio_xa_settings_t xa_settings = settings_to_libpsxav_xa_audio(settings);
 	psx_audio_encoder_state_t audio_state;	
 	int audio_samples_per_sector = psx_audio_xa_get_samples_per_sector(xa_settings);
 	int av_sample_mul = settings->stereo ? 2 : 1;
-	uint8_t buffer[2352];
+	psx_audio_encoder_stats_t audio_stats;
+	int offset = 0;
 
 	memset(&audio_state, 0, sizeof(psx_audio_encoder_state_t));
+	attach_adpcm_stats(settings, &audio_state, &audio_stats);
+	*output = malloc(psx_audio_xa_get_buffer_size(xa_settings, audio_sample_count) + 2352);
 
 	for (int i = 0; i < audio_sample_count; i += audio_samples_per_sector) {
 		int samples_length = audio_sample_count - i;
 		if (samples_length > audio_samples_per_sector) samples_length = audio_samples_per_sector;
-		int length = psx_audio_xa_encode(xa_settings, &audio_state, audio_samples + (i * av_sample_mul), samples_length, buffer);
+		int length = encode_sector_xa(settings, xa_settings, &audio_state, audio_samples + (i * av_sample_mul), samples_length, *output + offset);
 		if ((i + audio_samples_per_sector) >= audio_sample_count) {
-			psx_audio_xa_encode_finalize(xa_settings, buffer, length);
+			psx_audio_xa_encode_finalize(xa_settings, *output + offset, length);
 		}
-		fwrite(buffer, length, 1, output);
+		offset += length;
 	}
+
+	profile_add_adpcm_stats(settings, audio_state.stats);
+	return offset;
+}
+
+void encode_file_xa(int16_t *audio_samples, int audio_sample_count, settings_t *settings, FILE *output) {
+	uint8_t *buffer;
+	int length = encode_buffer_xa(audio_samples, audio_sample_count, settings, &buffer);
+	write_output(buffer, length, output, settings);
+	free(buffer);
 }
 
-void encode_file_str(settings_t *settings, FILE *output) {
+// Sectors between consecutive sectors of one channel, at 2x speed
+int get_xa_stride(settings_t *settings) {
+	psx_audio_xa_settings_t xa_settings = settings_to_libpsxav_xa_audio(settings);
+	return (150 * psx_audio_xa_get_samples_per_sector(xa_settings)) / settings->frequency;
+}
+
+// Interleaves already encoded channels sector by sector. Channel i goes
+// in slot i of every stride; unused slots and channels which have run
+// out are filled with null sectors.
+void mux_file_xa(uint8_t **channels, int *lengths, int channel_count, settings_t *settings, FILE *output) {
+	int sector_size = (settings->format == FORMAT_XA) ? 2336 : 2352;
+	int stride = get_xa_stride(settings);
+	uint8_t null_sector[2352];
+	int sectors = 0;
+
+	assert(channel_count <= stride);
+	memset(null_sector, 0, sizeof(null_sector));
+	for (int i = 0; i < channel_count; i++) {
+		if (lengths[i] / sector_size > sectors) sectors = lengths[i] / sector_size;
+	}
+
+	for (int j = 0; j < sectors; j++) {
+		for (int i = 0; i < stride; i++) {
+			if (i < channel_count && (j + 1) * sector_size <= lengths[i]) {
+				write_output(channels[i] + j * sector_size, sector_size, output, settings);
+			} else {
+				write_output(null_sector, sector_size, output, settings);
+			}
+		}
+	}
+}
+
+// Pieces of one STR encoded separately (--start/--end) can only be joined
+// where a frame starts on the first video sector of an 8-sector group and
+// the block count has no fractional carry. Returns that unit in frames and
+// in groups; at 15 FPS it is 4 frames in 5 groups.
+void get_str_alignment(settings_t *settings, int *frames, int *groups) {
+	int a = 150*settings->video_fps_den, b = 8*settings->video_fps_num;
+	while (b != 0) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	*frames = (8*settings->video_fps_num) / a;
+	*groups = (150*settings->video_fps_den) / a;
+}
+
+int encode_file_str(settings_t *settings, FILE *output) {
 	uint8_t buffer[2352*8];
 	psx_audio_xa_settings_t xa_settings = settings_to_libpsxav_xa_audio(settings);
 	psx_audio_encoder_state_t audio_state;	
 	int audio_samples_per_sector = psx_audio_xa_get_samples_per_sector(xa_settings);
 	int av_sample_mul = settings->stereo ? 2 : 1;
+	int group_samples = audio_samples_per_sector*av_sample_mul;
+	psx_audio_encoder_stats_t audio_stats;
 
 	memset(&audio_state, 0, sizeof(psx_audio_encoder_state_t));
 
-	settings->state_vid.frame_index = 0;
+	// Snap --start and --end to the nearest point where pieces can be joined,
+	// the same way for both so that one piece's end is the next one's start
+	int unit_frames, unit_groups;
+	get_str_alignment(settings, &unit_frames, &unit_groups);
+	double unit_time = (double)(unit_frames*settings->video_fps_den) / settings->video_fps_num;
+	int first_unit = (int)lround(settings->start_time / unit_time);
+	int first_frame = first_unit*unit_frames;
+	int first_group = first_unit*unit_groups;
+	int end_group = (settings->end_time > 0.0)
+		? (int)lround(settings->end_time / unit_time)*unit_groups
+		: INT_MAX;
+
+	settings->state_vid.frame_index = (settings->start_frame_index >= 0) ? settings->start_frame_index - 1 : first_frame;
 	settings->state_vid.bits_value = 0;
 	settings->state_vid.bits_left = 16;
 	settings->state_vid.frame_block_index = 0;
@@ -108,10 +213,43 @@ void encode_file_str(settings_t *settings, FILE *output) {
 	settings->state_vid.frame_block_overflow_den = 8*settings->video_fps_num;
 	//fprintf(stderr, "%f\n", ((double)settings->state_vid.frame_block_base_overflow)/((double)settings->state_vid.frame_block_overflow_den)); abort();
 
+	int lba = (settings->start_lba >= 0) ? settings->start_lba : 75*2 + first_group*8;
+
+	if (first_group > 0) {
+		fprintf(stderr, "Starting at %.3f s: frame %d, sector %d\n",
+			first_unit*unit_time, settings->state_vid.frame_index + 1, lba);
+
+		// Skip what comes before the start, encoding the last few audio
+		// sectors of it so the ADPCM predictor carries over into this piece
+		for (int i = 0; i < first_frame; i++) {
+			if (!ensure_av_data(settings, 0, 2)) {
+				fprintf(stderr, "Start is past the end of the input\n");
+				return 1;
+			}
+			retire_av_data(settings, 0, 1);
+		}
+		for (int i = 0; i < first_group; i++) {
+			if (!ensure_av_data(settings, group_samples*2, 0)) {
+				fprintf(stderr, "Start is past the end of the input\n");
+				return 1;
+			}
+			if (i >= first_group - settings->audio_preroll) {
+				encode_sector_xa(settings, xa_settings, &audio_state, settings->audio_samples, audio_samples_per_sector, buffer + 2352 * 7);
+			}
+			retire_av_data(settings, group_samples, 0);
+		}
+	}
+
+	// The pre-roll isn't output, so it isn't counted
+	attach_adpcm_stats(settings, &audio_state, &audio_stats);
+	if (settings->print_stats) {
+		settings->str_stats = stats_create(settings);
+	}
+
 	// FIXME: this needs an extra frame to prevent A/V desync
 	const int frames_needed = 2;
-	for (int j = 0; ensure_av_data(settings, audio_samples_per_sector*av_sample_mul*frames_needed, 1*frames_needed); j+=18) {
-		psx_audio_xa_encode(xa_settings, &audio_state, settings->audio_samples, audio_samples_per_sector, buffer + 2352 * 7);
+	for (int j = first_group*18; j/18 < end_group && ensure_av_data(settings, group_samples*frames_needed, 1*frames_needed); j+=18) {
+		encode_sector_xa(settings, xa_settings, &audio_state, settings->audio_samples, audio_samples_per_sector, buffer + 2352 * 7);
 		
 		// TODO: the final buffer
 		for(int k = 0; k < 7; k++) {
@@ -119,18 +257,180 @@ void encode_file_str(settings_t *settings, FILE *output) {
 		}
 		encode_block_str(settings->video_frames, settings->video_frame_count, buffer, settings);
 		for(int k = 0; k < 8; k++) {
-			int t = k + (j/18)*8 + 75*2;
-
-			// Put the time in
-			buffer[0x00C + 2352*k] = ((t/75/60)%10)|(((t/75/60)/10)<<4);
-			buffer[0x00D + 2352*k] = (((t/75)%60)%10)|((((t/75)%60)/10)<<4);
-			buffer[0x00E + 2352*k] = ((t%75)%10)|(((t%75)/10)<<4);
+			set_sector_msf(buffer + 2352*k, lba++);
 
 			if(k != 7) {
-				calculate_edc_data(buffer + 2352*k);
+				calculate_edc_data_timed(settings, buffer + 2352*k);
+				if (settings->str_stats != NULL) {
+					stats_add_sector(settings->str_stats, settings, buffer + 2352*k);
+				}
+			}
+		}
+		retire_av_data(settings, group_samples, 0);
+		write_output(buffer, 2352*8, output, settings);
+	}
+
+	if (settings->str_stats != NULL) {
+		stats_finish(settings->str_stats);
+		settings->str_stats = NULL;
+	}
+	profile_add_adpcm_stats(settings, audio_state.stats);
+	return 0;
+}
+
+static bool is_str_video_sector(uint8_t *sector) {
+	return (sector[0x012] & 0x08) && sector[0x018] == 0x60 && sector[0x019] == 0x01
+		&& sector[0x01A] == 0x01 && sector[0x01B] == 0x80;
+}
+
+// Joins pieces encoded with --start/--end into one STR: sector timecodes
+// run on from the first piece (or --lba), and frame numbers are shifted so
+// each piece continues from the last frame of the one before it (or start
+// at --frame-index). Video sector EDCs are recalculated.
+int concat_file_str(char **inputs, int input_count, settings_t *settings, FILE *output) {
+	uint8_t sector[2352];
+	int lba = settings->start_lba;
+	int next_frame = settings->start_frame_index;
+	int sectors = 0;
+
+	for (int i = 0; i < input_count; i++) {
+		FILE *input = is_stdio_path(inputs[i]) ? stdin : fopen(inputs[i], "rb");
+		if (input == NULL) {
+			fprintf(stderr, "Could not open input file %s!\n", inputs[i]);
+			return 1;
+		}
+
+		int frame_offset = 0, last_frame = -1;
+		bool first_video = true;
+		size_t amt;
+		while ((amt = fread(sector, 1, sizeof(sector), input)) == sizeof(sector)) {
+			if (lba < 0) {
+				lba = get_sector_msf(sector);
+			}
+			set_sector_msf(sector, lba++);
+
+			if (is_str_video_sector(sector)) {
+				int frame = sector[0x020] | (sector[0x021]<<8) | (sector[0x022]<<16) | (sector[0x023]<<24);
+				if (first_video) {
+					if (next_frame >= 0) frame_offset = next_frame - frame;
+					first_video = false;
+				}
+				frame += frame_offset;
+				last_frame = frame;
+				sector[0x020] = (uint8_t)frame;
+				sector[0x021] = (uint8_t)(frame>>8);
+				sector[0x022] = (uint8_t)(frame>>16);
+				sector[0x023] = (uint8_t)(frame>>24);
+				calculate_edc_data_timed(settings, sector);
 			}
+
+			write_output(sector, sizeof(sector), output, settings);
+			sectors++;
+		}
+		bool ok = (amt == 0) && !ferror(input);
+		if (input != stdin) fclose(input);
+		if (!ok) {
+			fprintf(stderr, "%s is not a whole number of 2352-byte sectors\n", inputs[i]);
+			return 1;
 		}
-		retire_av_data(settings, audio_samples_per_sector*av_sample_mul, 0);
-		fwrite(buffer, 2352*8, 1, output);
+
+		if (last_frame >= 0) next_frame = last_frame + 1;
+		fprintf(stderr, "Appended %s, frame offset %d\n", inputs[i], frame_offset);
+	}
+
+	fprintf(stderr, "Stitched %d pieces into %d sectors, last frame %d\n", input_count, sectors, next_frame - 1);
+	return 0;
+}
+
+// Re-encodes the XA sectors of an existing STR from a new audio input and
+// copies everything else as is, so a movie can be given another language
+// without going through the MDEC encoder again. The audio format, file and
+// channel come from the STR's own audio sectors, keeping the interleave
+// playing at the right speed. A short track is padded with silence.
+int replace_audio_str(const char *str_name, const char *audio_name, settings_t *settings, FILE *output) {
+	uint8_t sector[2352];
+	int16_t silence[4032];
+	size_t amt;
+
+	if (is_stdio_path(str_name)) {
+		fprintf(stderr, "The STR to re-mux can't come from stdin\n");
+		return 1;
+	}
+	FILE *input = fopen(str_name, "rb");
+	if (input == NULL) {
+		fprintf(stderr, "Could not open input file %s!\n", str_name);
+		return 1;
+	}
+
+	while ((amt = fread(sector, 1, sizeof(sector), input)) == sizeof(sector) && !(sector[0x012] & 0x04)) {
+		// look for the first audio sector
+	}
+	if (amt != sizeof(sector)) {
+		fprintf(stderr, "%s has no XA audio sectors\n", str_name);
+		fclose(input);
+		return 1;
+	}
+	settings->file_number = sector[0x010];
+	settings->channel_number = sector[0x011] & 0x1F;
+	settings->stereo = sector[0x013] & 0x01;
+	settings->frequency = (sector[0x013] & 0x04) ? PSX_AUDIO_XA_FREQ_SINGLE : PSX_AUDIO_XA_FREQ_DOUBLE;
+	settings->bits_per_sample = (sector[0x013] & 0x10) ? 8 : 4;
+	fseek(input, 0, SEEK_SET);
+
+	if (!open_av_data(audio_name, settings)) {
+		fprintf(stderr, "Could not open input file %s!\n", audio_name);
+		fclose(input);
+		return 1;
+	}
+	fprintf(stderr, "Re-encoding audio as %d Hz %s, F%d C%d\n", settings->frequency,
+		settings->stereo ? "stereo" : "mono", settings->file_number, settings->channel_number);
+
+	psx_audio_xa_settings_t xa_settings = settings_to_libpsxav_xa_audio(settings);
+	psx_audio_encoder_state_t audio_state;
+	psx_audio_encoder_stats_t audio_stats;
+	int audio_samples_per_sector = psx_audio_xa_get_samples_per_sector(xa_settings);
+	int group_samples = audio_samples_per_sector*(settings->stereo ? 2 : 1);
+	int lba = -1, audio_sectors = 0, silent_sectors = 0;
+
+	memset(&audio_state, 0, sizeof(psx_audio_encoder_state_t));
+	attach_adpcm_stats(settings, &audio_state, &audio_stats);
+	memset(silence, 0, sizeof(silence));
+
+	while ((amt = fread(sector, 1, sizeof(sector), input)) == sizeof(sector)) {
+		if (lba < 0) {
+			lba = get_sector_msf(sector);
+		}
+
+		if (sector[0x012] & 0x04) {
+			// Past the end of the input the samples are padded with zeroes
+			ensure_av_data(settings, group_samples, 0);
+			int16_t *samples = settings->audio_samples;
+			int retired = settings->audio_sample_count < group_samples ? settings->audio_sample_count : group_samples;
+			if (retired == 0) {
+				samples = silence;
+				silent_sectors++;
+			}
+			encode_sector_xa(settings, xa_settings, &audio_state, samples, audio_samples_per_sector, sector);
+			retire_av_data(settings, retired, settings->video_frame_count);
+			audio_sectors++;
+		}
+
+		set_sector_msf(sector, lba++);
+		write_output(sector, sizeof(sector), output, settings);
+	}
+	bool ok = (amt == 0) && !ferror(input);
+	fclose(input);
+	profile_add_adpcm_stats(settings, audio_state.stats);
+
+	if (settings->audio_sample_count > 0 || poll_av_data(settings)) {
+		fprintf(stderr, "The new audio is longer than the STR, cutting it short\n");
+	}
+	close_av_data(settings);
+
+	if (!ok) {
+		fprintf(stderr, "%s is not a whole number of 2352-byte sectors\n", str_name);
+		return 1;
 	}
+	fprintf(stderr, "Replaced %d audio sectors (%d silent)\n", audio_sectors, silent_sectors);
+	return 0;
 }
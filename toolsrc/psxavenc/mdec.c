@@ -22,11 +22,34 @@ freely, subject to the following restrictions:
 */
 
 #include "common.h"
+#include <pthread.h>
 
 // high 8 bits = bit count
 // low 24 bits = value
 uint32_t huffman_encoding_map[0x10000];
-bool dct_done_init = false;
+
+// Indexed by the number of zeroes a code starts with, never more than 11,
+// and the 7 bits after them, which hold the rest of any code:
+// bits 24+ = HUFFMAN_DECODE_*, bits 16-23 = code length, low 16 bits = RLE halfword
+#define HUFFMAN_DECODE_ZEROES 11
+#define HUFFMAN_DECODE_SUFFIX 7
+#define HUFFMAN_DECODE_BITS (HUFFMAN_DECODE_ZEROES+HUFFMAN_DECODE_SUFFIX)
+static uint32_t huffman_decoding_map[(HUFFMAN_DECODE_ZEROES+1)<<HUFFMAN_DECODE_SUFFIX];
+// The same entries indexed directly by the next 10 bits, for codes that fit
+// in them, and 0 for longer ones
+#define HUFFMAN_DECODE_SHORT 10
+static uint32_t huffman_decoding_short[1<<HUFFMAN_DECODE_SHORT];
+#define HUFFMAN_DECODE_CODE 1
+#define HUFFMAN_DECODE_EOB 2
+#define HUFFMAN_DECODE_ESCAPE 3
+
+// The basis of idct_block in 2.14 fixed point, row k = frequency, and in
+// 1.15 for the 4x4 path, there also with every entry repeated across a row
+// of 8 so the column pass can take it as a vector
+static int16_t idct_table[8*8];
+static int16_t idct_table_4x4[8*8];
+static int16_t idct_rows_4x4[4*8*8];
+static pthread_once_t dct_init_once = PTHREAD_ONCE_INIT;
 
 #define MAKE_HUFFMAN_PAIR(zeroes, value) (((zeroes)<<10)|((+(value))&0x3FF)),(((zeroes)<<10)|((-(value))&0x3FF))
 const struct {
@@ -194,6 +217,24 @@ const int16_t dct_scale_table[8*8] = {
 	+0x18F8, -0x471D, +0x6A6D, -0x7D8B, +0x7D8A, -0x6A6E, +0x471C, -0x18F9,
 };
 
+// Fills the slots of all the streams the code is a prefix of
+static void add_huffman_decoding(uint32_t code, int bits, uint32_t entry)
+{
+	int zeroes = 0;
+	while(!(code & (1<<(bits-1-zeroes)))) {
+		zeroes++;
+	}
+	int suffix_bits = bits-zeroes;
+	for(int j = 0; j < (1<<(HUFFMAN_DECODE_SUFFIX-suffix_bits)); j++) {
+		huffman_decoding_map[(zeroes<<HUFFMAN_DECODE_SUFFIX)|(code<<(HUFFMAN_DECODE_SUFFIX-suffix_bits))|j] = entry;
+	}
+	if (bits <= HUFFMAN_DECODE_SHORT) {
+		for(int j = 0; j < (1<<(HUFFMAN_DECODE_SHORT-bits)); j++) {
+			huffman_decoding_short[(code<<(HUFFMAN_DECODE_SHORT-bits))|j] = entry;
+		}
+	}
+}
+
 static void init_dct_data(void)
 {
 	for(int i = 0; i <= 0xFFFF; i++) {
@@ -207,6 +248,29 @@ static void init_dct_data(void)
 		huffman_encoding_map[huffman_lookup[i].u_hword_neg] = (bits<<24)|(base_value<<1)|1;
 	}
 
+	for(int i = 0; i < sizeof(huffman_lookup)/sizeof(huffman_lookup[0]); i++) {
+		int bits = huffman_lookup[i].c_bits+1;
+		uint32_t code = huffman_lookup[i].c_value<<1;
+		add_huffman_decoding(code|0, bits, (HUFFMAN_DECODE_CODE<<24)|(bits<<16)|huffman_lookup[i].u_hword_pos);
+		add_huffman_decoding(code|1, bits, (HUFFMAN_DECODE_CODE<<24)|(bits<<16)|huffman_lookup[i].u_hword_neg);
+	}
+	add_huffman_decoding(0x2, 2, (HUFFMAN_DECODE_EOB<<24)|(2<<16));
+	add_huffman_decoding(0x1, 6, (HUFFMAN_DECODE_ESCAPE<<24)|(6<<16));
+
+	// dct_scale_table holds the same basis in 0.16
+	for(int i = 0; i < 8*8; i++) {
+		idct_table[i] = (dct_scale_table[i] + 2)>>2;
+		idct_table_4x4[i] = (dct_scale_table[i] + 1)>>1;
+	}
+	for(int i = 0; i < 4*8*8; i++) {
+		idct_rows_4x4[i] = idct_table_4x4[8*(i>>6)+((i>>3)&7)];
+	}
+}
+
+// Safe to call from several threads; the table is only built once.
+void prepare_dct_data(void)
+{
+	pthread_once(&dct_init_once, init_dct_data);
 }
 
 static void flush_bits(vid_encoder_state_t *state)
@@ -385,6 +449,7 @@ static int reduce_dct_block(vid_encoder_state_t *state, int32_t *block, int32_t
 			if ((*values_to_shed) > 0 && abs(block[i]) < min_val*1) {
 				block[i] = 0;
 				(*values_to_shed)--;
+				state->coeffs_shed++;
 			} else {
 				nonzeroes++;
 			}
@@ -405,10 +470,7 @@ static void encode_frame_str(uint8_t *video_frames, int video_frame_count, uint8
 	//uint8_t *video_frame = video_frames + settings->video_width*settings->video_height*4*real_index;
 	uint8_t *video_frame = video_frames;
 
-	if (!dct_done_init) {
-		init_dct_data();
-		dct_done_init = true;
-	}
+	prepare_dct_data();
 
 	if (settings->state_vid.dct_block_lists[0] == NULL) {
 		int dct_block_count_x = (settings->video_width+15)/16;
@@ -422,6 +484,7 @@ static void encode_frame_str(uint8_t *video_frames, int video_frame_count, uint8
 	memset(settings->state_vid.unmuxed, 0, sizeof(settings->state_vid.unmuxed));
 
 	settings->state_vid.quant_scale = 1;
+	settings->state_vid.coeffs_shed = 0;
 	settings->state_vid.uncomp_hwords_used = 0;
 	settings->state_vid.bytes_used = 8;
 	settings->state_vid.blocks_used = 0;
@@ -430,7 +493,9 @@ static void encode_frame_str(uint8_t *video_frames, int video_frame_count, uint8
 	assert((settings->video_width % 16) == 0);
 	assert((settings->video_height % 16) == 0);
 
-	// Do the initial transform
+	// Convert to YCbCr, then do the initial transform over every block
+	profile_mark_t mark;
+	profile_begin(settings, &mark);
 	for(int fx = 0; fx < settings->video_width; fx += 16) {
 	for(int fy = 0; fy < settings->video_height; fy += 16) {
 		// Order: Cr Cb [Y1|Y2\nY3|Y4]
@@ -487,11 +552,18 @@ static void encode_frame_str(uint8_t *video_frames, int video_frame_count, uint8
 			}
 		}
 		}
-		for(int i = 0; i < 6; i++) {
-			transform_dct_block(&(settings->state_vid), blocks[i]);
-		}
 	}
 	}
+	profile_end(settings, PROFILE_COLOUR, &mark);
+
+	profile_begin(settings, &mark);
+	for(int i = 0; i < 6; i++) {
+		int32_t *block = settings->state_vid.dct_block_lists[i];
+		for(int j = 0; j < ((settings->video_width+15)/16)*((settings->video_height+15)/16); j++) {
+			transform_dct_block(&(settings->state_vid), block + 8*8*j);
+		}
+	}
+	profile_end(settings, PROFILE_DCT, &mark);
 
 	// Now reduce all the blocks
 	// TODO: Base this on actual bit count
@@ -501,6 +573,7 @@ static void encode_frame_str(uint8_t *video_frames, int video_frame_count, uint8
 	int values_to_shed = 0;
 	for(int min_val = 0;; min_val += 1) {
 		int accum = 0;
+		profile_begin(settings, &mark);
 		for(int fx = 0; fx < settings->video_width; fx += 16) {
 		for(int fy = 0; fy < settings->video_height; fy += 16) {
 			// Order: Cr Cb [Y1|Y2\nY3|Y4]
@@ -520,6 +593,7 @@ static void encode_frame_str(uint8_t *video_frames, int video_frame_count, uint8
 			}
 		}
 		}
+		profile_end(settings, PROFILE_RATE_CONTROL, &mark);
 
 		if(accum <= accum_threshold) {
 			break;
@@ -529,6 +603,7 @@ static void encode_frame_str(uint8_t *video_frames, int video_frame_count, uint8
 	}
 
 	// Now encode all the blocks
+	profile_begin(settings, &mark);
 	for(int fx = 0; fx < settings->video_width; fx += 16) {
 	for(int fy = 0; fy < settings->video_height; fy += 16) {
 		// Order: Cr Cb [Y1|Y2\nY3|Y4]
@@ -553,6 +628,7 @@ static void encode_frame_str(uint8_t *video_frames, int video_frame_count, uint8
 	settings->state_vid.uncomp_hwords_used = (settings->state_vid.uncomp_hwords_used+0xF)&~0xF;
 
 	flush_bits(&(settings->state_vid));
+	profile_end(settings, PROFILE_HUFFMAN, &mark);
 
 	settings->state_vid.blocks_used = ((settings->state_vid.uncomp_hwords_used+0xF)&~0xF)>>4;
 
@@ -569,6 +645,11 @@ static void encode_frame_str(uint8_t *video_frames, int video_frame_count, uint8
 	settings->state_vid.unmuxed[0x006] = 0x02; // Version 2
 	settings->state_vid.unmuxed[0x007] = 0x00;
 
+	profile_note_buffers(settings);
+	if (settings->str_stats != NULL) {
+		stats_add_frame(settings->str_stats, settings, video_frame);
+	}
+
 	retire_av_data(settings, 0, 1);
 }
 
@@ -642,3 +723,290 @@ void encode_block_str(uint8_t *video_frames, int video_frame_count, uint8_t *out
 		settings->state_vid.frame_block_index++;
 	}
 }
+
+//
+// Decoding
+//
+// A reference for what the MDEC makes of encode_frame_str's output: the
+// bitstream is Huffman/RLE decoded, dequantised with the hardware's
+// formula (DC * q[0], AC * q[k] * scale / 8), inverse transformed and
+// converted with the MDEC's YCbCr -> RGB coefficients.
+//
+
+typedef struct {
+	const uint8_t *data;
+	int length;
+	int pos;
+	uint64_t bits;
+	int bits_left;
+} bit_reader_t;
+
+// Bits are packed MSB first into little-endian halfwords. The buffer is
+// topped up a word at a time whenever it holds less than 32 bits, which
+// covers a code with its escaped halfword, so peeking and reading never
+// have to load. A word is read in one go while the data lasts, swapping
+// its halfwords (so on a little-endian host, like the rest of the tool).
+static inline void refill_bits(bit_reader_t *reader)
+{
+	if (reader->bits_left < 32) {
+		uint32_t word = 0;
+		if (reader->pos + 4 <= reader->length) {
+			memcpy(&word, reader->data + reader->pos, 4);
+			word = (word<<16)|(word>>16);
+		} else {
+			for (int i = 0; i < 4; i += 2) {
+				if (reader->pos + i + 1 < reader->length) {
+					word |= (reader->data[reader->pos+i] | (reader->data[reader->pos+i+1]<<8))<<(16-8*i);
+				}
+			}
+		}
+		reader->pos += 4;
+		reader->bits = (reader->bits<<32)|word;
+		reader->bits_left += 32;
+	}
+}
+
+static inline uint32_t peek_bits(bit_reader_t *reader, int bits)
+{
+	return (uint32_t)(reader->bits>>(reader->bits_left-bits))&((1<<bits)-1);
+}
+
+static inline uint32_t read_bits(bit_reader_t *reader, int bits)
+{
+	uint32_t value = peek_bits(reader, bits);
+	reader->bits_left -= bits;
+	return value;
+}
+
+// True once more bits have been read than the stream holds
+static bool bits_overrun(bit_reader_t *reader)
+{
+	return 8*reader->pos - reader->bits_left > 8*reader->length;
+}
+
+static int sign_extend_10(uint32_t value)
+{
+	return (int)(value<<22)>>22;
+}
+
+// High half of a 16x16 bit product, which the compiler turns into a SIMD
+// multiply
+static inline int16_t mul_high(int16_t a, int16_t b)
+{
+	return (int16_t)((a*b)>>16);
+}
+
+// Inverse transform of a block whose coefficients all lie in the top-left
+// 4x4 corner, as nearly all do at low rates. So few coefficients can't
+// overflow 16 bits, so both passes are sums of four multiply-highs on
+// rows of 8 halfwords: the coefficients are scaled up by 32 to keep four
+// fractional bits in between, and the output has three, rounded off with
+// a bias that makes up for the multiplies truncating.
+static void idct_block_4x4(const int16_t *block, int16_t *output, int pitch)
+{
+	int16_t midblock[4*8];
+
+	for (int y = 0; y < 4; y++) {
+		int16_t c0 = block[8*y+0]*32, c1 = block[8*y+1]*32, c2 = block[8*y+2]*32, c3 = block[8*y+3]*32;
+		for (int x = 0; x < 8; x++) {
+			midblock[8*y+x] = mul_high(c0, idct_table_4x4[x]) + mul_high(c1, idct_table_4x4[8+x])
+				+ mul_high(c2, idct_table_4x4[16+x]) + mul_high(c3, idct_table_4x4[24+x]);
+		}
+	}
+	for (int y = 0; y < 8; y++) {
+		int16_t row[8];
+		for (int x = 0; x < 8; x++) {
+			int16_t v = mul_high(idct_rows_4x4[8*y+x], midblock[x]) + mul_high(idct_rows_4x4[64+8*y+x], midblock[8+x])
+				+ mul_high(idct_rows_4x4[128+8*y+x], midblock[16+x]) + mul_high(idct_rows_4x4[192+8*y+x], midblock[24+x]);
+			row[x] = (int16_t)(v + 5)>>3;
+		}
+		// Copied out separately, as output could alias the tables
+		for (int x = 0; x < 8; x++) {
+			output[pitch*y+x] = row[x];
+		}
+	}
+}
+
+// Inverse transform in integer arithmetic: rows first, then columns, each
+// a product with the basis in 2.14 fixed point, with three bits of extra
+// precision kept in between. Only the top-left rows x cols corner holding
+// nonzero coefficients is multiplied through, a DC-only block is a plain
+// fill and a corner of up to 4x4 goes to idct_block_4x4. Every inner loop
+// runs along a row of 8 so the compiler turns it into SIMD multiply-adds.
+#define IDCT_MID_SHIFT 11
+#define IDCT_OUT_SHIFT 17
+
+static void idct_block(const int16_t *block, int rows, int cols, int16_t *output, int pitch)
+{
+	int16_t midblock[8*8];
+	int32_t acc[8];
+
+	if (rows == 1 && cols == 1) {
+		int16_t v = (int16_t)((block[0] + 4)>>3);
+		for (int y = 0; y < 8; y++) {
+			for (int x = 0; x < 8; x++) {
+				output[pitch*y+x] = v;
+			}
+		}
+		return;
+	}
+	if (rows <= 4 && cols <= 4) {
+		idct_block_4x4(block, output, pitch);
+		return;
+	}
+	for (int y = 0; y < rows; y++) {
+		for (int x = 0; x < 8; x++) {
+			acc[x] = 0;
+		}
+		for (int k = 0; k < cols; k++) {
+			int32_t c = block[8*y+k];
+			for (int x = 0; x < 8; x++) {
+				acc[x] += c*idct_table[8*k+x];
+			}
+		}
+		for (int x = 0; x < 8; x++) {
+			midblock[8*y+x] = (int16_t)((acc[x] + (1<<(IDCT_MID_SHIFT-1)))>>IDCT_MID_SHIFT);
+		}
+	}
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++) {
+			acc[x] = 0;
+		}
+		for (int k = 0; k < rows; k++) {
+			int32_t c = idct_table[8*k+y];
+			for (int x = 0; x < 8; x++) {
+				acc[x] += c*midblock[8*k+x];
+			}
+		}
+		for (int x = 0; x < 8; x++) {
+			output[pitch*y+x] = (int16_t)((acc[x] + (1<<(IDCT_OUT_SHIFT-1)))>>IDCT_OUT_SHIFT);
+		}
+	}
+}
+
+// The MDEC saturates dequantised coefficients to 11 bits
+static int16_t clamp_coeff(int value)
+{
+	return value < -0x400 ? -0x400 : (value > 0x3FF ? 0x3FF : value);
+}
+
+// Stores the dequantised coefficients in block, which must be all zeroes,
+// and sets rows and cols to the size of the corner they lie in
+static bool decode_dct_block(bit_reader_t *reader, int quant_scale, int16_t *block, int *rows, int *cols)
+{
+	int last_row = 0, last_col = 0;
+
+	refill_bits(reader);
+	block[0] = clamp_coeff(sign_extend_10(read_bits(reader, 10))*quant_dec[0]);
+
+	for (int i = 0;;) {
+		refill_bits(reader);
+		uint32_t entry = huffman_decoding_short[peek_bits(reader, HUFFMAN_DECODE_SHORT)];
+		if (entry == 0) {
+			uint32_t window = peek_bits(reader, HUFFMAN_DECODE_BITS);
+			int zeroes = window ? __builtin_clz(window) - (32-HUFFMAN_DECODE_BITS) : HUFFMAN_DECODE_BITS;
+			if (zeroes > HUFFMAN_DECODE_ZEROES) {
+				return false;
+			}
+			entry = huffman_decoding_map[(zeroes<<HUFFMAN_DECODE_SUFFIX)|((window>>(HUFFMAN_DECODE_ZEROES-zeroes))&((1<<HUFFMAN_DECODE_SUFFIX)-1))];
+		}
+		uint32_t hword = entry&0xFFFF;
+
+		if ((entry>>24) == HUFFMAN_DECODE_CODE) {
+			read_bits(reader, (entry>>16)&0xFF);
+		} else if ((entry>>24) == HUFFMAN_DECODE_EOB) {
+			read_bits(reader, 2);
+			*rows = last_row+1;
+			*cols = last_col+1;
+			return true;
+		} else if ((entry>>24) == HUFFMAN_DECODE_ESCAPE) {
+			read_bits(reader, 6);
+			hword = read_bits(reader, 16);
+		} else {
+			return false;
+		}
+
+		i += (hword>>10)+1;
+		if (i > 63 || bits_overrun(reader)) {
+			return false;
+		}
+		int ri = dct_zagzig_table[i];
+		block[ri] = clamp_coeff((sign_extend_10(hword&0x3FF)*quant_dec[ri]*quant_scale+4)/8);
+		if ((ri>>3) > last_row) last_row = ri>>3;
+		if ((ri&7) > last_col) last_col = ri&7;
+	}
+}
+
+static uint8_t clamp_pixel(int16_t value)
+{
+	return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// Decodes a demuxed frame, header included, calling fn for every
+// macroblock. Returns false if the bitstream is corrupt.
+bool decode_frame_str(const uint8_t *data, int length, int width, int height, mdec_macroblock_fn fn, void *arg)
+{
+	bit_reader_t reader;
+	int16_t coeffs[8*8];
+	int16_t chroma[2][8*8];
+	int16_t luma[16*16];
+	int16_t dr[8*16], dg[8*16], db[8*16];
+	uint8_t r[16*16], g[16*16], b[16*16];
+
+	prepare_dct_data();
+	if (length < 8) {
+		return false;
+	}
+	int quant_scale = data[4]|(data[5]<<8);
+
+	reader.data = data + 8;
+	reader.length = length - 8;
+	reader.pos = 0;
+	reader.bits = 0;
+	reader.bits_left = 0;
+	memset(coeffs, 0, sizeof(coeffs));
+
+	// Macroblocks run down the columns, in the order Cr Cb [Y1|Y2\nY3|Y4]
+	for (int fx = 0; fx < width; fx += 16) {
+	for (int fy = 0; fy < height; fy += 16) {
+		for (int i = 0; i < 6; i++) {
+			int rows, cols;
+			if (!decode_dct_block(&reader, quant_scale, coeffs, &rows, &cols)) {
+				return false;
+			}
+			if (i < 2) {
+				idct_block(coeffs, rows, cols, chroma[i], 8);
+			} else {
+				idct_block(coeffs, rows, cols, luma + 8*(i&1) + 16*8*((i-2)>>1), 16);
+			}
+			// Only the rows the coefficients lie in need clearing again
+			for (int y = 0; y < rows; y++) {
+				memset(coeffs + 8*y, 0, sizeof(int16_t)*8);
+			}
+		}
+
+		// 1.402, 0.3437, 0.7143 and 1.772 in 8.8 fixed point, each chroma
+		// sample stored twice to stretch it across a macroblock row
+		for (int i = 0; i < 8*8; i++) {
+			int cr = chroma[0][i], cb = chroma[1][i];
+			dr[2*i] = dr[2*i+1] = (359*cr + 128)>>8;
+			dg[2*i] = dg[2*i+1] = -((88*cb + 183*cr + 128)>>8);
+			db[2*i] = db[2*i+1] = (454*cb + 128)>>8;
+		}
+		for (int y = 0; y < 16; y++) {
+			const int16_t *ly = luma + 16*y;
+			int c = 16*(y>>1);
+			for (int x = 0; x < 16; x++) {
+				int16_t l = ly[x] + 128;
+				r[16*y+x] = clamp_pixel((int16_t)(l + dr[c+x]));
+				g[16*y+x] = clamp_pixel((int16_t)(l + dg[c+x]));
+				b[16*y+x] = clamp_pixel((int16_t)(l + db[c+x]));
+			}
+		}
+
+		fn(arg, fx, fy, r, g, b);
+	}
+	}
+
+	return true;
+}
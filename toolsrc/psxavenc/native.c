@@ -0,0 +1,375 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#define _GNU_SOURCE // mremap
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+// Native input readers
+//
+// Pre-processed assets don't need FFmpeg's probing, decoding and
+// resampling. These are sniffed from the file header and used when the
+// input already matches the output settings; anything else falls back to
+// FFmpeg.
+//
+//   WAV: 16-bit PCM at the output rate and channel count. The file is
+//        mapped copy-on-write and the encoder reads the samples in place.
+//   Y4M: 4:2:0 frames at the output size. Frames are converted to RGBA as
+//        the encoder asks for them; the audio track is silence.
+//
+
+// Encoders expect this many zero samples per channel past the end
+#define SAMPLE_PADDING 4032
+
+// Enough to recognise either header
+#define STDIN_PEEK_SIZE 4096
+
+static uint32_t read_u32(const uint8_t *p) {
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static uint16_t read_u16(const uint8_t *p) {
+	return p[0] | (p[1]<<8);
+}
+
+// Maps the file with extra_size writable zero bytes after it.
+static uint8_t *map_file(const char *filename, size_t *file_size, size_t *map_size, size_t extra_size) {
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 16) {
+		close(fd);
+		return NULL;
+	}
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	*file_size = st.st_size;
+	*map_size = (st.st_size + extra_size + page - 1) & ~(page - 1);
+
+	// Reserve zeroed memory, then lay the file over the start of it
+	uint8_t *map = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	if (mmap(map, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(map, *map_size);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	return map;
+}
+
+// Reads from stdin into a growing mapping with extra_size zero bytes after
+// the data. With peek_only, stops once STDIN_PEEK_SIZE bytes are in.
+static uint8_t *read_stdin(size_t *data_size, size_t *map_size, size_t extra_size, uint8_t *map, bool peek_only, bool *eof) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	if (map == NULL) {
+		*data_size = 0;
+		*map_size = (STDIN_PEEK_SIZE + extra_size + page - 1) & ~(page - 1);
+		map = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) return NULL;
+	}
+
+	while (!*eof && !(peek_only && *data_size >= STDIN_PEEK_SIZE)) {
+		if (*data_size + extra_size + 0x10000 > *map_size) {
+			size_t new_size = (*map_size * 2 + page - 1) & ~(page - 1);
+			uint8_t *new_map = mremap(map, *map_size, new_size, MREMAP_MAYMOVE);
+			if (new_map == MAP_FAILED) {
+				munmap(map, *map_size);
+				return NULL;
+			}
+			map = new_map;
+			*map_size = new_size;
+		}
+		size_t want = peek_only ? STDIN_PEEK_SIZE - *data_size : *map_size - extra_size - *data_size;
+		ssize_t n = read(STDIN_FILENO, map + *data_size, want);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			*eof = true;
+			break;
+		}
+		*data_size += n;
+	}
+	return map;
+}
+
+static bool open_wav(av_decoder_state_t *av, settings_t *settings, size_t file_size) {
+	const uint8_t *p = av->map;
+	int channels = settings->stereo ? 2 : 1;
+	bool have_fmt = false;
+
+	if (memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) return false;
+
+	for (size_t pos = 12; pos + 8 <= file_size; ) {
+		uint32_t chunk_size = read_u32(p + pos + 4);
+		size_t body = pos + 8;
+		if (chunk_size > file_size - body) chunk_size = file_size - body;
+
+		if (memcmp(p + pos, "fmt ", 4) == 0 && chunk_size >= 16) {
+			uint16_t format = read_u16(p + body);
+			// 1 = PCM, 0xFFFE = WAVE_FORMAT_EXTENSIBLE with a PCM subformat
+			bool pcm = format == 1 || (format == 0xFFFE && chunk_size >= 26 && read_u16(p + body + 24) == 1);
+			if (!pcm
+				|| read_u16(p + body + 2) != channels
+				|| read_u32(p + body + 4) != (uint32_t)settings->frequency
+				|| read_u16(p + body + 14) != 16) {
+				return false;
+			}
+			have_fmt = true;
+		} else if (memcmp(p + pos, "data", 4) == 0) {
+			if (!have_fmt || (body & 1) != 0) return false;
+			av->sample_count_mul = channels;
+			settings->audio_samples = (int16_t *)(av->map + body);
+			settings->audio_sample_count = (chunk_size / (2 * channels)) * channels;
+			// Whatever follows the samples gets overwritten by the padding
+			memset(settings->audio_samples + settings->audio_sample_count, 0,
+				SAMPLE_PADDING * channels * sizeof(int16_t));
+			return true;
+		}
+
+		pos = body + chunk_size + (chunk_size & 1);
+	}
+
+	return false;
+}
+
+static int y4m_param(const char *header, char tag, int *a, int *b) {
+	for (const char *p = strchr(header, ' '); p != NULL; p = strchr(p + 1, ' ')) {
+		if (p[1] == tag) {
+			return sscanf(p + 2, "%d:%d", a, b);
+		}
+	}
+	return 0;
+}
+
+// Returns what follows prefix in the header token starting with it, or NULL
+static const char *y4m_token(const char *header, const char *prefix, size_t *len) {
+	size_t prefix_len = strlen(prefix);
+	for (const char *p = strchr(header, ' '); p != NULL; p = strchr(p + 1, ' ')) {
+		if (strncmp(p + 1, prefix, prefix_len) == 0) {
+			*len = strcspn(p + 1 + prefix_len, " ");
+			return p + 1 + prefix_len;
+		}
+	}
+	return NULL;
+}
+
+static bool y4m_token_is(const char *value, size_t len, const char *expected) {
+	return len == strlen(expected) && strncmp(value, expected, len) == 0;
+}
+
+// 8-bit 4:2:0 in limited range is all y4m_to_rgba handles; the chroma
+// siting variants share its plane layout. Anything else goes to FFmpeg.
+static bool y4m_format_supported(const char *header) {
+	size_t len;
+	const char *colour = y4m_token(header, "C", &len);
+	if (colour != NULL
+		&& !y4m_token_is(colour, len, "420")
+		&& !y4m_token_is(colour, len, "420jpeg")
+		&& !y4m_token_is(colour, len, "420paldv")
+		&& !y4m_token_is(colour, len, "420mpeg2")) {
+		return false;
+	}
+	const char *range = y4m_token(header, "XCOLORRANGE=", &len);
+	if (range != NULL && !y4m_token_is(range, len, "LIMITED")) {
+		return false;
+	}
+	return true;
+}
+
+static bool open_y4m(av_decoder_state_t *av, settings_t *settings, size_t file_size) {
+	char header[256];
+	const uint8_t *nl = memchr(av->map, '\n', file_size < sizeof(header) ? file_size : sizeof(header));
+	if (memcmp(av->map, "YUV4MPEG2 ", 10) != 0 || nl == NULL) return false;
+	memcpy(header, av->map, nl - av->map);
+	header[nl - av->map] = '\0';
+
+	int width, height, num, den = 1, unused;
+	if (y4m_param(header, 'W', &width, &unused) < 1
+		|| y4m_param(header, 'H', &height, &unused) < 1
+		|| y4m_param(header, 'F', &num, &den) < 2
+		|| num <= 0 || den <= 0) {
+		return false;
+	}
+	if (!y4m_format_supported(header)) return false;
+	if (strstr(header, " Ii") != NULL || strstr(header, " It") != NULL || strstr(header, " Ib") != NULL) return false;
+	if (width != settings->video_width || height != settings->video_height) return false;
+
+	av->y4m_width = width;
+	av->y4m_height = height;
+	av->y4m_fps_num = num;
+	av->y4m_fps_den = den;
+	av->y4m_frame_index = 0;
+	av->y4m_pos = nl - av->map + 1;
+	av->y4m_frame_size = width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+	av->video_frame_src_size = 4 * width * height;
+	av->video_frame_dst_size = 4 * settings->video_width * settings->video_height;
+
+	// Silent audio for the length of the video
+	size_t frame_count = (file_size - av->y4m_pos) / (av->y4m_frame_size + 6);
+	int channels = settings->stereo ? 2 : 1;
+	int sample_count = (int)(((uint64_t)frame_count * settings->frequency * den + num - 1) / num);
+	av->sample_count_mul = channels;
+	settings->audio_sample_count = sample_count * channels;
+	settings->audio_samples = calloc(settings->audio_sample_count + SAMPLE_PADDING * channels, sizeof(int16_t));
+	return settings->audio_samples != NULL;
+}
+
+bool open_native_data(const char *filename, settings_t *settings) {
+	av_decoder_state_t *av = &(settings->decoder_state_av);
+	size_t padding = SAMPLE_PADDING * 2 * sizeof(int16_t);
+
+	av->from_stdin = is_stdio_path(filename);
+	av->stdin_eof = false;
+	av->avio_pos = 0;
+	if (av->from_stdin) {
+		// Only slurp the whole stream if it looks like something we read
+		av->map = read_stdin(&(av->file_size), &(av->map_size), padding, NULL, true, &(av->stdin_eof));
+		if (av->map == NULL) return false;
+		if (memcmp(av->map, "RIFF", 4) != 0 && memcmp(av->map, "YUV4MPEG2 ", 10) != 0) {
+			return false;
+		}
+		av->map = read_stdin(&(av->file_size), &(av->map_size), padding, av->map, false, &(av->stdin_eof));
+		if (av->map == NULL) return false;
+	} else {
+		av->map = map_file(filename, &(av->file_size), &(av->map_size), padding);
+		if (av->map == NULL) return false;
+	}
+	size_t file_size = av->file_size;
+	if (file_size < 16) return false;
+
+	settings->audio_samples = NULL;
+	settings->audio_sample_count = 0;
+	settings->video_frames = NULL;
+	settings->video_frame_count = 0;
+
+	if (open_wav(av, settings, file_size)) {
+		av->native = NATIVE_WAV;
+		fprintf(stderr, "Reading %s as native WAV\n", filename);
+		return true;
+	}
+	if (open_y4m(av, settings, file_size)) {
+		av->native = NATIVE_Y4M;
+		fprintf(stderr, "Reading %s as native Y4M (%d:%d fps, silent audio)\n",
+			filename, av->y4m_fps_num, av->y4m_fps_den);
+		return true;
+	}
+
+	// Anything read from stdin is handed on to FFmpeg (see open_av_data)
+	if (!av->from_stdin) {
+		munmap(av->map, av->map_size);
+		av->map = NULL;
+	}
+	settings->audio_samples = NULL;
+	settings->audio_sample_count = 0;
+	return false;
+}
+
+static uint8_t clamp_u8(int v) {
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// BT.601 limited range, as swscale treats untagged yuv420p
+static void y4m_to_rgba(const uint8_t *src, int width, int height, uint8_t *dst) {
+	int cw = (width + 1) / 2;
+	const uint8_t *py = src;
+	const uint8_t *pu = py + width * height;
+	const uint8_t *pv = pu + cw * ((height + 1) / 2);
+
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int c = 298 * (py[y * width + x] - 16);
+			int d = pu[(y / 2) * cw + x / 2] - 128;
+			int e = pv[(y / 2) * cw + x / 2] - 128;
+			uint8_t *out = dst + 4 * (y * width + x);
+			out[0] = clamp_u8((c + 409 * e + 128) >> 8);
+			out[1] = clamp_u8((c - 100 * d - 208 * e + 128) >> 8);
+			out[2] = clamp_u8((c + 516 * d + 128) >> 8);
+			out[3] = 0xFF;
+		}
+	}
+}
+
+bool poll_native_data(settings_t *settings) {
+	av_decoder_state_t *av = &(settings->decoder_state_av);
+	profile_mark_t mark;
+
+	while (av->native == NATIVE_Y4M && av->y4m_pos + 5 < av->file_size) {
+		profile_begin(settings, &mark);
+		const uint8_t *p = av->map + av->y4m_pos;
+		const uint8_t *nl = memchr(p, '\n', av->file_size - av->y4m_pos);
+		if (memcmp(p, "FRAME", 5) != 0 || nl == NULL
+			|| (size_t)(nl + 1 - av->map) + av->y4m_frame_size > av->file_size) {
+			break;
+		}
+		const uint8_t *frame = nl + 1;
+		av->y4m_pos = (frame - av->map) + av->y4m_frame_size;
+		profile_end(settings, PROFILE_DEMUX, &mark);
+
+		// Same frame dropping as the FFmpeg path
+		double pts = ((double)av->y4m_frame_index++ * av->y4m_fps_den) / av->y4m_fps_num;
+		if (settings->video_frame_count >= 1 && pts < av->video_next_pts) {
+			continue;
+		}
+		if (settings->video_frame_count < 1) {
+			av->video_next_pts = pts;
+		}
+		av->video_next_pts += ((double)settings->video_fps_den) / settings->video_fps_num;
+
+		settings->video_frames = realloc(settings->video_frames, (settings->video_frame_count + 1) * av->video_frame_dst_size);
+		profile_begin(settings, &mark);
+		y4m_to_rgba(frame, av->y4m_width, av->y4m_height,
+			settings->video_frames + av->video_frame_dst_size * settings->video_frame_count);
+		profile_end(settings, PROFILE_COLOUR, &mark);
+		settings->video_frame_count += 1;
+		return true;
+	}
+
+	// Keep the zero padding right after whatever is left
+	memset(settings->audio_samples + settings->audio_sample_count, 0,
+		SAMPLE_PADDING * av->sample_count_mul * sizeof(int16_t));
+	return false;
+}
+
+void close_native_data(settings_t *settings) {
+	av_decoder_state_t *av = &(settings->decoder_state_av);
+
+	if (av->native == NATIVE_Y4M) {
+		free(settings->audio_samples);
+	}
+	settings->audio_samples = NULL;
+	if (settings->video_frames != NULL) {
+		free(settings->video_frames);
+		settings->video_frames = NULL;
+	}
+	munmap(av->map, av->map_size);
+	av->map = NULL;
+	av->native = NATIVE_NONE;
+}
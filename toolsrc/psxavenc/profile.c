@@ -0,0 +1,231 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "common.h"
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+
+//
+// Per-stage timing (--profile)
+//
+// Every stage keeps a call count, wall time and CPU time of the calling
+// thread. The multi-input XA workers share one profile, so the counters
+// are updated atomically and stage times are summed over threads. When
+// settings->profile is NULL every hook returns straight away.
+//
+// Each audio encoder also hands libpsxav a psx_audio_encoder_stats_t of
+// its own and adds it to the profile when done, so the report includes
+// what the ADPCM search chose per channel.
+//
+
+// Bump whenever a field is renamed or its meaning changes
+#define PROFILE_VERSION 1
+
+typedef struct {
+	uint64_t calls;
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+} profile_stage_t;
+
+struct profile {
+	profile_stage_t stages[PROFILE_STAGE_COUNT];
+	uint64_t start_wall_ns;
+	uint64_t start_cpu_ns;
+	uint64_t output_bytes;
+	uint64_t peak_audio_bytes;
+	uint64_t peak_video_bytes;
+	uint64_t peak_unmuxed_bytes;
+	psx_audio_encoder_stats_t adpcm;
+};
+
+static const char *stage_names[PROFILE_STAGE_COUNT] = {
+	"demux",
+	"audio_decode",
+	"resample",
+	"video_decode",
+	"swscale",
+	"colour_conversion",
+	"dct",
+	"rate_control",
+	"huffman",
+	"adpcm",
+	"edc",
+	"write",
+};
+
+static uint64_t clock_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void atomic_max(uint64_t *value, uint64_t candidate) {
+	uint64_t old;
+	while ((old = *value) < candidate && !__sync_bool_compare_and_swap(value, old, candidate)) {
+		// retry
+	}
+}
+
+profile_t *profile_create(void) {
+	profile_t *profile = calloc(1, sizeof(profile_t));
+	profile->start_wall_ns = clock_ns(CLOCK_MONOTONIC);
+	profile->start_cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	return profile;
+}
+
+void profile_begin(settings_t *settings, profile_mark_t *mark) {
+	if (settings->profile == NULL) return;
+	mark->wall_ns = clock_ns(CLOCK_MONOTONIC);
+	mark->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void profile_end(settings_t *settings, int stage, profile_mark_t *mark) {
+	if (settings->profile == NULL) return;
+	profile_stage_t *s = &(settings->profile->stages[stage]);
+	__sync_fetch_and_add(&s->wall_ns, clock_ns(CLOCK_MONOTONIC) - mark->wall_ns);
+	__sync_fetch_and_add(&s->cpu_ns, clock_ns(CLOCK_THREAD_CPUTIME_ID) - mark->cpu_ns);
+	__sync_fetch_and_add(&s->calls, 1);
+}
+
+void profile_add_output(settings_t *settings, size_t bytes) {
+	if (settings->profile == NULL) return;
+	__sync_fetch_and_add(&(settings->profile->output_bytes), bytes);
+}
+
+// Records the high-water marks of the buffers hanging off settings
+void profile_note_buffers(settings_t *settings) {
+	if (settings->profile == NULL) return;
+	atomic_max(&(settings->profile->peak_audio_bytes), (uint64_t)settings->audio_sample_count*sizeof(int16_t));
+	atomic_max(&(settings->profile->peak_video_bytes),
+		(uint64_t)settings->video_frame_count*settings->decoder_state_av.video_frame_dst_size);
+	atomic_max(&(settings->profile->peak_unmuxed_bytes), settings->state_vid.bytes_used);
+}
+
+static void add_channel_stats(psx_audio_encoder_channel_stats_t *total, const psx_audio_encoder_channel_stats_t *stats) {
+	__sync_fetch_and_add(&total->units, stats->units);
+	for (int i = 0; i < PSX_AUDIO_ADPCM_FILTER_COUNT; i++) {
+		__sync_fetch_and_add(&total->filters[i], stats->filters[i]);
+	}
+	for (int i = 0; i < PSX_AUDIO_ADPCM_SHIFT_COUNT; i++) {
+		__sync_fetch_and_add(&total->shifts[i], stats->shifts[i]);
+	}
+	__sync_fetch_and_add(&total->candidates_evaluated, stats->candidates_evaluated);
+	__sync_fetch_and_add(&total->candidates_pruned, stats->candidates_pruned);
+	__sync_fetch_and_add(&total->clipped_nibbles, stats->clipped_nibbles);
+	__sync_fetch_and_add(&total->clipped_samples, stats->clipped_samples);
+	__sync_fetch_and_add(&total->samples, stats->samples);
+	__sync_fetch_and_add(&total->signal_energy, stats->signal_energy);
+	__sync_fetch_and_add(&total->error_energy, stats->error_energy);
+}
+
+// Adds the ADPCM search statistics of one encoder; stats may be NULL
+void profile_add_adpcm_stats(settings_t *settings, const psx_audio_encoder_stats_t *stats) {
+	if (settings->profile == NULL || stats == NULL) return;
+	add_channel_stats(&(settings->profile->adpcm.left), &(stats->left));
+	add_channel_stats(&(settings->profile->adpcm.right), &(stats->right));
+}
+
+static void write_histogram(FILE *fp, const uint64_t *counts, int count) {
+	fprintf(fp, "[");
+	for (int i = 0; i < count; i++) {
+		fprintf(fp, "%s%" PRIu64, i ? ", " : "", counts[i]);
+	}
+	fprintf(fp, "]");
+}
+
+// SNR is null rather than infinite for a lossless or silent channel
+static void write_channel_stats(FILE *fp, const char *name, const psx_audio_encoder_channel_stats_t *stats, bool last) {
+	fprintf(fp, "\t\t\"%s\": {\"units\": %" PRIu64 ", \"filters\": ", name, stats->units);
+	write_histogram(fp, stats->filters, PSX_AUDIO_ADPCM_FILTER_COUNT);
+	fprintf(fp, ", \"shifts\": ");
+	write_histogram(fp, stats->shifts, PSX_AUDIO_ADPCM_SHIFT_COUNT);
+	fprintf(fp, ", \"candidates_evaluated\": %" PRIu64 ", \"candidates_pruned\": %" PRIu64,
+		stats->candidates_evaluated, stats->candidates_pruned);
+	fprintf(fp, ", \"clipped_nibbles\": %" PRIu64 ", \"clipped_samples\": %" PRIu64,
+		stats->clipped_nibbles, stats->clipped_samples);
+	fprintf(fp, ", \"mse\": %.3f, \"snr_db\": ",
+		stats->samples ? (double)stats->error_energy/stats->samples : 0.0);
+	if (stats->error_energy > 0 && stats->signal_energy > 0) {
+		fprintf(fp, "%.3f", 10.0*log10((double)stats->signal_energy/stats->error_energy));
+	} else {
+		fprintf(fp, "null");
+	}
+	fprintf(fp, "}%s\n", last ? "" : ",");
+}
+
+static const char *format_name(int format) {
+	switch (format) {
+		case FORMAT_XA: return "xa";
+		case FORMAT_XACD: return "xacd";
+		case FORMAT_SPU: return "spu";
+		case FORMAT_STR2: return "str2";
+		default: return "unknown";
+	}
+}
+
+// Writes the profile as JSON to filename ("-" for stdout) and frees it
+bool profile_finish(profile_t *profile, settings_t *settings, const char *filename) {
+	uint64_t wall_ns = clock_ns(CLOCK_MONOTONIC) - profile->start_wall_ns;
+	uint64_t cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - profile->start_cpu_ns;
+	int sector_size = get_sector_size(settings);
+
+	FILE *fp = is_stdio_path(filename) ? stdout : fopen(filename, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Could not open profile output %s!\n", filename);
+		free(profile);
+		return false;
+	}
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"version\": %d,\n", PROFILE_VERSION);
+	fprintf(fp, "\t\"format\": \"%s\",\n", format_name(settings->format));
+	fprintf(fp, "\t\"wall_seconds\": %.6f,\n", wall_ns*1e-9);
+	fprintf(fp, "\t\"cpu_seconds\": %.6f,\n", cpu_ns*1e-9);
+	fprintf(fp, "\t\"stages\": {\n");
+	for (int i = 0; i < PROFILE_STAGE_COUNT; i++) {
+		profile_stage_t *s = &(profile->stages[i]);
+		fprintf(fp, "\t\t\"%s\": {\"calls\": %" PRIu64 ", \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f}%s\n",
+			stage_names[i], s->calls, s->wall_ns*1e-9, s->cpu_ns*1e-9,
+			i + 1 < PROFILE_STAGE_COUNT ? "," : "");
+	}
+	fprintf(fp, "\t},\n");
+	fprintf(fp, "\t\"output\": {\"bytes\": %" PRIu64 ", \"sectors\": %" PRIu64 ", \"sector_size\": %d},\n",
+		profile->output_bytes, profile->output_bytes/sector_size, sector_size);
+	fprintf(fp, "\t\"peak_buffers\": {\"audio_samples\": %" PRIu64 ", \"video_frames\": %" PRIu64 ", \"unmuxed\": %" PRIu64 "},\n",
+		profile->peak_audio_bytes, profile->peak_video_bytes, profile->peak_unmuxed_bytes);
+	fprintf(fp, "\t\"adpcm\": {\n");
+	write_channel_stats(fp, "left", &(profile->adpcm.left), false);
+	write_channel_stats(fp, "right", &(profile->adpcm.right), true);
+	fprintf(fp, "\t}\n");
+	fprintf(fp, "}\n");
+
+	bool ok = !ferror(fp);
+	if (fp != stdout) {
+		if (fclose(fp) != 0) ok = false;
+	} else {
+		fflush(fp);
+	}
+	free(profile);
+	return ok;
+}
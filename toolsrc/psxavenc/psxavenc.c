@@ -22,24 +22,84 @@ freely, subject to the following restrictions:
 */
 
 #include "common.h"
+#include <pthread.h>
+#include <unistd.h>
 
-void print_help(void) {
-	fprintf(stderr, "Usage: psxavenc [-f freq] [-b bitdepth] [-c channels] [-F num] [-C num] [-t xa|xacd|spu|str2] <in> <out>\n\n");
-	fprintf(stderr, "    -f freq          Use specified frequency\n");
-	fprintf(stderr, "    -t format        Use specified output type:\n");
-	fprintf(stderr, "                       xa     [A.] .xa 2336-byte sectors\n");
-	fprintf(stderr, "                       xacd   [A.] .xa 2352-byte sectors\n");
-	fprintf(stderr, "                       spu    [A.] raw SPU-ADPCM data\n");
-	fprintf(stderr, "                       str2   [AV] v2 .str video 2352-byte sectors\n");
-	fprintf(stderr, "    -b bitdepth      Use specified bit depth (only 4 bits supported)\n");
-	fprintf(stderr, "    -c channels      Use specified channel count (1 or 2)\n");
-	fprintf(stderr, "    -F num           [.xa] Set the file number to num (0-255)\n");
-	fprintf(stderr, "    -C num           [.xa] Set the channel number to num (0-31)\n");
+void print_help(FILE *fp) {
+	fprintf(fp, "Usage: psxavenc [-f freq] [-b bitdepth] [-c channels] [-F num] [-C num] [-t xa|xacd|spu|str2] <in> <out>\n");
+	fprintf(fp, "       psxavenc -t xa|xacd [-C num,num,...] [-j threads] [...] <in> <in> ... <out>\n");
+	fprintf(fp, "       psxavenc -B jobs.txt [-j workers] [--cache-dir dir]\n");
+	fprintf(fp, "       psxavenc --serve socket [-j workers] [--cache-dir dir]\n");
+	fprintf(fp, "       psxavenc --client socket [...] <in> <out>\n");
+	fprintf(fp, "       psxavenc -t str2 --start sec --end sec [...] <in> <out>\n");
+	fprintf(fp, "       psxavenc --concat [--lba n] [--frame-index n] <in.str> <in.str> ... <out.str>\n");
+	fprintf(fp, "       psxavenc --replace-audio <in.str> <audio> <out.str>\n\n");
+	fprintf(fp, "    -f freq          Use specified frequency\n");
+	fprintf(fp, "    <in>, <out>      \"-\" reads stdin or writes stdout (not with the cache, -B or --serve)\n");
+	fprintf(fp, "    -t format        Use specified output type:\n");
+	fprintf(fp, "                       xa     [A.] .xa 2336-byte sectors\n");
+	fprintf(fp, "                       xacd   [A.] .xa 2352-byte sectors\n");
+	fprintf(fp, "                       spu    [A.] raw SPU-ADPCM data\n");
+	fprintf(fp, "                       str2   [AV] v2 .str video 2352-byte sectors\n");
+	fprintf(fp, "    -b bitdepth      Use specified bit depth (only 4 bits supported)\n");
+	fprintf(fp, "    -c channels      Use specified channel count (1 or 2)\n");
+	fprintf(fp, "    -F num           [.xa] Set the file number to num (0-255)\n");
+	fprintf(fp, "    -C num           [.xa] Set the channel number to num (0-31)\n");
+	fprintf(fp, "                     With several inputs, give one per input, or the first\n");
+	fprintf(fp, "                     of a consecutive run; all inputs are interleaved into one file\n");
+	fprintf(fp, "    -j threads       [.xa] Encode this many inputs at once (default: all CPUs)\n");
+	fprintf(fp, "    -B jobs.txt      Run every command line in jobs.txt (\"-\" for stdin), -j at a time\n");
+	fprintf(fp, "    --cache-dir dir  Reuse outputs of earlier runs with identical inputs and settings\n");
+	fprintf(fp, "    --cache-size n   Keep the cache under n bytes (K/M/G suffixes; default 1G)\n");
+	fprintf(fp, "    --serve socket   Run as a server taking jobs on a Unix socket, -j at a time\n");
+	fprintf(fp, "    --client socket  Hand this encode to a server (must be the first option)\n");
+	fprintf(fp, "    --start sec      [.str] Encode from this time, snapped to the nearest point pieces can be joined at\n");
+	fprintf(fp, "    --end sec        [.str] Stop at this time, snapped the same way\n");
+	fprintf(fp, "    --frame-index n  [.str] Number the first frame n (default: follows --start)\n");
+	fprintf(fp, "    --lba n          [.str] Give the first sector timecode n (default: follows --start)\n");
+	fprintf(fp, "    --preroll n      [.str] Feed n audio sectors before --start to the encoder (default: 1)\n");
+	fprintf(fp, "    --stats          [.str] Decode every frame again and report PSNR, SSIM and rate use (bypasses the cache)\n");
+	fprintf(fp, "    --profile file   Write per-stage timings, output size, peak buffers and ADPCM search stats as JSON (\"-\" for stdout)\n");
+	fprintf(fp, "    --concat         Join .str pieces, renumbering frames and sector timecodes\n");
+	fprintf(fp, "    --replace-audio  Re-encode only the audio of a .str, in its existing format\n");
 }
 
-int parse_args(settings_t* settings, int argc, char** argv) {
+enum {
+	OPT_CACHE_DIR = 0x100,
+	OPT_CACHE_SIZE,
+	OPT_SERVE,
+	OPT_START,
+	OPT_END,
+	OPT_FRAME_INDEX,
+	OPT_LBA,
+	OPT_PREROLL,
+	OPT_CONCAT,
+	OPT_REPLACE_AUDIO,
+	OPT_STATS,
+	OPT_PROFILE,
+};
+
+static const struct option long_options[] = {
+	{"cache-dir", required_argument, NULL, OPT_CACHE_DIR},
+	{"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+	{"serve", required_argument, NULL, OPT_SERVE},
+	{"start", required_argument, NULL, OPT_START},
+	{"end", required_argument, NULL, OPT_END},
+	{"frame-index", required_argument, NULL, OPT_FRAME_INDEX},
+	{"lba", required_argument, NULL, OPT_LBA},
+	{"preroll", required_argument, NULL, OPT_PREROLL},
+	{"concat", no_argument, NULL, OPT_CONCAT},
+	{"replace-audio", no_argument, NULL, OPT_REPLACE_AUDIO},
+	{"stats", no_argument, NULL, OPT_STATS},
+	{"profile", required_argument, NULL, OPT_PROFILE},
+	{NULL, 0, NULL, 0}
+};
+
+int parse_args(settings_t* settings, int argc, char** argv, FILE *err) {
 	int c;
-	while ((c = getopt(argc, argv, "t:f:b:c:F:C:")) != -1) {
+	// Errors go to err, so the server can hand them back to its client
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "t:f:b:c:F:C:j:B:", long_options, NULL)) != -1) {
 		switch (c) {
 			case 't': {
 				if (strcmp(optarg, "xa") == 0) {
@@ -51,7 +111,7 @@ int parse_args(settings_t* settings, int argc, char** argv) {
 				} else if (strcmp(optarg, "str2") == 0) {
 					settings->format = FORMAT_STR2;
 				} else {
-					fprintf(stderr, "Invalid format: %s\n", optarg);
+					fprintf(err, "Invalid format: %s\n", optarg);
 					return -1;
 				}
 			} break;
@@ -61,14 +121,14 @@ int parse_args(settings_t* settings, int argc, char** argv) {
 			case 'b': {
 				settings->bits_per_sample = atoi(optarg);
 				if (settings->bits_per_sample != 4) {
-					fprintf(stderr, "Invalid bit depth: %d\n", settings->frequency);
+					fprintf(err, "Invalid bit depth: %d\n", settings->frequency);
 					return -1;
 				}
 			} break;
 			case 'c': {
 				int ch = atoi(optarg);
 				if (ch <= 0 || ch > 2) {
-					fprintf(stderr, "Invalid channel count: %d\n", ch);
+					fprintf(err, "Invalid channel count: %d\n", ch);
 					return -1;
 				}
 				settings->stereo = (ch == 2 ? 1 : 0);
@@ -76,20 +136,106 @@ int parse_args(settings_t* settings, int argc, char** argv) {
 			case 'F': {
 				settings->file_number = atoi(optarg);
 				if (settings->file_number < 0 || settings->file_number > 255) {
-					fprintf(stderr, "Invalid file number: %d\n", settings->file_number);
+					fprintf(err, "Invalid file number: %d\n", settings->file_number);
 					return -1;
 				}
 			} break;
 			case 'C': {
-				settings->channel_number = atoi(optarg);
-				if (settings->channel_number < 0 || settings->channel_number > 31) {
-					fprintf(stderr, "Invalid channel number: %d\n", settings->channel_number);
+				char *p = optarg;
+				settings->channel_number_count = 0;
+				do {
+					char *end;
+					long ch = strtol(p, &end, 10);
+					if (end == p || (*end != ',' && *end != '\0') || ch < 0 || ch > 31
+						|| settings->channel_number_count >= MAX_XA_INPUTS) {
+						fprintf(err, "Invalid channel number list: %s\n", optarg);
+						return -1;
+					}
+					settings->channel_numbers[settings->channel_number_count++] = ch;
+					p = end;
+				} while (*(p++) == ',');
+				settings->channel_number = settings->channel_numbers[0];
+			} break;
+			case 'j': {
+				settings->thread_count = atoi(optarg);
+				if (settings->thread_count <= 0) {
+					fprintf(err, "Invalid thread count: %d\n", settings->thread_count);
 					return -1;
 				}
 			} break;
-			case '?':
+			case 'B': {
+				settings->batch_file = optarg;
+			} break;
+			case OPT_CACHE_DIR: {
+				settings->cache_dir = optarg;
+			} break;
+			case OPT_CACHE_SIZE: {
+				if (!parse_size(optarg, &(settings->cache_size))) {
+					fprintf(err, "Invalid cache size: %s\n", optarg);
+					return -1;
+				}
+			} break;
+			case OPT_SERVE: {
+				settings->serve_socket = optarg;
+			} break;
+			case OPT_START: {
+				settings->start_time = atof(optarg);
+				if (settings->start_time < 0.0) {
+					fprintf(err, "Invalid start time: %s\n", optarg);
+					return -1;
+				}
+			} break;
+			case OPT_END: {
+				settings->end_time = atof(optarg);
+				if (settings->end_time <= 0.0) {
+					fprintf(err, "Invalid end time: %s\n", optarg);
+					return -1;
+				}
+			} break;
+			case OPT_FRAME_INDEX: {
+				settings->start_frame_index = atoi(optarg);
+				if (settings->start_frame_index < 0) {
+					fprintf(err, "Invalid frame index: %d\n", settings->start_frame_index);
+					return -1;
+				}
+			} break;
+			case OPT_LBA: {
+				settings->start_lba = atoi(optarg);
+				if (settings->start_lba < 0 || settings->start_lba >= 100*60*75) {
+					fprintf(err, "Invalid LBA: %d\n", settings->start_lba);
+					return -1;
+				}
+			} break;
+			case OPT_PREROLL: {
+				settings->audio_preroll = atoi(optarg);
+				if (settings->audio_preroll < 0) {
+					fprintf(err, "Invalid pre-roll: %d\n", settings->audio_preroll);
+					return -1;
+				}
+			} break;
+			case OPT_CONCAT: {
+				settings->concat = true;
+			} break;
+			case OPT_REPLACE_AUDIO: {
+				settings->replace_audio = true;
+			} break;
+			case OPT_STATS: {
+				settings->print_stats = true;
+			} break;
+			case OPT_PROFILE: {
+				settings->profile_path = optarg;
+			} break;
+			case '?': {
+				if (optopt > 0 && optopt < 0x80) {
+					fprintf(err, "Invalid option or missing argument: -%c\n", optopt);
+				} else {
+					fprintf(err, "Invalid option or missing argument: %s\n", argv[optind - 1]);
+				}
+				print_help(err);
+				return -1;
+			} break;
 			case 'h': {
-				print_help();
+				print_help(err);
 				return -1;
 			} break;
 		}
@@ -97,7 +243,7 @@ int parse_args(settings_t* settings, int argc, char** argv) {
 
 	if (settings->format == FORMAT_XA || settings->format == FORMAT_XACD) {
 		if (settings->frequency != PSX_AUDIO_XA_FREQ_SINGLE && settings->frequency != PSX_AUDIO_XA_FREQ_DOUBLE) {
-			fprintf(stderr, "Invalid frequency: %d Hz\n", settings->frequency);
+			fprintf(err, "Invalid frequency: %d Hz\n", settings->frequency);
 			return -1;
 		}
 	}
@@ -106,82 +252,329 @@ int parse_args(settings_t* settings, int argc, char** argv) {
 		settings->stereo = false;
 	}
 
+	if ((settings->concat || settings->replace_audio) && settings->print_stats) {
+		fprintf(err, "--stats only applies to encoding video, not --concat or --replace-audio\n");
+		return -1;
+	}
+	if (settings->concat || settings->replace_audio) {
+		settings->format = FORMAT_STR2;
+	} else if (settings->format != FORMAT_STR2 && (settings->start_time > 0.0 || settings->end_time > 0.0
+		|| settings->start_frame_index >= 0 || settings->start_lba >= 0 || settings->print_stats)) {
+		fprintf(err, "--start, --end, --frame-index, --lba and --stats only apply to str2\n");
+		return -1;
+	}
+	if (settings->end_time > 0.0 && settings->end_time <= settings->start_time) {
+		fprintf(err, "End time must come after the start time\n");
+		return -1;
+	}
+
 	return optind;
 }
 
-int main(int argc, char **argv) {
+//
+// Multi-input XA: every input is decoded and encoded on its own channel
+// by a pool of threads, then the results are interleaved into one file.
+//
+
+typedef struct {
+	const char *filename;
 	settings_t settings;
-	int arg_offset;
-	FILE* output;
+	uint8_t *data;
+	int length;
+	bool ok;
+} xa_job_t;
+
+typedef struct {
+	xa_job_t *jobs;
+	int count;
+	int next;
+	pthread_mutex_t lock;
+} xa_job_pool_t;
 
-	memset(&settings,0,sizeof(settings_t));
+static void run_job(xa_job_t *job) {
+	settings_t *settings = &(job->settings);
+	int av_sample_mul = settings->stereo ? 2 : 1;
 
-	settings.file_number = 0;
-	settings.channel_number = 0;
-	settings.stereo = true;
-	settings.frequency = PSX_AUDIO_XA_FREQ_DOUBLE;
-	settings.bits_per_sample = 4;
+	job->ok = open_av_data(job->filename, settings);
+	if (!job->ok) {
+		fprintf(stderr, "Could not open input file %s!\n", job->filename);
+		return;
+	}
 
-	settings.video_width = 320;
-	settings.video_height = 240;
+	pull_all_av_data(settings);
+	job->length = encode_buffer_xa(settings->audio_samples, settings->audio_sample_count / av_sample_mul, settings, &(job->data));
+	close_av_data(settings);
+	fprintf(stderr, "Encoded %s as channel %d\n", job->filename, settings->channel_number);
+}
 
-	settings.audio_samples = NULL;
-	settings.audio_sample_count = 0;
-	settings.video_frames = NULL;
-	settings.video_frame_count = 0;
+static void *xa_job_worker(void *arg) {
+	xa_job_pool_t *pool = arg;
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		int i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
 
-	// TODO: make this adjustable
-	// also for some reason ffmpeg seems to hard-code the framerate to 15fps
-	settings.video_fps_num = 15;
-	settings.video_fps_den = 1;
-	for(int i = 0; i < 6; i++) {
-		settings.state_vid.dct_block_lists[i] = NULL;
+		if (i >= pool->count) return NULL;
+		run_job(&pool->jobs[i]);
 	}
+}
 
-	arg_offset = parse_args(&settings, argc, argv);
-	if (arg_offset < 0) {
+static int encode_multi_xa(settings_t *settings, char **inputs, int input_count, FILE *output) {
+	int stride = get_xa_stride(settings);
+	if (input_count > stride) {
+		fprintf(stderr, "At most %d channels fit at %d Hz %s\n", stride,
+			settings->frequency, settings->stereo ? "stereo" : "mono");
 		return 1;
-	} else if (argc < arg_offset + 2) {
-		print_help();
+	}
+	if (settings->channel_number_count > 1 && settings->channel_number_count != input_count) {
+		fprintf(stderr, "Got %d channel numbers for %d inputs\n", settings->channel_number_count, input_count);
 		return 1;
 	}
+	for (int i = 1; i < settings->channel_number_count; i++) {
+		for (int j = 0; j < i; j++) {
+			if (settings->channel_numbers[i] == settings->channel_numbers[j]) {
+				fprintf(stderr, "Channel %d is given to more than one input\n", settings->channel_numbers[i]);
+				return 1;
+			}
+		}
+	}
 
-	fprintf(stderr, "Using settings: %d Hz @ %d bit depth, %s. F%d C%d\n",
-		settings.frequency, settings.bits_per_sample,
-		settings.stereo ? "stereo" : "mono",
-		settings.file_number, settings.channel_number
-	);
+	xa_job_pool_t pool;
+	pool.count = input_count;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	xa_job_t *xa_jobs = pool.jobs = calloc(input_count, sizeof(xa_job_t));
+	for (int i = 0; i < input_count; i++) {
+		xa_jobs[i].filename = inputs[i];
+		xa_jobs[i].settings = *settings;
+		xa_jobs[i].settings.channel_number = (settings->channel_number_count > 1)
+			? settings->channel_numbers[i]
+			: ((settings->channel_number + i) & 0x1F);
+	}
+
+	int thread_count = settings->thread_count;
+	if (thread_count <= 0) thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (thread_count <= 0) thread_count = 1;
+	if (thread_count > input_count) thread_count = input_count;
+
+	pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+	for (int i = 0; i < thread_count; i++) {
+		pthread_create(&threads[i], NULL, xa_job_worker, &pool);
+	}
+	for (int i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	int result = 0;
+	uint8_t *channels[MAX_XA_INPUTS];
+	int lengths[MAX_XA_INPUTS];
+	for (int i = 0; i < input_count; i++) {
+		if (!xa_jobs[i].ok) result = 1;
+		channels[i] = xa_jobs[i].data;
+		lengths[i] = xa_jobs[i].length;
+	}
+	if (result == 0) {
+		mux_file_xa(channels, lengths, input_count, settings, output);
+	}
 
-	bool did_open_data = open_av_data(argv[arg_offset + 0], &settings);
+	for (int i = 0; i < input_count; i++) {
+		free(xa_jobs[i].data);
+	}
+	free(xa_jobs);
+	pthread_mutex_destroy(&pool.lock);
+	return result;
+}
+
+static int encode(settings_t *settings, char **inputs, int input_count, const char *output_name) {
+	FILE* output;
+
+	if (settings->concat) {
+		output = open_output(output_name, settings);
+		if (output == NULL) {
+			fprintf(stderr, "Could not open output file!\n");
+			return 1;
+		}
+		int result = concat_file_str(inputs, input_count, settings, output);
+		close_output(output, settings);
+		return result;
+	}
+
+	if (settings->replace_audio) {
+		if (input_count != 2) {
+			fprintf(stderr, "--replace-audio takes a .str and an audio input\n");
+			return 1;
+		}
+		output = open_output(output_name, settings);
+		if (output == NULL) {
+			fprintf(stderr, "Could not open output file!\n");
+			return 1;
+		}
+		int result = replace_audio_str(inputs[0], inputs[1], settings, output);
+		close_output(output, settings);
+		return result;
+	}
+
+	if (input_count > 1) {
+		if (settings->format != FORMAT_XA && settings->format != FORMAT_XACD) {
+			fprintf(stderr, "Several inputs can only be muxed into xa or xacd\n");
+			return 1;
+		}
+		if (input_count > MAX_XA_INPUTS) {
+			fprintf(stderr, "Too many inputs (at most %d)\n", MAX_XA_INPUTS);
+			return 1;
+		}
+
+		output = open_output(output_name, settings);
+		if (output == NULL) {
+			fprintf(stderr, "Could not open output file!\n");
+			return 1;
+		}
+		int result = encode_multi_xa(settings, inputs, input_count, output);
+		close_output(output, settings);
+		return result;
+	}
+
+	bool did_open_data = open_av_data(inputs[0], settings);
 	if (!did_open_data) {
 		fprintf(stderr, "Could not open input file!\n");
 		return 1;
 	}
 
-	output = fopen(argv[arg_offset + 1], "wb");
+	output = open_output(output_name, settings);
 	if (output == NULL) {
 		fprintf(stderr, "Could not open output file!\n");
 		return 1;
 	}
 
-	int av_sample_mul = settings.stereo ? 2 : 1;
+	int av_sample_mul = settings->stereo ? 2 : 1;
+	int result = 0;
 
-	switch (settings.format) {
+	switch (settings->format) {
 		case FORMAT_XA:
 		case FORMAT_XACD:
-			pull_all_av_data(&settings);
-			encode_file_xa(settings.audio_samples, settings.audio_sample_count / av_sample_mul, &settings, output);
+			pull_all_av_data(settings);
+			encode_file_xa(settings->audio_samples, settings->audio_sample_count / av_sample_mul, settings, output);
 			break;
 		case FORMAT_SPU:
-			pull_all_av_data(&settings);
-			encode_file_spu(settings.audio_samples, settings.audio_sample_count / av_sample_mul, &settings, output);
+			pull_all_av_data(settings);
+			encode_file_spu(settings->audio_samples, settings->audio_sample_count / av_sample_mul, settings, output);
 			break;
 		case FORMAT_STR2:
-			encode_file_str(&settings, output);
+			result = encode_file_str(settings, output);
 			break;
 	}
 
-	fclose(output);
-	close_av_data(&settings);
-	return 0;
+	close_output(output, settings);
+	close_av_data(settings);
+	return result;
+}
+
+void init_settings(settings_t *settings) {
+	memset(settings,0,sizeof(settings_t));
+
+	settings->file_number = 0;
+	settings->channel_number = 0;
+	settings->stereo = true;
+	settings->frequency = PSX_AUDIO_XA_FREQ_DOUBLE;
+	settings->bits_per_sample = 4;
+	settings->cache_size = DEFAULT_CACHE_SIZE;
+	settings->start_frame_index = -1;
+	settings->start_lba = -1;
+	settings->audio_preroll = 1;
+
+	settings->video_width = 320;
+	settings->video_height = 240;
+
+	settings->audio_samples = NULL;
+	settings->audio_sample_count = 0;
+	settings->video_frames = NULL;
+	settings->video_frame_count = 0;
+
+	// TODO: make this adjustable
+	// also for some reason ffmpeg seems to hard-code the framerate to 15fps
+	settings->video_fps_num = 15;
+	settings->video_fps_den = 1;
+	for(int i = 0; i < 6; i++) {
+		settings->state_vid.dct_block_lists[i] = NULL;
+	}
+}
+
+// Encodes through the cache when one is configured.
+int run_encode(settings_t *settings, char **inputs, int input_count, const char *output_name) {
+	char key[CACHE_KEY_LENGTH];
+	bool cacheable = false;
+	int stdin_inputs = 0;
+
+	for (int i = 0; i < input_count; i++) {
+		if (is_stdio_path(inputs[i])) stdin_inputs++;
+	}
+	if (stdin_inputs > 1) {
+		fprintf(stderr, "Only one input can come from stdin\n");
+		return 1;
+	}
+	bool streaming = stdin_inputs > 0 || is_stdio_path(output_name);
+	if (settings->profile_path != NULL && is_stdio_path(settings->profile_path) && is_stdio_path(output_name)) {
+		fprintf(stderr, "The profile and the output can't both go to stdout\n");
+		return 1;
+	}
+	if (settings->profile_path != NULL) {
+		settings->profile = profile_create();
+	}
+
+	// Streams can't be hashed ahead of time or linked into the cache, and
+	// --stats needs the encode to actually run
+	if (settings->cache_dir != NULL && !streaming && !settings->print_stats) {
+		cacheable = cache_key(settings, inputs, input_count, key);
+		if (cacheable && cache_fetch(settings, key, output_name)) {
+			if (settings->profile != NULL) {
+				profile_finish(settings->profile, settings, settings->profile_path);
+				settings->profile = NULL;
+			}
+			return 0;
+		}
+	}
+
+	int result = encode(settings, inputs, input_count, output_name);
+	if (result == 0 && cacheable) {
+		cache_store(settings, key, output_name);
+	}
+	if (settings->profile != NULL) {
+		if (!profile_finish(settings->profile, settings, settings->profile_path) && result == 0) {
+			result = 1;
+		}
+		settings->profile = NULL;
+	}
+	return result;
+}
+
+int main(int argc, char **argv) {
+	settings_t settings;
+	int arg_offset;
+
+	if (argc >= 3 && strcmp(argv[1], "--client") == 0) {
+		return run_client(argv[2], argc - 3, argv + 3);
+	}
+
+	init_settings(&settings);
+
+	arg_offset = parse_args(&settings, argc, argv, stderr);
+	if (arg_offset < 0) {
+		return 1;
+	} else if (settings.serve_socket != NULL) {
+		return run_server(&settings);
+	} else if (settings.batch_file != NULL) {
+		return run_batch(&settings);
+	} else if (argc < arg_offset + 2) {
+		print_help(stderr);
+		return 1;
+	}
+
+	fprintf(stderr, "Using settings: %d Hz @ %d bit depth, %s. F%d C%d\n",
+		settings.frequency, settings.bits_per_sample,
+		settings.stereo ? "stereo" : "mono",
+		settings.file_number, settings.channel_number
+	);
+
+	return run_encode(&settings, argv + arg_offset, argc - arg_offset - 1, argv[argc - 1]);
 }
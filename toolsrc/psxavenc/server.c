@@ -0,0 +1,404 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "common.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+//
+// Batch server (--serve) and client (--client)
+//
+// The server keeps one process, one FFmpeg initialisation and one DCT table
+// around for any number of encodes. Each connection carries one job:
+//
+//   client -> server: u32 count, then count NUL-terminated strings: the
+//                     client's working directory, then the usual psxavenc
+//                     arguments (options, inputs, output)
+//   server -> client: status lines, "queued", "started", then "ok" or
+//                     "error <reason>"; the server closes after the last one
+//
+// Every connection gets a reader thread of its own, so a client that stalls
+// mid-request holds up nobody else; it is dropped after
+// SERVER_READ_TIMEOUT seconds. Only the getopt pass is serialised. Jobs
+// wait in a bounded queue and run on -j worker threads. Jobs without
+// --cache-dir use the server's.
+//
+
+#define SERVER_MAX_ARGS 256
+#define SERVER_MAX_REQUEST (64*1024)
+#define SERVER_QUEUE_PER_WORKER 4
+#define SERVER_READ_TIMEOUT 10
+
+typedef struct server_job {
+	int fd;
+	settings_t settings;
+	char request[SERVER_MAX_REQUEST];
+	char *argv[SERVER_MAX_ARGS + 1];
+	char *paths[SERVER_MAX_ARGS + 1]; // absolute copies, freed with the job
+	int path_count;
+	char **inputs;
+	int input_count;
+	const char *output;
+	struct server_job *next;
+} server_job_t;
+
+static settings_t *server_defaults;
+
+// getopt isn't reentrant
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	server_job_t *head, *tail;
+	int length, capacity;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+} queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+};
+
+static void send_status(int fd, const char *fmt, ...) {
+	char line[512];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+	if (len < 0) return;
+	if (len > (int)sizeof(line) - 2) len = sizeof(line) - 2;
+	line[len++] = '\n';
+
+	for (int pos = 0; pos < len; ) {
+		ssize_t n = send(fd, line + pos, len - pos, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return; // client went away; the job still runs
+		pos += n;
+	}
+}
+
+// Relays what parse_args printed, a status line per line
+static void send_lines(int fd, char *text) {
+	char *save;
+	for (char *line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+		send_status(fd, "%s", line);
+	}
+}
+
+static bool read_fully(int fd, void *buf, size_t len) {
+	uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static const char *resolve_path(server_job_t *job, const char *cwd, const char *path) {
+	if (path[0] == '/' || job->path_count >= SERVER_MAX_ARGS) return path;
+	size_t len = strlen(cwd) + strlen(path) + 2;
+	char *abs = malloc(len);
+	assert(abs != NULL);
+	snprintf(abs, len, "%s/%s", cwd, path);
+	job->paths[job->path_count++] = abs;
+	return abs;
+}
+
+static void free_job(server_job_t *job) {
+	for (int i = 0; i < job->path_count; i++) {
+		free(job->paths[i]);
+	}
+	for (int i = 0; i < 6; i++) {
+		free(job->settings.state_vid.dct_block_lists[i]);
+	}
+	close(job->fd);
+	free(job);
+}
+
+// Reads the count strings of a request into job->argv. The client sends
+// nothing after them, so reading in chunks never eats into anything else.
+static bool read_request(server_job_t *job, uint32_t count) {
+	size_t used = 0, start = 0;
+	uint32_t found = 0;
+
+	while (found < count) {
+		if (used >= sizeof(job->request)) return false;
+		ssize_t n = read(job->fd, job->request + used, sizeof(job->request) - used);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false; // includes the receive timeout
+		for (size_t end = used + n; used < end && found < count; used++) {
+			if (job->request[used] == '\0') {
+				job->argv[found++] = job->request + start;
+				start = used + 1;
+			}
+		}
+	}
+	job->argv[count] = NULL;
+	return true;
+}
+
+// Reads and parses one request on the connection's reader thread
+static bool read_job(server_job_t *job, settings_t *defaults) {
+	uint32_t count;
+	struct timeval timeout = {SERVER_READ_TIMEOUT, 0};
+
+	setsockopt(job->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (!read_fully(job->fd, &count, sizeof(count)) || count < 1 || count > SERVER_MAX_ARGS
+		|| !read_request(job, count)) {
+		send_status(job->fd, "error bad request");
+		return false;
+	}
+
+	// argv[0] is the program name slot, which carries the cwd here
+	const char *cwd = job->argv[0];
+	char *errors = NULL;
+	size_t errors_len = 0;
+	FILE *err = open_memstream(&errors, &errors_len);
+	pthread_mutex_lock(&parse_lock);
+	init_settings(&job->settings);
+	job->settings.thread_count = 1;
+	optind = 0;
+	int arg_offset = parse_args(&job->settings, count, job->argv, err != NULL ? err : stderr);
+	pthread_mutex_unlock(&parse_lock);
+	if (err != NULL) {
+		fclose(err);
+		if (arg_offset < 0) {
+			send_lines(job->fd, errors);
+		}
+		free(errors);
+	}
+	if (arg_offset < 0 || job->settings.serve_socket != NULL || (int)count < arg_offset + 2) {
+		send_status(job->fd, "error invalid arguments");
+		return false;
+	}
+
+	if (job->settings.cache_dir == NULL) {
+		job->settings.cache_dir = defaults->cache_dir;
+		job->settings.cache_size = defaults->cache_size;
+	} else {
+		job->settings.cache_dir = resolve_path(job, cwd, job->settings.cache_dir);
+	}
+	job->inputs = job->argv + arg_offset;
+	job->input_count = count - arg_offset - 1;
+	for (int i = 0; i <= job->input_count; i++) {
+		if (is_stdio_path(job->inputs[i])) {
+			send_status(job->fd, "error stdin/stdout can't be used through the server");
+			return false;
+		}
+	}
+	for (int i = 0; i < job->input_count; i++) {
+		job->inputs[i] = (char *)resolve_path(job, cwd, job->inputs[i]);
+	}
+	job->output = resolve_path(job, cwd, job->argv[count - 1]);
+	if (job->settings.profile_path != NULL) {
+		if (is_stdio_path(job->settings.profile_path)) {
+			send_status(job->fd, "error stdin/stdout can't be used through the server");
+			return false;
+		}
+		job->settings.profile_path = resolve_path(job, cwd, job->settings.profile_path);
+	}
+	return true;
+}
+
+static void *server_reader(void *arg) {
+	server_job_t *job = arg;
+	if (!read_job(job, server_defaults)) {
+		free_job(job);
+		return NULL;
+	}
+
+	// Hold the client here while the queue is full
+	pthread_mutex_lock(&queue.lock);
+	while (queue.length >= queue.capacity) {
+		pthread_cond_wait(&queue.not_full, &queue.lock);
+	}
+	if (queue.tail != NULL) {
+		queue.tail->next = job;
+	} else {
+		queue.head = job;
+	}
+	queue.tail = job;
+	queue.length++;
+	send_status(job->fd, "queued %d", queue.length);
+	pthread_cond_signal(&queue.not_empty);
+	pthread_mutex_unlock(&queue.lock);
+	return NULL;
+}
+
+static void *server_worker(void *arg) {
+	(void)arg;
+	while (1) {
+		pthread_mutex_lock(&queue.lock);
+		while (queue.head == NULL) {
+			pthread_cond_wait(&queue.not_empty, &queue.lock);
+		}
+		server_job_t *job = queue.head;
+		queue.head = job->next;
+		if (queue.head == NULL) queue.tail = NULL;
+		queue.length--;
+		pthread_cond_signal(&queue.not_full);
+		pthread_mutex_unlock(&queue.lock);
+
+		send_status(job->fd, "started");
+		fprintf(stderr, "Encoding %s\n", job->output);
+		int result = run_encode(&job->settings, job->inputs, job->input_count, job->output);
+		if (result == 0) {
+			send_status(job->fd, "ok");
+		} else {
+			send_status(job->fd, "error encode failed");
+		}
+		free_job(job);
+	}
+	return NULL;
+}
+
+int run_server(settings_t *settings) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(settings->serve_socket) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", settings->serve_socket);
+		return 1;
+	}
+	strcpy(addr.sun_path, settings->serve_socket);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	// Replace a stale socket, but not one a live server is listening on
+	if (connect(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "A server is already listening on %s\n", settings->serve_socket);
+		close(listen_fd);
+		return 1;
+	}
+	close(listen_fd);
+	unlink(settings->serve_socket);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0
+		|| bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+		|| listen(listen_fd, 64) != 0) {
+		perror(settings->serve_socket);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	prepare_dct_data();
+	server_defaults = settings;
+
+	int worker_count = settings->thread_count;
+	if (worker_count <= 0) worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (worker_count <= 0) worker_count = 1;
+	queue.capacity = worker_count * SERVER_QUEUE_PER_WORKER;
+
+	for (int i = 0; i < worker_count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, server_worker, NULL) != 0) {
+			fprintf(stderr, "Could not start worker threads\n");
+			return 1;
+		}
+		pthread_detach(thread);
+	}
+	fprintf(stderr, "Listening on %s with %d workers\n", settings->serve_socket, worker_count);
+
+	while (1) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			perror("accept");
+			break;
+		}
+
+		server_job_t *job = calloc(1, sizeof(server_job_t));
+		assert(job != NULL);
+		job->fd = fd;
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, server_reader, job) != 0) {
+			send_status(fd, "error server busy");
+			free_job(job);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	close(listen_fd);
+	unlink(settings->serve_socket);
+	return 1;
+}
+
+int run_client(const char *socket_path, int argc, char **argv) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", socket_path);
+		return 1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		perror(socket_path);
+		return 1;
+	}
+
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		perror("getcwd");
+		close(fd);
+		return 1;
+	}
+
+	FILE *conn = fdopen(fd, "r+");
+	assert(conn != NULL);
+	uint32_t count = argc + 1;
+	fwrite(&count, sizeof(count), 1, conn);
+	fwrite(cwd, strlen(cwd) + 1, 1, conn);
+	for (int i = 0; i < argc; i++) {
+		fwrite(argv[i], strlen(argv[i]) + 1, 1, conn);
+	}
+	fflush(conn);
+
+	char line[512];
+	int result = 1;
+	while (fgets(line, sizeof(line), conn) != NULL) {
+		fprintf(stderr, "%s", line);
+		if (strcmp(line, "ok\n") == 0) {
+			result = 0;
+		}
+	}
+	fclose(conn);
+	return result;
+}
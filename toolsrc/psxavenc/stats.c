@@ -0,0 +1,395 @@
+/*
+psxavenc: MDEC video + SPU/XA-ADPCM audio encoder frontend
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+
+#include "common.h"
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+
+//
+// Encoder statistics (--stats)
+//
+// Every video sector written is demuxed again, and each frame that comes
+// out whole is handed to a worker thread, which runs it through the
+// reference MDEC decoder and compares it with the source frame it was
+// encoded from, so that the encoder isn't held up. Source frames are kept
+// from the time they are encoded until they have been compared,
+// rearranged into macroblocks in the order they are decoded in.
+//
+
+#define STATS_PENDING_FRAMES 4
+
+typedef struct {
+	int frame_index; // -1 if free
+	bool queued; // Waiting for or being compared by the worker
+	uint8_t *source; // 16x16 planes of R, G, B and Y per macroblock
+	uint8_t *demuxed; // Taken over from the demuxer when queued
+	int demuxed_size;
+	int demuxed_length;
+	int bytes_used;
+	int bytes_budget;
+	int coeffs_shed;
+} stats_frame_t;
+
+struct str_stats {
+	stats_frame_t pending[STATS_PENDING_FRAMES];
+	int width;
+	int height;
+
+	// Worker, taking queued frames in order. lock guards the queue, the
+	// queued flags and frame_index of queued frames, and lost_frames.
+	bool has_worker;
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, released;
+	stats_frame_t *queue[STATS_PENDING_FRAMES];
+	int queue_head;
+	int queue_length;
+	bool finishing;
+
+	// Demuxer
+	uint8_t *demuxed;
+	int demuxed_size;
+	int demux_frame_index;
+	int demux_chunk_count;
+	int demux_chunks_seen;
+	int demux_bytes_used;
+
+	// Frame being compared, only touched by the worker
+	const uint8_t *compare_source;
+	uint64_t compare_rgb_error;
+	uint64_t compare_y_error;
+	double compare_ssim_sum;
+	int compare_windows;
+
+	// Totals
+	int frames;
+	int lost_frames;
+	double psnr_sum;
+	double psnr_y_sum;
+	double psnr_y_min;
+	double ssim_sum;
+	uint64_t bytes_used_sum;
+	uint64_t bytes_budget_sum;
+	uint64_t coeffs_shed_sum;
+};
+
+static void *stats_worker(void *arg);
+
+str_stats_t *stats_create(settings_t *settings) {
+	str_stats_t *stats = calloc(1, sizeof(str_stats_t));
+	stats->width = settings->video_width;
+	stats->height = settings->video_height;
+	for (int i = 0; i < STATS_PENDING_FRAMES; i++) {
+		stats->pending[i].frame_index = -1;
+		stats->pending[i].source = malloc(stats->width*stats->height*4);
+	}
+	stats->demux_frame_index = -1;
+	stats->psnr_y_min = INFINITY;
+
+	pthread_mutex_init(&stats->lock, NULL);
+	pthread_cond_init(&stats->not_empty, NULL);
+	pthread_cond_init(&stats->released, NULL);
+	// Without a worker, frames are compared on the encoder's thread
+	stats->has_worker = pthread_create(&stats->worker, NULL, stats_worker, stats) == 0;
+	return stats;
+}
+
+// The per-pixel steps below are each a loop of their own over a whole
+// macroblock, so that the compiler turns them into SIMD arithmetic
+static inline int sum_squared_error(const uint8_t *a, const uint8_t *b, int count) {
+	int sum = 0;
+	for (int i = 0; i < count; i++) {
+		sum += (a[i]-b[i])*(a[i]-b[i]);
+	}
+	return sum;
+}
+
+// BT.601 weights in 8.8 fixed point
+static inline void luma_of(const uint8_t *r, const uint8_t *g, const uint8_t *b, uint8_t *luma, int count) {
+	for (int i = 0; i < count; i++) {
+		luma[i] = (77*r[i] + 150*g[i] + 29*b[i] + 128)>>8;
+	}
+}
+
+// Called once a frame has been encoded, before its source is retired.
+// Waits if the worker still has the frame from STATS_PENDING_FRAMES ago.
+// Pixels are read a word at a time (so on a little-endian host, like the
+// rest of the tool) and a macroblock row at a time.
+void stats_add_frame(str_stats_t *stats, settings_t *settings, uint8_t *video_frame) {
+	stats_frame_t *frame = &(stats->pending[settings->state_vid.frame_index % STATS_PENDING_FRAMES]);
+
+	pthread_mutex_lock(&stats->lock);
+	while (frame->queued) {
+		pthread_cond_wait(&stats->released, &stats->lock);
+	}
+	if (frame->frame_index >= 0) {
+		stats->lost_frames++;
+	}
+	frame->frame_index = settings->state_vid.frame_index;
+	pthread_mutex_unlock(&stats->lock);
+
+	const uint32_t *pixel = (const uint32_t *)video_frame;
+	for (int y = 0; y < stats->height; y++) {
+		for (int x = 0; x < stats->width; x += 16, pixel += 16) {
+			uint8_t r[16], g[16], b[16], l[16];
+			uint8_t *mb = frame->source + 4*16*16*((x>>4)*(stats->height>>4) + (y>>4)) + 16*(y&15);
+			for (int i = 0; i < 16; i++) {
+				r[i] = pixel[i]&0xFF;
+				g[i] = (pixel[i]>>8)&0xFF;
+				b[i] = (pixel[i]>>16)&0xFF;
+			}
+			luma_of(r, g, b, l, 16);
+			memcpy(mb, r, 16);
+			memcpy(mb + 16*16, g, 16);
+			memcpy(mb + 16*16*2, b, 16);
+			memcpy(mb + 16*16*3, l, 16);
+		}
+	}
+	frame->bytes_used = settings->state_vid.bytes_used;
+	frame->bytes_budget = 2016*settings->state_vid.frame_block_count;
+	frame->coeffs_shed = settings->state_vid.coeffs_shed;
+}
+
+static double psnr(double mse) {
+	return mse > 0.0 ? 10.0*log10(255.0*255.0/mse) : 99.0;
+}
+
+// Compares a decoded macroblock with the source. SSIM is taken over the
+// four 8x8 windows, a pair at a time: sums are kept per column over whole
+// 16 pixel rows and only split between the windows at the end. The sums
+// of squares are taken in a second pass, so that neither pass has more
+// sums than fit in registers. The Y error falls out of the same sums.
+static void compare_macroblock(void *arg, int mx, int my, const uint8_t *r, const uint8_t *g, const uint8_t *b) {
+	const double c1 = (0.01*255)*(0.01*255);
+	const double c2 = (0.03*255)*(0.03*255);
+	str_stats_t *stats = arg;
+	const uint8_t *sr = stats->compare_source + 4*16*16*((mx>>4)*(stats->height>>4) + (my>>4));
+	const uint8_t *sg = sr + 16*16, *sb = sr + 16*16*2, *sy = sr + 16*16*3;
+	uint8_t dy[16*16];
+
+	luma_of(r, g, b, dy, 16*16);
+	stats->compare_rgb_error += sum_squared_error(sr, r, 16*16) + sum_squared_error(sg, g, 16*16) + sum_squared_error(sb, b, 16*16);
+
+	for (int h = 0; h < 2; h++) {
+		int16_t sum_a[16], sum_b[16];
+		int32_t sum_aa[16], sum_bb[16], sum_ab[16];
+		for (int x = 0; x < 16; x++) {
+			sum_a[x] = sum_b[x] = 0;
+			sum_aa[x] = sum_bb[x] = sum_ab[x] = 0;
+		}
+		for (int y = 0; y < 8; y++) {
+			const uint8_t *ya = sy + 16*(8*h+y), *yb = dy + 16*(8*h+y);
+			for (int x = 0; x < 16; x++) {
+				sum_a[x] += ya[x];
+				sum_b[x] += yb[x];
+				sum_ab[x] += ya[x]*yb[x];
+			}
+		}
+		for (int y = 0; y < 8; y++) {
+			const uint8_t *ya = sy + 16*(8*h+y), *yb = dy + 16*(8*h+y);
+			for (int x = 0; x < 16; x++) {
+				sum_aa[x] += ya[x]*ya[x];
+				sum_bb[x] += yb[x]*yb[x];
+			}
+		}
+		for (int w = 0; w < 2; w++) {
+			int ta = 0, tb = 0, taa = 0, tbb = 0, tab = 0;
+			for (int x = 8*w; x < 8*w+8; x++) {
+				ta += sum_a[x];
+				tb += sum_b[x];
+				taa += sum_aa[x];
+				tbb += sum_bb[x];
+				tab += sum_ab[x];
+			}
+			stats->compare_y_error += taa + tbb - 2*tab;
+			double ma = ta/64.0, mb = tb/64.0;
+			double va = taa/64.0 - ma*ma, vb = tbb/64.0 - mb*mb;
+			double cov = tab/64.0 - ma*mb;
+			stats->compare_ssim_sum += ((2*ma*mb + c1)*(2*cov + c2)) / ((ma*ma + mb*mb + c1)*(va + vb + c2));
+			stats->compare_windows++;
+		}
+	}
+}
+
+// Returns false if the frame could not be decoded
+static bool compare_frame(str_stats_t *stats, stats_frame_t *frame) {
+	int pixels = stats->width*stats->height;
+
+	stats->compare_source = frame->source;
+	stats->compare_rgb_error = 0;
+	stats->compare_y_error = 0;
+	stats->compare_ssim_sum = 0.0;
+	stats->compare_windows = 0;
+	if (!decode_frame_str(frame->demuxed, frame->demuxed_length, stats->width, stats->height, compare_macroblock, stats)) {
+		fprintf(stderr, "Frame %d: could not be decoded\n", frame->frame_index);
+		return false;
+	}
+
+	double frame_psnr = psnr((double)stats->compare_rgb_error/(pixels*3));
+	double frame_psnr_y = psnr((double)stats->compare_y_error/pixels);
+	double frame_ssim = stats->compare_windows ? stats->compare_ssim_sum/stats->compare_windows : 1.0;
+
+	fprintf(stderr, "Frame %d: PSNR %.2f dB (Y %.2f dB), SSIM %.4f, %d of %d bytes, %d coefficients shed\n",
+		frame->frame_index,
+		frame_psnr, frame_psnr_y, frame_ssim, frame->bytes_used, frame->bytes_budget, frame->coeffs_shed);
+
+	stats->frames++;
+	stats->psnr_sum += frame_psnr;
+	stats->psnr_y_sum += frame_psnr_y;
+	if (frame_psnr_y < stats->psnr_y_min) stats->psnr_y_min = frame_psnr_y;
+	stats->ssim_sum += frame_ssim;
+	stats->bytes_used_sum += frame->bytes_used;
+	stats->bytes_budget_sum += frame->bytes_budget;
+	stats->coeffs_shed_sum += frame->coeffs_shed;
+	return true;
+}
+
+// Frees a frame's slot once it has been compared (the lock must be held)
+static void release_frame(str_stats_t *stats, stats_frame_t *frame, bool decoded) {
+	if (!decoded) {
+		stats->lost_frames++;
+	}
+	frame->frame_index = -1;
+	frame->queued = false;
+	pthread_cond_signal(&stats->released);
+}
+
+static void *stats_worker(void *arg) {
+	str_stats_t *stats = arg;
+	while (1) {
+		pthread_mutex_lock(&stats->lock);
+		while (stats->queue_length == 0 && !stats->finishing) {
+			pthread_cond_wait(&stats->not_empty, &stats->lock);
+		}
+		if (stats->queue_length == 0) {
+			pthread_mutex_unlock(&stats->lock);
+			return NULL;
+		}
+		stats_frame_t *frame = stats->queue[stats->queue_head];
+		stats->queue_head = (stats->queue_head + 1) % STATS_PENDING_FRAMES;
+		stats->queue_length--;
+		pthread_mutex_unlock(&stats->lock);
+
+		bool decoded = compare_frame(stats, frame);
+
+		pthread_mutex_lock(&stats->lock);
+		release_frame(stats, frame, decoded);
+		pthread_mutex_unlock(&stats->lock);
+	}
+}
+
+// Hands a frame whose sectors have all been demuxed over to the worker,
+// swapping the demuxer's buffer for the one the frame had
+static void queue_frame(str_stats_t *stats) {
+	stats_frame_t *frame = &(stats->pending[stats->demux_frame_index % STATS_PENDING_FRAMES]);
+
+	pthread_mutex_lock(&stats->lock);
+	if (frame->queued || frame->frame_index != stats->demux_frame_index) {
+		pthread_mutex_unlock(&stats->lock);
+		return;
+	}
+	uint8_t *demuxed = frame->demuxed;
+	int demuxed_size = frame->demuxed_size;
+	frame->demuxed = stats->demuxed;
+	frame->demuxed_size = stats->demuxed_size;
+	frame->demuxed_length = stats->demux_bytes_used;
+	stats->demuxed = demuxed;
+	stats->demuxed_size = demuxed_size;
+	stats->demux_frame_index = -1;
+	frame->queued = true;
+
+	if (!stats->has_worker) {
+		pthread_mutex_unlock(&stats->lock);
+		bool decoded = compare_frame(stats, frame);
+		pthread_mutex_lock(&stats->lock);
+		release_frame(stats, frame, decoded);
+	} else {
+		stats->queue[(stats->queue_head + stats->queue_length) % STATS_PENDING_FRAMES] = frame;
+		stats->queue_length++;
+		pthread_cond_signal(&stats->not_empty);
+	}
+	pthread_mutex_unlock(&stats->lock);
+}
+
+// Called for every video sector written, in order
+void stats_add_sector(str_stats_t *stats, settings_t *settings, uint8_t *sector) {
+	const uint8_t *header = sector + 0x018;
+	int chunk_index = header[0x004]|(header[0x005]<<8);
+	int chunk_count = header[0x006]|(header[0x007]<<8);
+	int frame_index = header[0x008]|(header[0x009]<<8)|(header[0x00A]<<16)|(header[0x00B]<<24);
+
+	if (frame_index != stats->demux_frame_index) {
+		stats->demux_frame_index = frame_index;
+		stats->demux_chunk_count = chunk_count;
+		stats->demux_chunks_seen = 0;
+		if (stats->demuxed_size < 2016*chunk_count) {
+			stats->demuxed_size = 2016*chunk_count;
+			stats->demuxed = realloc(stats->demuxed, stats->demuxed_size);
+		}
+	}
+	if (chunk_index >= stats->demux_chunk_count) {
+		return;
+	}
+
+	memcpy(stats->demuxed + 2016*chunk_index, sector + 0x018 + 0x020, 2016);
+	stats->demux_bytes_used = header[0x00C]|(header[0x00D]<<8)|(header[0x00E]<<16)|(header[0x00F]<<24);
+	if (++stats->demux_chunks_seen == stats->demux_chunk_count) {
+		queue_frame(stats);
+	}
+}
+
+void stats_finish(str_stats_t *stats) {
+	if (stats->has_worker) {
+		pthread_mutex_lock(&stats->lock);
+		stats->finishing = true;
+		pthread_cond_signal(&stats->not_empty);
+		pthread_mutex_unlock(&stats->lock);
+		pthread_join(stats->worker, NULL);
+	}
+	pthread_mutex_destroy(&stats->lock);
+	pthread_cond_destroy(&stats->not_empty);
+	pthread_cond_destroy(&stats->released);
+
+	int cut_off = 0;
+	for (int i = 0; i < STATS_PENDING_FRAMES; i++) {
+		if (stats->pending[i].frame_index >= 0) cut_off++;
+		free(stats->pending[i].source);
+		free(stats->pending[i].demuxed);
+	}
+
+	if (stats->frames > 0) {
+		fprintf(stderr, "Stats: %d frames, mean PSNR %.2f dB (Y %.2f dB, worst %.2f dB), mean SSIM %.4f\n",
+			stats->frames, stats->psnr_sum/stats->frames, stats->psnr_y_sum/stats->frames,
+			stats->psnr_y_min, stats->ssim_sum/stats->frames);
+		fprintf(stderr, "Stats: %.1f%% of the sector budget used, %" PRIu64 " coefficients shed\n",
+			100.0*stats->bytes_used_sum/stats->bytes_budget_sum, stats->coeffs_shed_sum);
+	}
+	if (cut_off + stats->lost_frames > 0) {
+		fprintf(stderr, "Stats: %d frames not compared (cut off at the end or undecodable)\n", cut_off + stats->lost_frames);
+	}
+
+	free(stats->demuxed);
+	free(stats);
+}
@@ -0,0 +1,42 @@
+/*
+psxbench: host benchmarks for the toolchain's encoding kernels
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+// mdec.c is built into the benchmark as is, so that its static kernels
+// are measured exactly as psxavenc compiles them.
+#include "../psxavenc/mdec.c"
+
+void bench_transform_dct_block(vid_encoder_state_t *state, int32_t *block) {
+	transform_dct_block(state, block);
+}
+
+void bench_encode_bits(vid_encoder_state_t *state, int bits, uint32_t val) {
+	encode_bits(state, bits, val);
+}
+
+void bench_flush_bits(vid_encoder_state_t *state) {
+	flush_bits(state);
+}
+
+void bench_encode_frame_str(settings_t *settings) {
+	encode_frame_str(settings->video_frames, settings->video_frame_count, NULL, settings);
+}
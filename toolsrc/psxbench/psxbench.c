@@ -0,0 +1,509 @@
+/*
+psxbench: host benchmarks for the toolchain's encoding kernels
+
+Copyright (c) 2019, 2020 Adrian "asie" Siekierka
+Copyright (c) 2019 Ben "GreaseMonkey" Russell
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "../psxavenc/common.h"
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// Every benchmark runs one kernel on deterministic synthetic input. The
+// iteration count is grown until a run takes min_time/REPEATS, then the
+// fastest of REPEATS runs is reported, which is the figure least
+// disturbed by whatever else the machine is doing.
+//
+
+#define REPEATS 5
+#define MAX_BENCHMARKS 32
+
+// mdec_kernels.c
+void bench_transform_dct_block(vid_encoder_state_t *state, int32_t *block);
+void bench_encode_bits(vid_encoder_state_t *state, int bits, uint32_t val);
+void bench_flush_bits(vid_encoder_state_t *state);
+void bench_encode_frame_str(settings_t *settings);
+
+// pscd-new.c, built with its main renamed
+void init_tables(void);
+void calc_p_parity(uint8_t *sector);
+void calc_q_parity(uint8_t *sector);
+void adjust_edc(uint8_t *addr, int len);
+
+typedef struct {
+	const char *name;
+	void (*run)(uint64_t iterations);
+	double bytes_per_op; // input processed per call
+	double sectors_per_op; // 0 if the kernel doesn't work on sectors
+} benchmark_t;
+
+typedef struct {
+	char name[64];
+	double ns_per_op;
+} baseline_t;
+
+static volatile uint32_t sink;
+
+//
+// Synthetic input
+//
+
+static uint32_t rng_state;
+
+static uint32_t rng_next(void) {
+	rng_state = rng_state*1664525 + 1013904223;
+	return rng_state >> 8;
+}
+
+// Two triangle waves plus noise, so every filter and shift gets picked
+static void make_audio(int16_t *samples, int count, int channels) {
+	rng_state = 1;
+	for (int i = 0; i < count; i++) {
+		for (int c = 0; c < channels; c++) {
+			int a = (i*(37 + 11*c)) % 2048;
+			int b = (i*(5 + c)) % 512;
+			int v = 6*(a < 1024 ? a - 512 : 1535 - a) + 20*(b < 256 ? b - 128 : 383 - b)
+				+ (int)(rng_next() % 2001) - 1000;
+			samples[i*channels + c] = (int16_t)v;
+		}
+	}
+}
+
+// Gradients, hard edges and noise in RGBA
+static void make_frame(uint8_t *rgba, int width, int height) {
+	rng_state = 2;
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			uint8_t *p = rgba + 4*(y*width + x);
+			int checker = (((x >> 5) ^ (y >> 5)) & 1) ? 64 : 0;
+			int noise = rng_next() % 32;
+			p[0] = (uint8_t)((x*255)/width/2 + checker + noise);
+			p[1] = (uint8_t)((y*255)/height/2 + noise);
+			p[2] = (uint8_t)(((x + y)*255)/(width + height)/2 + checker);
+			p[3] = 0xFF;
+		}
+	}
+}
+
+static void make_sector(uint8_t *sector) {
+	rng_state = 3;
+	for (int i = 0; i < 2352; i++) {
+		sector[i] = (uint8_t)rng_next();
+	}
+}
+
+//
+// ADPCM
+//
+
+#define SPU_SAMPLES (28*72)
+
+static int16_t audio_samples[4032*2 + 4032];
+static uint8_t audio_output[2352];
+
+static psx_audio_xa_settings_t xa_settings(bool stereo, int frequency) {
+	psx_audio_xa_settings_t settings;
+	settings.format = PSX_AUDIO_XA_FORMAT_XACD;
+	settings.stereo = stereo;
+	settings.frequency = frequency;
+	settings.bits_per_sample = 4;
+	settings.file_number = 0;
+	settings.channel_number = 0;
+	return settings;
+}
+
+// One 28-sample unit through psx_audio_spu_encode is one encode_nibbles
+// search over all five filters
+static void run_encode_nibbles(uint64_t iterations) {
+	psx_audio_encoder_state_t state;
+	memset(&state, 0, sizeof(state));
+	for (uint64_t i = 0; i < iterations; i++) {
+		psx_audio_spu_encode(&state, audio_samples + 28*(i % 72), 28, audio_output);
+	}
+	sink += audio_output[0];
+}
+
+static void run_xa_encode(uint64_t iterations, bool stereo, int frequency) {
+	psx_audio_xa_settings_t settings = xa_settings(stereo, frequency);
+	int samples = psx_audio_xa_get_samples_per_sector(settings);
+	psx_audio_encoder_state_t state;
+	memset(&state, 0, sizeof(state));
+	for (uint64_t i = 0; i < iterations; i++) {
+		psx_audio_xa_encode(settings, &state, audio_samples, samples, audio_output);
+	}
+	sink += audio_output[0x18];
+}
+
+static void run_xa_encode_stereo(uint64_t iterations) {
+	run_xa_encode(iterations, true, PSX_AUDIO_XA_FREQ_DOUBLE);
+}
+
+static void run_xa_encode_mono(uint64_t iterations) {
+	run_xa_encode(iterations, false, PSX_AUDIO_XA_FREQ_SINGLE);
+}
+
+static void run_spu_encode(uint64_t iterations) {
+	static uint8_t output[SPU_SAMPLES/28*16];
+	psx_audio_encoder_state_t state;
+	memset(&state, 0, sizeof(state));
+	for (uint64_t i = 0; i < iterations; i++) {
+		psx_audio_spu_encode(&state, audio_samples, SPU_SAMPLES, output);
+	}
+	sink += output[0];
+}
+
+//
+// CD-ROM sectors
+//
+
+static uint8_t sector[2352];
+
+static void run_edc_libpsxav_form1(uint64_t iterations) {
+	for (uint64_t i = 0; i < iterations; i++) {
+		psx_cdrom_calculate_checksums(sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM1);
+	}
+	sink += sector[0x818];
+}
+
+static void run_edc_libpsxav_form2(uint64_t iterations) {
+	for (uint64_t i = 0; i < iterations; i++) {
+		psx_cdrom_calculate_checksums(sector, PSX_CDROM_SECTOR_TYPE_MODE2_FORM2);
+	}
+	sink += sector[0x92C];
+}
+
+static void run_edc_psxavenc(uint64_t iterations) {
+	for (uint64_t i = 0; i < iterations; i++) {
+		calculate_edc_data(sector);
+	}
+	sink += sector[0x818];
+}
+
+static void run_edc_pscd_new(uint64_t iterations) {
+	for (uint64_t i = 0; i < iterations; i++) {
+		adjust_edc(sector + 0x010, 0x808);
+	}
+	sink += sector[0x818];
+}
+
+static void run_calc_p_parity(uint64_t iterations) {
+	for (uint64_t i = 0; i < iterations; i++) {
+		calc_p_parity(sector);
+	}
+	sink += sector[0x81C];
+}
+
+static void run_calc_q_parity(uint64_t iterations) {
+	for (uint64_t i = 0; i < iterations; i++) {
+		calc_q_parity(sector);
+	}
+	sink += sector[0x8C8];
+}
+
+//
+// MDEC
+//
+
+#define FRAME_WIDTH 320
+#define FRAME_HEIGHT 240
+#define FRAME_BLOCK_COUNT 8 // sectors per frame at 15 fps, rounded down
+
+static settings_t frame_settings;
+static int32_t dct_source[64*16];
+
+// Each call transforms a fresh copy, as the transform works in place
+static void run_transform_dct_block(uint64_t iterations) {
+	int32_t block[64];
+	for (uint64_t i = 0; i < iterations; i++) {
+		memcpy(block, dct_source + 64*(i % 16), sizeof(block));
+		bench_transform_dct_block(&(frame_settings.state_vid), block);
+	}
+	sink += block[0];
+}
+
+// A mix of code lengths like the one AC coefficients produce
+static const int encode_bits_lengths[8] = {2, 3, 4, 6, 8, 10, 12, 16};
+#define ENCODE_BITS_CALLS 1024
+#define ENCODE_BITS_PER_OP (ENCODE_BITS_CALLS/8*(2+3+4+6+8+10+12+16))
+
+static void run_encode_bits(uint64_t iterations) {
+	vid_encoder_state_t *state = &(frame_settings.state_vid);
+	for (uint64_t i = 0; i < iterations; i++) {
+		state->bytes_used = 0;
+		state->bits_left = 16;
+		state->bits_value = 0;
+		for (int j = 0; j < ENCODE_BITS_CALLS; j++) {
+			int bits = encode_bits_lengths[j & 7];
+			bench_encode_bits(state, bits, (j*0x9E3779B1u) & ((1u<<bits) - 1));
+		}
+		bench_flush_bits(state);
+	}
+	sink += state->unmuxed[0];
+}
+
+static void run_encode_frame_str(uint64_t iterations) {
+	for (uint64_t i = 0; i < iterations; i++) {
+		frame_settings.video_frame_count = 1;
+		frame_settings.state_vid.frame_index++;
+		bench_encode_frame_str(&frame_settings);
+	}
+	sink += frame_settings.state_vid.unmuxed[8];
+}
+
+static void setup(void) {
+	make_audio(audio_samples, 4032, 2);
+	make_sector(sector);
+	init_tables();
+	prepare_dct_data();
+
+	memset(&frame_settings, 0, sizeof(frame_settings));
+	frame_settings.video_width = FRAME_WIDTH;
+	frame_settings.video_height = FRAME_HEIGHT;
+	frame_settings.decoder_state_av.video_frame_dst_size = 4*FRAME_WIDTH*FRAME_HEIGHT;
+	frame_settings.video_frames = malloc(4*FRAME_WIDTH*FRAME_HEIGHT);
+	frame_settings.state_vid.frame_block_count = MAX_UNMUXED_BLOCKS;
+	make_frame(frame_settings.video_frames, FRAME_WIDTH, FRAME_HEIGHT);
+
+	// Level-shifted pixels of the synthetic frame's first rows
+	for (int i = 0; i < 64*16; i++) {
+		dct_source[i] = frame_settings.video_frames[4*i + 1] - 128;
+	}
+}
+
+static const benchmark_t benchmarks[] = {
+	{"encode_nibbles", run_encode_nibbles, 28*2, 0},
+	{"psx_audio_xa_encode.stereo", run_xa_encode_stereo, 2016*2*2, 1},
+	{"psx_audio_xa_encode.mono", run_xa_encode_mono, 4032*2, 1},
+	{"psx_audio_spu_encode", run_spu_encode, SPU_SAMPLES*2, 0},
+	{"edc.libpsxav.form1", run_edc_libpsxav_form1, 0x808, 1},
+	{"edc.libpsxav.form2", run_edc_libpsxav_form2, 0x91C, 1},
+	{"edc.psxavenc", run_edc_psxavenc, 0x808, 1},
+	{"edc.pscd-new", run_edc_pscd_new, 0x808, 1},
+	{"calc_p_parity", run_calc_p_parity, 43*2*24, 1},
+	{"calc_q_parity", run_calc_q_parity, 26*2*43, 1},
+	{"transform_dct_block", run_transform_dct_block, 64*sizeof(int32_t), 0},
+	{"encode_bits", run_encode_bits, ENCODE_BITS_PER_OP/8, 0},
+	{"encode_frame_str", run_encode_frame_str, 4*FRAME_WIDTH*FRAME_HEIGHT, FRAME_BLOCK_COUNT},
+};
+
+#define BENCHMARK_COUNT ((int)(sizeof(benchmarks)/sizeof(benchmarks[0])))
+
+//
+// Harness
+//
+
+static double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static double time_run(const benchmark_t *b, uint64_t iterations) {
+	double start = now_seconds();
+	b->run(iterations);
+	return now_seconds() - start;
+}
+
+// Returns the best ns/op and the iteration count it was measured over
+static double measure(const benchmark_t *b, double min_time, uint64_t *iterations) {
+	double run_time = min_time/REPEATS;
+	uint64_t n = 1;
+
+	// Warm up, then grow n until one run is long enough
+	b->run(1);
+	for (;;) {
+		double t = time_run(b, n);
+		if (t >= run_time) break;
+		n = (t > run_time/64) ? (uint64_t)(n*run_time*1.1/t) + 1 : n*8;
+	}
+
+	double best = INFINITY;
+	for (int i = 0; i < REPEATS; i++) {
+		double t = time_run(b, n)/n;
+		if (t < best) best = t;
+	}
+	*iterations = n;
+	return best*1e9;
+}
+
+// Reads back the "name"/"ns_per_op" pairs of an earlier run's output
+static int load_baseline(const char *filename, baseline_t *baseline, int max_count) {
+	char line[1024];
+	int count = 0;
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+
+	while (count < max_count && fgets(line, sizeof(line), fp) != NULL) {
+		const char *name = strstr(line, "\"name\": \"");
+		const char *ns = strstr(line, "\"ns_per_op\": ");
+		if (name == NULL || ns == NULL) continue;
+		if (sscanf(name + 9, "%63[^\"]", baseline[count].name) == 1
+			&& sscanf(ns + 13, "%lf", &(baseline[count].ns_per_op)) == 1) {
+			count++;
+		}
+	}
+
+	fclose(fp);
+	return count;
+}
+
+static const baseline_t *find_baseline(const baseline_t *baseline, int count, const char *name) {
+	for (int i = 0; i < count; i++) {
+		if (strcmp(baseline[i].name, name) == 0) return &baseline[i];
+	}
+	return NULL;
+}
+
+static void print_help(void) {
+	fprintf(stderr, "Usage: psxbench [-b baseline.json] [-t percent] [-m seconds] [-f filter] [-o out.json] [-l]\n\n");
+	fprintf(stderr, "    -b file          Compare with the JSON output of an earlier run\n");
+	fprintf(stderr, "    -t percent       Fail if any benchmark is this much slower than the baseline (default: 10)\n");
+	fprintf(stderr, "    -m seconds       Time spent measuring each benchmark (default: 0.5)\n");
+	fprintf(stderr, "    -f filter        Only run benchmarks whose name contains filter\n");
+	fprintf(stderr, "    -o file          Write the JSON results to file instead of stdout\n");
+	fprintf(stderr, "    -l               List the benchmarks and exit\n");
+}
+
+int main(int argc, char **argv) {
+	const char *baseline_name = NULL;
+	const char *output_name = NULL;
+	const char *filter = NULL;
+	double threshold = 10.0;
+	double min_time = 0.5;
+	baseline_t baseline[MAX_BENCHMARKS];
+	int baseline_count = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:t:m:f:o:lh")) != -1) {
+		switch (c) {
+			case 'b': {
+				baseline_name = optarg;
+			} break;
+			case 't': {
+				threshold = atof(optarg);
+				if (threshold <= 0.0) {
+					fprintf(stderr, "Invalid threshold: %s\n", optarg);
+					return 1;
+				}
+			} break;
+			case 'm': {
+				min_time = atof(optarg);
+				if (min_time <= 0.0) {
+					fprintf(stderr, "Invalid measuring time: %s\n", optarg);
+					return 1;
+				}
+			} break;
+			case 'f': {
+				filter = optarg;
+			} break;
+			case 'o': {
+				output_name = optarg;
+			} break;
+			case 'l': {
+				for (int i = 0; i < BENCHMARK_COUNT; i++) {
+					printf("%s\n", benchmarks[i].name);
+				}
+				return 0;
+			} break;
+			case '?':
+			case 'h': {
+				print_help();
+				return 1;
+			} break;
+		}
+	}
+
+	if (baseline_name != NULL) {
+		baseline_count = load_baseline(baseline_name, baseline, MAX_BENCHMARKS);
+		if (baseline_count < 0) {
+			fprintf(stderr, "Could not open baseline %s!\n", baseline_name);
+			return 1;
+		}
+	}
+
+	FILE *output = (output_name != NULL) ? fopen(output_name, "w") : stdout;
+	if (output == NULL) {
+		fprintf(stderr, "Could not open output file %s!\n", output_name);
+		return 1;
+	}
+
+	setup();
+
+	int regressions = 0;
+	bool first = true;
+	fprintf(output, "{\n");
+	fprintf(output, "\t\"version\": 1,\n");
+	fprintf(output, "\t\"threshold_percent\": %.1f,\n", threshold);
+	fprintf(output, "\t\"benchmarks\": [\n");
+	for (int i = 0; i < BENCHMARK_COUNT; i++) {
+		const benchmark_t *b = &benchmarks[i];
+		if (filter != NULL && strstr(b->name, filter) == NULL) continue;
+
+		uint64_t iterations;
+		double ns = measure(b, min_time, &iterations);
+		double mb_per_s = b->bytes_per_op/ns*1e9/(1024.0*1024.0);
+		double sectors_per_s = b->sectors_per_op/ns*1e9;
+
+		fprintf(stderr, "%-28s %12.1f ns/op %10.2f MB/s", b->name, ns, mb_per_s);
+		if (b->sectors_per_op > 0) {
+			fprintf(stderr, " %12.0f sectors/s", sectors_per_s);
+		} else {
+			fprintf(stderr, " %22s", "");
+		}
+
+		fprintf(output, "%s\t\t{\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.3f, \"mb_per_s\": %.3f, \"sectors_per_s\": ",
+			first ? "" : ",\n", b->name, (unsigned long long)iterations, ns, mb_per_s);
+		if (b->sectors_per_op > 0) {
+			fprintf(output, "%.1f", sectors_per_s);
+		} else {
+			fprintf(output, "null");
+		}
+		first = false;
+
+		const baseline_t *base = find_baseline(baseline, baseline_count, b->name);
+		if (base != NULL && base->ns_per_op > 0.0) {
+			double change = (ns - base->ns_per_op)/base->ns_per_op*100.0;
+			bool regressed = change > threshold;
+			fprintf(output, ", \"baseline_ns_per_op\": %.3f, \"change_percent\": %.2f, \"regressed\": %s",
+				base->ns_per_op, change, regressed ? "true" : "false");
+			fprintf(stderr, " %+7.1f%%%s", change, regressed ? " REGRESSION" : "");
+			if (regressed) regressions++;
+		} else if (baseline_name != NULL) {
+			fprintf(stderr, "   (not in baseline)");
+		}
+		fprintf(output, "}");
+		fprintf(stderr, "\n");
+	}
+	fprintf(output, "\n\t],\n");
+	fprintf(output, "\t\"regressions\": %d\n", regressions);
+	fprintf(output, "}\n");
+
+	if (output != stdout) {
+		fclose(output);
+	}
+	if (regressions > 0) {
+		fprintf(stderr, "%d benchmarks more than %.1f%% slower than %s\n", regressions, threshold, baseline_name);
+		return 1;
+	}
+	return 0;
+}
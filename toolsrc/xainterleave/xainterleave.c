@@ -20,10 +20,17 @@ freely, subject to the following restrictions:
 3. This notice may not be removed or altered from any source distribution.
 */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #define ENTRY_MAX 64
 
@@ -32,38 +39,178 @@ freely, subject to the following restrictions:
 #define TYPE_XA 2
 #define TYPE_XACD 3
 
+#define SECTOR_SIZE 2352
+#define XA_SECTOR_SIZE 2336
+
+// Each input is read in chunks this big; sectors are handed to the
+// output straight from these buffers without copying.
+#define READ_AHEAD_SIZE (1 << 20)
+#define NULL_RUN_SECTORS 64
+#define OUTPUT_IOV_MAX 512
+
+typedef struct {
+	int fd;
+	uint8_t *buffer;
+	size_t pos, len;
+	int eof;
+} reader_t;
+
 typedef struct {
 	int sectors, type;
 
-	FILE *file;
+	reader_t *reader;
+	char filename[257];
 
 	int xa_file;
 	int xa_channel;
+
+	// Scheduler mode (-s) only
+	char rate_str[65];
+	double rate; // sectors per second, for fixed-rate streams
+	double fps; // frames per second, for STR streams
+	int have_head;
+	int64_t release, deadline; // output slots the next sector must fall between
+	int64_t sent;
+	int64_t frame, frame_base;
+	int64_t min_slack;
 } entry_t;
 
+typedef struct {
+	int fd;
+	struct iovec iov[OUTPUT_IOV_MAX];
+	int iov_count;
+	uint64_t written;
+} writer_t;
+
 static entry_t entries[ENTRY_MAX];
+static writer_t output;
+
+static const uint8_t null_sectors[NULL_RUN_SECTORS * SECTOR_SIZE];
+static const uint8_t xa_header[16] = { [15] = 0x02 };
+
+static int open_input(const char *filename) {
+	if (strcmp(filename, "-") == 0) return STDIN_FILENO;
+	return open(filename, O_RDONLY);
+}
+
+static reader_t *reader_open(const char *filename) {
+	int fd = open_input(filename);
+	if (fd < 0) return NULL;
+
+	reader_t *r = calloc(1, sizeof(reader_t));
+	r->fd = fd;
+	r->buffer = malloc(READ_AHEAD_SIZE);
+	if (r->buffer == NULL) { close(fd); free(r); return NULL; }
+	return r;
+}
+
+static void output_flush(void) {
+	struct iovec *iov = output.iov;
+	int iov_count = output.iov_count;
+
+	while (iov_count > 0) {
+		ssize_t amt = writev(output.fd, iov, iov_count);
+		if (amt < 0) {
+			if (errno == EINTR) continue;
+			perror("writev");
+			exit(1);
+		}
+		output.written += amt;
+
+		// Pipes can take less than we asked for
+		while (iov_count > 0 && (size_t) amt >= iov->iov_len) {
+			amt -= iov->iov_len;
+			iov++; iov_count--;
+		}
+		if (iov_count > 0) {
+			iov->iov_base = (uint8_t*) iov->iov_base + amt;
+			iov->iov_len -= amt;
+		}
+	}
+
+	output.iov_count = 0;
+}
+
+static void output_add(const void *data, size_t len) {
+	if (output.iov_count > 0) {
+		// Null runs come out of one buffer, so merge them while they fit
+		struct iovec *last = &output.iov[output.iov_count - 1];
+		if (data == null_sectors && last->iov_base == null_sectors
+			&& last->iov_len + len <= sizeof(null_sectors)) {
+			last->iov_len += len;
+			return;
+		}
+	}
+
+	if (output.iov_count == OUTPUT_IOV_MAX) output_flush();
+	output.iov[output.iov_count].iov_base = (void*) data;
+	output.iov[output.iov_count].iov_len = len;
+	output.iov_count++;
+}
 
-int parse(char *filename) {
+// Returns a pointer to the next len bytes of the input, or NULL (and
+// sets eof) if there aren't that many left.
+static uint8_t *reader_fetch(reader_t *r, size_t len) {
+	if (r->eof) return NULL;
+
+	if (r->len - r->pos < len) {
+		// Pending output may still point into the buffer
+		output_flush();
+		memmove(r->buffer, r->buffer + r->pos, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos = 0;
+
+		while (r->len < len) {
+			ssize_t amt = read(r->fd, r->buffer + r->len, READ_AHEAD_SIZE - r->len);
+			if (amt < 0 && errno == EINTR) continue;
+			if (amt <= 0) break;
+			r->len += amt;
+		}
+
+		if (r->len < len) {
+			r->eof = 1;
+			return NULL;
+		}
+	}
+
+	uint8_t *data = r->buffer + r->pos;
+	r->pos += len;
+	return data;
+}
+
+// In scheduler mode the first column is a rate instead of a sector count.
+int parse(char *filename, int scheduled) {
 	entry_t e;
+	char count_str[65];
 	char type_str[65];
 	char fn_str[257];
 	int entry_count = 0;
 	FILE *file = fopen(filename, "r");
 	if (file == NULL) return 0;
 
-	while (fscanf(file, " %d %64s", &(e.sectors), type_str) > 0) {
+	while (fscanf(file, " %64s %64s", count_str, type_str) > 0) {
+		memset(&e, 0, sizeof(e));
+		if (scheduled) {
+			strcpy(e.rate_str, count_str);
+			e.sectors = 1;
+		} else {
+			e.sectors = atoi(count_str);
+		}
+
 		if (strcmp(type_str, "null") == 0) e.type = TYPE_NULL;
 		else if (strcmp(type_str, "raw") == 0) e.type = TYPE_RAW;
 		else if (strcmp(type_str, "xacd") == 0) e.type = TYPE_XACD;
 		else if (strcmp(type_str, "xa") == 0) e.type = TYPE_XA;
 		else { fprintf(stderr, "Unknown type: %s\n", type_str); continue; }
 
+		e.reader = NULL;
 		switch (e.type) {
 			case TYPE_RAW:
 			case TYPE_XA:
 			case TYPE_XACD:
 				if (fscanf(file, " %256s", fn_str) > 0) {
-					if ((e.file = fopen(fn_str, "rb")) == NULL) return 0;
+					if ((e.reader = reader_open(fn_str)) == NULL) return 0;
+					strcpy(e.filename, fn_str);
 				} else return 0;
 				break;
 		}
@@ -80,6 +227,11 @@ int parse(char *filename) {
 				break;
 		}
 
+		if (scheduled && e.type == TYPE_NULL) {
+			fprintf(stderr, "null entries make no sense with -s, ignoring\n");
+			continue;
+		}
+
 		entries[entry_count] = e;
 		entry_count++;
 	}
@@ -88,15 +240,221 @@ int parse(char *filename) {
 	return entry_count;
 }
 
+// Appends the next sector of e to the output, or returns 0 if it has run out.
+static int emit_sector(entry_t *e) {
+	uint8_t *buffer;
+	switch (e->type) {
+		case TYPE_RAW:
+			if ((buffer = reader_fetch(e->reader, SECTOR_SIZE)) == NULL) return 0;
+			output_add(buffer, SECTOR_SIZE);
+			return 1;
+		case TYPE_XA:
+		case TYPE_XACD: {
+			// xa inputs lack the first 0x10 bytes of the sector
+			int base = (e->type == TYPE_XA) ? 0x10 : 0;
+			if ((buffer = reader_fetch(e->reader, SECTOR_SIZE - base)) == NULL) return 0;
+			if (e->xa_file >= 0) buffer[0x010 - base] = buffer[0x014 - base] = e->xa_file;
+			if (e->xa_channel >= 0) buffer[0x011 - base] = buffer[0x015 - base] = e->xa_channel & 0x1F;
+			buffer[0x92F - base] = 0xFF; // make pscd-new generate EDC
+			if (base != 0) output_add(xa_header, sizeof(xa_header));
+			output_add(buffer, SECTOR_SIZE - base);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//
+// Scheduler mode
+//
+// Instead of a fixed pattern, every stream gets a rate, and each output
+// sector goes to whichever stream's next sector is due soonest
+// (earliest deadline first). Rates are given in the manifest's first
+// column as one of:
+//
+//   auto        XA audio, from the coding info in the first subheader
+//   auto@<fps>  STR video, deadlines taken from the frame numbers
+//   <number>    any stream, in sectors per second
+//
+// Fixed-rate streams get sector k in the window [k, k+1) * period, so
+// XA comes out evenly spaced. STR frame f has to arrive within
+// [f, f+1) / fps. The drive reads 75 sectors per second at 1x.
+//
+
+static uint8_t *reader_peek(reader_t *r, size_t len) {
+	uint8_t *data = reader_fetch(r, len);
+	if (data != NULL) r->pos -= len;
+	return data;
+}
+
+static int sched_setup(entry_t *e) {
+	int base = (e->type == TYPE_XA) ? 0x10 : 0;
+
+	if (strncmp(e->rate_str, "auto@", 5) == 0) {
+		e->fps = strtod(e->rate_str + 5, NULL);
+		if (e->fps <= 0.0) {
+			fprintf(stderr, "%s: bad frame rate \"%s\"\n", e->filename, e->rate_str);
+			return 0;
+		}
+	} else if (strcmp(e->rate_str, "auto") == 0) {
+		uint8_t *sector = (e->type == TYPE_RAW) ? NULL : reader_peek(e->reader, SECTOR_SIZE - base);
+		if (sector == NULL) {
+			fprintf(stderr, "%s: auto needs an XA stream (use auto@<fps> for STR)\n", e->filename);
+			return 0;
+		}
+
+		int coding = sector[0x013 - base];
+		int freq = (coding & 0x04) ? 18900 : 37800;
+		int stereo = (coding & 0x01) ? 2 : 1;
+		int samples = (coding & 0x10) ? (18 * 4 * 28) : (18 * 8 * 28);
+		e->rate = (double) freq * stereo / samples;
+	} else {
+		e->rate = strtod(e->rate_str, NULL);
+		if (e->rate <= 0.0) {
+			fprintf(stderr, "%s: bad rate \"%s\"\n", e->filename, e->rate_str);
+			return 0;
+		}
+	}
+
+	e->min_slack = INT64_MAX;
+	e->frame_base = -1;
+	return 1;
+}
+
+// Works out the window for e's next sector. Returns 0 if there isn't one.
+static int sched_head(entry_t *e, double slots_per_sec) {
+	if (e->have_head) return 1;
+
+	int base = (e->type == TYPE_XA) ? 0x10 : 0;
+	uint8_t *sector = reader_peek(e->reader, SECTOR_SIZE - base);
+	if (sector == NULL) return 0;
+
+	if (e->fps > 0.0) {
+		// Video sectors start with 60 01 01 80; anything else (e.g.
+		// audio) rides along with the frame before it
+		uint8_t *data = sector + 0x018 - base;
+		if (data[0] == 0x60 && data[1] == 0x01 && data[2] == 0x01 && data[3] == 0x80) {
+			int64_t frame = data[8] | (data[9] << 8) | (data[10] << 16) | ((int64_t) data[11] << 24);
+			if (e->frame_base < 0) e->frame_base = frame;
+			e->frame = frame - e->frame_base;
+		}
+		e->release = (int64_t) (e->frame * slots_per_sec / e->fps);
+		e->deadline = (int64_t) ((e->frame + 1) * slots_per_sec / e->fps) - 1;
+	} else {
+		e->release = (int64_t) (e->sent * slots_per_sec / e->rate);
+		e->deadline = (int64_t) ((e->sent + 1) * slots_per_sec / e->rate) - 1;
+	}
+	if (e->deadline < e->release) e->deadline = e->release;
+
+	e->have_head = 1;
+	return 1;
+}
+
+static int run_scheduler(int entry_count, int speed) {
+	double slots_per_sec = 75.0 * speed;
+	double fixed_rate = 0.0;
+
+	for (int i = 0; i < entry_count; i++) {
+		if (!sched_setup(&entries[i])) return 1;
+		fixed_rate += entries[i].rate;
+	}
+	if (fixed_rate > slots_per_sec) {
+		fprintf(stderr, "Streams need %.2f sectors/s, the drive only reads %.0f at %dx\n",
+			fixed_rate, slots_per_sec, speed);
+		return 1;
+	}
+
+	int64_t slot = 0;
+	int64_t nulls = 0;
+	while (1) {
+		entry_t *best = NULL;
+		int active = 0;
+
+		for (int i = 0; i < entry_count; i++) {
+			entry_t *e = &entries[i];
+			if (!sched_head(e, slots_per_sec)) continue;
+			active++;
+
+			if (e->deadline < slot) {
+				fprintf(stderr, "%s: sector %" PRId64 " missed its deadline (sector %" PRId64 " of output, due by %" PRId64 ")\n",
+					e->filename, e->sent, slot, e->deadline);
+				fprintf(stderr, "Too much data for %dx speed\n", speed);
+				return 1;
+			}
+			if (e->release > slot) continue;
+			if (best == NULL || e->deadline < best->deadline) best = e;
+		}
+		if (active == 0) break;
+
+		if (best != NULL) {
+			if (best->deadline - slot < best->min_slack) best->min_slack = best->deadline - slot;
+			emit_sector(best);
+			best->sent++;
+			best->have_head = 0;
+		} else {
+			output_add(null_sectors, SECTOR_SIZE);
+			nulls++;
+		}
+		slot++;
+	}
+
+	fprintf(stderr, "Scheduled %" PRId64 " sectors at %dx, %" PRId64 " null (%.1f%% bandwidth unused)\n",
+		slot, speed, nulls, slot > 0 ? 100.0 * nulls / slot : 0.0);
+	for (int i = 0; i < entry_count; i++) {
+		entry_t *e = &entries[i];
+		if (e->sent == 0) continue;
+		fprintf(stderr, "  %s: %" PRId64 " sectors, %.2f sectors/s, worst-case slack %" PRId64 " sectors (%.1f ms)\n",
+			e->filename, e->sent, e->sent * slots_per_sec / slot,
+			e->min_slack, e->min_slack * 1000.0 / slots_per_sec);
+	}
+	return 0;
+}
+
+// Works out the output size up front if every input is a regular file,
+// returning 0 otherwise. The last round is always all null sectors, as
+// an input only counts as finished once a read from it has failed.
+static off_t predict_size(int entry_count, int sector_div) {
+	int64_t rounds = 0;
+	for (int i = 0; i < entry_count; i++) {
+		entry_t *e = &entries[i];
+		struct stat st;
+		if (e->reader == NULL) continue;
+		if (fstat(e->reader->fd, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+
+		int64_t n = st.st_size / (e->type == TYPE_XA ? XA_SECTOR_SIZE : SECTOR_SIZE);
+		if (n / e->sectors + 1 > rounds) rounds = n / e->sectors + 1;
+	}
+	return (off_t) rounds * sector_div * SECTOR_SIZE;
+}
+
 int main(int argc, char** argv) {
-	uint8_t buffer[2352];
+	int speed = 0;
+	int c;
+	while ((c = getopt(argc, argv, "s:")) != -1) {
+		switch (c) {
+			case 's':
+				speed = atoi(optarg);
+				if (speed != 1 && speed != 2) {
+					fprintf(stderr, "Drive speed must be 1 or 2\n");
+					return 1;
+				}
+				break;
+			default:
+				return 1;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc < 3) {
-		fprintf(stderr, "Usage: xainterleave <in.txt> <out.raw>\n");
+		fprintf(stderr, "Usage: xainterleave [-s speed] <in.txt> <out.raw>\n");
+		fprintf(stderr, "Use - for stdin (as one of the inputs) or stdout.\n");
+		fprintf(stderr, "With -s, the manifest gives rates instead of sector counts\n");
+		fprintf(stderr, "and the interleave is worked out for the given drive speed.\n");
 		return 1;
 	}
 
-	int entry_count = parse(argv[1]);
+	int entry_count = parse(argv[1], speed != 0);
 	if (entry_count <= 0) {
 		fprintf(stderr, "Empty manifest?\n");
 		return 1;
@@ -106,16 +464,34 @@ int main(int argc, char** argv) {
 	for (int i = 0; i < entry_count; i++) {
 		sector_div += entries[i].sectors;
 	}
-	printf("Interleaving into %d-sector chunks\n", sector_div);
+	if (speed == 0) fprintf(stderr, "Interleaving into %d-sector chunks\n", sector_div);
 
-	FILE *output = fopen(argv[2], "wb");
+	if (strcmp(argv[2], "-") == 0) {
+		output.fd = STDOUT_FILENO;
+	} else {
+		output.fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (output.fd < 0) {
+			perror(argv[2]);
+			return 1;
+		}
+
+		off_t size = (speed == 0) ? predict_size(entry_count, sector_div) : 0;
+		if (size > 0) posix_fallocate(output.fd, 0, size);
+	}
+
+	if (speed != 0) {
+		int result = run_scheduler(entry_count, speed);
+		output_flush();
+		close(output.fd);
+		return result;
+	}
 
 	while (1) {
 		int can_read = 0;
 		for (int i = 0; i < entry_count; i++) {
 			entry_t *e = &entries[i];
-			if (e->file != NULL) {
-				if (!feof(e->file)) can_read++;
+			if (e->reader != NULL) {
+				if (!e->reader->eof) can_read++;
 			}
 		}
 		if (can_read <= 0) break;
@@ -123,37 +499,16 @@ int main(int argc, char** argv) {
 		for (int i = 0; i < entry_count; i++) {
 			entry_t *e = &entries[i];
 			for (int is = 0; is < e->sectors; is++) {
-				int write_null = 0;
-				switch (e->type) {
-					case TYPE_NULL:
-						write_null = 1;
-						break;
-					case TYPE_RAW:
-						if (!fread(buffer, 2352, 1, e->file)) { write_null = 1; break; }
-						fwrite(buffer, 2352, 1, output);
-						break;
-					case TYPE_XA:
-					case TYPE_XACD:
-						if (e->type == TYPE_XACD) {
-							if (!fread(buffer, 2352, 1, e->file)) { write_null = 1; break; }
-						} else {
-							if (!fread(buffer + 0x10, 2336, 1, e->file)) { write_null = 1; break; }
-							memset(buffer, 0, 15);
-							buffer[15] = 0x02;
-						}
-						if (e->xa_file >= 0) buffer[0x010] = buffer[0x014] = e->xa_file;
-						if (e->xa_channel >= 0) buffer[0x011] = buffer[0x015] = e->xa_channel & 0x1F;
-						buffer[0x92F] = 0xFF; // make pscd-new generate EDC
-						fwrite(buffer, 2352, 1, output); break;
-				}
-
-				if (write_null) {
-					for (int j = 0; j < 2352; j++) fputc(0, output);
-				}
+				if (e->type != TYPE_NULL && emit_sector(e)) continue;
+				output_add(null_sectors, SECTOR_SIZE);
 			}
 		}
 	}
 
-	fclose(output);
+	output_flush();
+	if (output.fd != STDOUT_FILENO && close(output.fd) != 0) {
+		perror(argv[2]);
+		return 1;
+	}
 	return 0;
 }